@@ -1,11 +1,24 @@
 #pragma once
 
-#include <GLFW/glfw3.h>
+#include "window.h"
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <math.h>
 
+struct CameraConstants {
+	glm::mat4 inverseView;
+	glm::mat4 inverseProj;
+
+	//Same projection the raygen shader expects, shared by the gpu and cpu paths
+	static CameraConstants create(glm::mat4 view, float aspectRatio) {
+		CameraConstants camCons{};
+		camCons.inverseView = glm::inverse(view);
+		camCons.inverseProj = glm::inverse(glm::perspective(glm::radians(45.0f), aspectRatio, 0.1f, 100.0f));
+		return camCons;
+	}
+};
+
 class Camera {
 private:
 
@@ -25,6 +38,7 @@ private:
 	bool firstMouse;
 
 	void TakeInput(float deltaTime, GLFWwindow* window) {
+#ifndef HEADLESS_ONLY
 		float cameraSpeed = 10.0f * deltaTime;
 
 		if (glfwGetKey(window, GLFW_KEY_ESCAPE)) glfwSetWindowShouldClose(window, true);
@@ -34,6 +48,7 @@ private:
 
 		if (glfwGetKey(window, GLFW_KEY_D)) cameraPos += cameraSpeed * cameraRight;
 		if (glfwGetKey(window, GLFW_KEY_A)) cameraPos -= cameraSpeed * cameraRight;
+#endif
 	}
 
 
@@ -96,4 +111,6 @@ public:
 	}
 
 	inline glm::vec3 worldPos() { return cameraPos; }
-};
\ No newline at end of file
+	inline void setPosition(glm::vec3 pos) { cameraPos = pos; }
+	inline glm::mat4 viewMatrix() { return glm::lookAt(cameraPos, cameraFront + cameraPos, cameraUp); }
+};
\ No newline at end of file
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+
+//Layout shared by the brick map builder, the cpu traversal and the shaders
+const int BRICK_SIZE = 8;
+const int BRICK_VOXELS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+const int BRICK_WORDS = BRICK_VOXELS / 32;
+const int BRICK_COLOUR_WORDS = BRICK_VOXELS / 4;
+const uint32_t EMPTY_BRICK = 0xFFFFFFFFu;
+
+inline int brickBit(int x, int y, int z) { return x * BRICK_SIZE * BRICK_SIZE + y * BRICK_SIZE + z; }
+
+//1 bit per voxel, what the traversal reads
+inline void setOccupied(uint32_t* mask, int bit) { mask[bit >> 5] |= 1u << (bit & 31); }
+inline bool isOccupied(const uint32_t* mask, int bit) { return (mask[bit >> 5] >> (bit & 31)) & 1u; }
+
+//8 bit palette indices, 4 to a uint. Only read once a hit has been found
+inline void setPaletteIndex(uint32_t* colours, int bit, uint8_t index) {
+    int shift = (bit & 3) * 8;
+    colours[bit >> 2] = (colours[bit >> 2] & ~(0xFFu << shift)) | ((uint32_t)index << shift);
+}
+inline uint8_t getPaletteIndex(const uint32_t* colours, int bit) { return (colours[bit >> 2] >> ((bit & 3) * 8)) & 0xFFu; }
+
+//Hit attribute passed from the intersection shader to the closest hit shader
+inline uint32_t packHitVoxel(uint32_t brick, int bit) { return (brick << 9) | (uint32_t)bit; }
+inline uint32_t hitVoxelBrick(uint32_t hitVoxel) { return hitVoxel >> 9; }
+inline int hitVoxelBit(uint32_t hitVoxel) { return (int)(hitVoxel & 511u); }
\ No newline at end of file
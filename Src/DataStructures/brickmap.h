@@ -0,0 +1,115 @@
+#pragma once
+
+#include "brick.h"
+#include "grid.h"
+#include "../buffer.h"
+#include <vulkan/vulkan_core.h>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+//Coarse grid of indices in to a pool of 8^3 bricks, each brick is a 512 bit occupancy mask. Air only costs an EMPTY_BRICK index.
+//data is exactly what goes to binding 3: bricksPerAxis^3 indices followed by BRICK_WORDS uints per brick.
+//The 8 bit palette indices live in colours (binding 4, BRICK_COLOUR_WORDS per brick) so the traversal never pulls them in to cache
+class BrickMap {
+    public:
+
+    vector<uint32_t> data;
+    vector<uint32_t> colours;
+    int bricksPerAxis = 0;
+    uint32_t brickCount = 0;
+
+    Buffer buf;
+    Buffer colourBuf;
+
+    //voxelAt returns the palette index at a voxel, 0 being air
+    void build(int size, const function<int(int, int, int)>& voxelAt) {
+        bricksPerAxis = (size + BRICK_SIZE - 1) / BRICK_SIZE;
+        brickCount = 0;
+
+        const uint32_t topCount = bricksPerAxis * bricksPerAxis * bricksPerAxis;
+
+        data.assign(topCount, EMPTY_BRICK);
+        colours.clear();
+
+        vector<uint32_t> mask(BRICK_WORDS);
+        vector<uint32_t> brickColours(BRICK_COLOUR_WORDS);
+
+        for(int bx = 0; bx < bricksPerAxis; bx++) {
+            for(int by = 0; by < bricksPerAxis; by++) {
+                for(int bz = 0; bz < bricksPerAxis; bz++) {
+                    fill(mask.begin(), mask.end(), 0u);
+                    fill(brickColours.begin(), brickColours.end(), 0u);
+                    bool empty = true;
+
+                    for(int x = 0; x < BRICK_SIZE; x++) {
+                        for(int y = 0; y < BRICK_SIZE; y++) {
+                            for(int z = 0; z < BRICK_SIZE; z++) {
+                                int vx = bx * BRICK_SIZE + x, vy = by * BRICK_SIZE + y, vz = bz * BRICK_SIZE + z;
+                                if(vx >= size || vy >= size || vz >= size) continue;
+
+                                int colour = voxelAt(vx, vy, vz);
+                                if(colour == 0) continue;
+
+                                int bit = brickBit(x, y, z);
+                                setOccupied(mask.data(), bit);
+                                setPaletteIndex(brickColours.data(), bit, (uint8_t)colour);
+                                empty = false;
+                            }
+                        }
+                    }
+
+                    if(empty) continue;
+
+                    data[topIndex(bx, by, bz)] = brickCount++;
+                    data.insert(data.end(), mask.begin(), mask.end());
+                    colours.insert(colours.end(), brickColours.begin(), brickColours.end());
+                }
+            }
+        }
+    }
+
+    template<int Dim, typename VoxelT>
+    void build(const Grid<Dim, VoxelT>& grid) {
+        build(Dim, [&grid](int x, int y, int z) { return grid.get(x, y, z).colour; });
+    }
+
+    bool isSolid(int x, int y, int z) const {
+        uint32_t brick = data[topIndex(x / BRICK_SIZE, y / BRICK_SIZE, z / BRICK_SIZE)];
+        if(brick == EMPTY_BRICK) return false;
+
+        return isOccupied(&data[brickOffset(brick)], brickBit(x % BRICK_SIZE, y % BRICK_SIZE, z % BRICK_SIZE));
+    }
+
+    uint8_t paletteIndex(int x, int y, int z) const {
+        uint32_t brick = data[topIndex(x / BRICK_SIZE, y / BRICK_SIZE, z / BRICK_SIZE)];
+        if(brick == EMPTY_BRICK) return 0;
+
+        return getPaletteIndex(&colours[(size_t)brick * BRICK_COLOUR_WORDS], brickBit(x % BRICK_SIZE, y % BRICK_SIZE, z % BRICK_SIZE));
+    }
+
+    size_t bytes() const { return data.size() * sizeof(uint32_t); }
+    size_t colourBytes() const { return colours.size() * sizeof(uint32_t); }
+
+    void createBuffer(VkDevice device, VkPhysicalDevice physicalDevice, VkCommandPool transferPool, VkQueue transferQueue) {
+        buf.createBuffer(device, physicalDevice, bytes(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+        buf.populateBuffer(device, physicalDevice, data.data(), bytes(), transferPool, transferQueue);
+
+        //An empty world still needs something bound at binding 4
+        vector<uint32_t> colourData = colours.empty() ? vector<uint32_t>(1, 0u) : colours;
+        colourBuf.createBuffer(device, physicalDevice, colourData.size() * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+        colourBuf.populateBuffer(device, physicalDevice, colourData.data(), colourData.size() * sizeof(uint32_t), transferPool, transferQueue);
+    }
+
+    void destroy(VkDevice device) {
+        buf.destroy(device);
+        colourBuf.destroy(device);
+    }
+
+    private:
+
+    uint32_t topIndex(int bx, int by, int bz) const { return (bx * bricksPerAxis + by) * bricksPerAxis + bz; }
+    size_t brickOffset(uint32_t brick) const { return (size_t)bricksPerAxis * bricksPerAxis * bricksPerAxis + (size_t)brick * BRICK_WORDS; }
+};
@@ -0,0 +1,362 @@
+#pragma once
+
+#include "voxelBoxes.h"
+#include "../RayTracing/gridTraversal.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+//Flattened node, 32 bytes so two share a cache line. Interior nodes have count 0, their left child is the next node and leftOrFirst is the right child.
+//Leaves have count boxes starting at leftOrFirst in BoxBVH::boxes
+struct BVHNode {
+    glm::vec3 bMin;
+    uint32_t leftOrFirst;
+    glm::vec3 bMax;
+    uint32_t count;
+};
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode has to stay 32 bytes");
+
+struct BVHStats {
+    double buildMilliseconds;
+    uint32_t primitiveCount;
+    uint32_t nodeCount;
+    uint32_t leafCount;
+    uint32_t maxDepth;
+    double sahCost; //Expected cost of a ray that hits the root, in units of one box test
+    size_t bytes;
+
+    vector<uint32_t> depthHistogram; //Leaves at each depth
+    vector<uint32_t> leafSizeHistogram; //Leaves holding each number of boxes
+
+    double averageLeafSize() const { return leafCount ? (double)primitiveCount / leafCount : 0.0; }
+};
+
+//Binned SAH bvh over the merged boxes of a grid, built and traversed on the cpu. It is what the driver builds for a VK_GEOMETRY_TYPE_AABBS_KHR blas,
+//only here the tree is ours, so it works without a gpu and its quality can be measured. Subtrees past a size get their own thread
+class BoxBVH {
+    public:
+
+    static const int BIN_COUNT = 16;
+    static const uint32_t MAX_LEAF_SIZE = 8;
+
+    //Relative cost of visiting a node against testing one box
+    static constexpr float TRAVERSAL_COST = 1.0f;
+    static constexpr float INTERSECTION_COST = 1.0f;
+
+    vector<BVHNode> nodes;
+    vector<VoxelBox> boxes; //In leaf order
+    vector<uint32_t> boxIds; //Index in to the list build was given, per entry of boxes
+    BVHStats stats{};
+
+    void build(const vector<VoxelBox>& input) {
+        auto start = chrono::high_resolution_clock::now();
+
+        nodes.clear();
+        boxes.clear();
+        boxIds.clear();
+        stats = {};
+        stats.primitiveCount = (uint32_t)input.size();
+
+        if(!input.empty()) {
+            order.resize(input.size());
+            centroids.resize(input.size());
+            for(uint32_t i = 0; i < input.size(); i++) {
+                order[i] = i;
+                centroids[i] = glm::vec3(input[i].min + input[i].max) * 0.5f;
+            }
+
+            source = &input;
+
+            uint32_t spawnDepth = 0;
+            while((1u << spawnDepth) < max(1u, thread::hardware_concurrency())) spawnDepth++;
+
+            BuildNode root;
+            buildNode(root, 0, (uint32_t)input.size(), 0, spawnDepth);
+
+            nodes.reserve(countNodes(root));
+            boxes.reserve(input.size());
+            boxIds.reserve(input.size());
+
+            float rootArea = surfaceArea(root.bMin, root.bMax);
+            flatten(root, 0, rootArea);
+
+            source = nullptr;
+            order.clear();
+            centroids.clear();
+        }
+
+        auto end = chrono::high_resolution_clock::now();
+
+        stats.buildMilliseconds = chrono::duration<double, milli>(end - start).count();
+        stats.nodeCount = (uint32_t)nodes.size();
+        stats.bytes = nodes.size() * sizeof(BVHNode) + boxes.size() * sizeof(VoxelBox);
+    }
+
+    void build(const VoxelBoxes& voxelBoxes) { build(voxelBoxes.boxes); }
+
+    //Nearest box hit in unit voxel space, same hits as testing every box with GridTraversal::solidBoxIntersection. hitBox is the index build was given
+    float traverse(glm::vec3 origin, glm::vec3 direction, uint32_t* hitBox = nullptr, glm::ivec3* hitCell = nullptr) const {
+        if(nodes.empty()) return -1.0f;
+
+        glm::vec3 invDir = 1.0f / GridTraversal::safeDirection(direction);
+
+        struct Entry { uint32_t node; float tNear; };
+        Entry stack[STACK_SIZE];
+        int top = 0;
+
+        float tNear;
+        if(!slabs(nodes[0], origin, invDir, tNear)) return -1.0f;
+        stack[top++] = {0, tNear};
+
+        float closest = -1.0f;
+
+        while(top > 0) {
+            Entry e = stack[--top];
+            if(closest > 0.0f && e.tNear > closest) continue;
+
+            const BVHNode& node = nodes[e.node];
+
+            if(node.count > 0) {
+                for(uint32_t i = node.leftOrFirst; i < node.leftOrFirst + node.count; i++) {
+                    glm::ivec3 cell;
+                    float t = GridTraversal::solidBoxIntersection(boxes[i].min, boxes[i].max, origin, direction, &cell);
+                    if(t > 0.0f && (closest < 0.0f || t < closest)) {
+                        closest = t;
+                        if(hitBox) *hitBox = boxIds[i];
+                        if(hitCell) *hitCell = cell;
+                    }
+                }
+                continue;
+            }
+
+            uint32_t near = e.node + 1;
+            uint32_t far = node.leftOrFirst;
+            float tNearChild, tFarChild;
+            bool hitNear = slabs(nodes[near], origin, invDir, tNearChild);
+            bool hitFar = slabs(nodes[far], origin, invDir, tFarChild);
+
+            if(hitNear && hitFar && tFarChild < tNearChild) {
+                swap(near, far);
+                swap(tNearChild, tFarChild);
+            }
+
+            //Far first so the near child is popped first
+            if(hitFar) stack[top++] = {far, tFarChild};
+            if(hitNear) stack[top++] = {near, tNearChild};
+        }
+
+        return closest;
+    }
+
+    private:
+
+    //Past this depth splits stop looking at cost and halve the boxes, which bounds the depth and so the traversal stack
+    static const uint32_t SAH_DEPTH_LIMIT = 64;
+    static const int STACK_SIZE = 128;
+
+    //A subtree with fewer boxes than this is built on the thread that reached it
+    static const uint32_t PARALLEL_THRESHOLD = 4096;
+
+    struct BuildNode {
+        glm::vec3 bMin;
+        glm::vec3 bMax;
+        uint32_t first;
+        uint32_t count;
+        unique_ptr<BuildNode> children[2];
+    };
+
+    struct Bin {
+        glm::vec3 bMin = glm::vec3(numeric_limits<float>::max());
+        glm::vec3 bMax = glm::vec3(-numeric_limits<float>::max());
+        uint32_t count = 0;
+
+        void grow(glm::vec3 otherMin, glm::vec3 otherMax) {
+            bMin = glm::min(bMin, otherMin);
+            bMax = glm::max(bMax, otherMax);
+        }
+    };
+
+    //Only alive during build. Threads partition disjoint ranges of order, so they never touch the same entries
+    const vector<VoxelBox>* source = nullptr;
+    vector<uint32_t> order;
+    vector<glm::vec3> centroids;
+
+    static float surfaceArea(glm::vec3 bMin, glm::vec3 bMax) {
+        glm::vec3 e = glm::max(bMax - bMin, glm::vec3(0.0f));
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+
+    //Same slab test as the leaves, a node holds the union of its boxes so it is never missed where one of them is hit
+    static bool slabs(const BVHNode& node, glm::vec3 origin, glm::vec3 invDir, float& tNear) {
+        glm::vec3 t0 = (node.bMin - origin) * invDir;
+        glm::vec3 t1 = (node.bMax - origin) * invDir;
+
+        glm::vec3 tmin = glm::min(t0, t1);
+        glm::vec3 tmax = glm::max(t0, t1);
+
+        tNear = std::max(std::max(tmin.x, tmin.y), tmin.z);
+        float tFar = std::min(std::min(tmax.x, tmax.y), tmax.z);
+
+        return tFar >= std::max(tNear, 0.0f);
+    }
+
+    void buildNode(BuildNode& node, uint32_t first, uint32_t count, uint32_t depth, uint32_t spawnDepth) {
+        node.first = first;
+        node.count = count;
+
+        Bin bounds, centroidBounds;
+        for(uint32_t i = first; i < first + count; i++) {
+            const VoxelBox& box = (*source)[order[i]];
+            bounds.grow(glm::vec3(box.min), glm::vec3(box.max));
+            centroidBounds.grow(centroids[order[i]], centroids[order[i]]);
+        }
+        node.bMin = bounds.bMin;
+        node.bMax = bounds.bMax;
+
+        if(count == 1) return;
+
+        int bestAxis = -1;
+        int bestSplit = 0;
+        float bestCost = numeric_limits<float>::max();
+
+        if(depth < SAH_DEPTH_LIMIT) findSplit(first, count, surfaceArea(node.bMin, node.bMax), centroidBounds, bestAxis, bestSplit, bestCost);
+
+        float leafCost = INTERSECTION_COST * count;
+        if(count <= MAX_LEAF_SIZE && (bestAxis < 0 || bestCost >= leafCost)) return;
+
+        uint32_t mid = first + count / 2;
+
+        if(bestAxis >= 0) {
+            float cMin = centroidBounds.bMin[bestAxis];
+            float scale = BIN_COUNT / (centroidBounds.bMax[bestAxis] - cMin);
+
+            auto split = partition(order.begin() + first, order.begin() + first + count, [&](uint32_t i) {
+                return binIndex(centroids[i][bestAxis], cMin, scale) <= bestSplit;
+            });
+            mid = (uint32_t)(split - order.begin());
+        }
+
+        //Every centroid in the same place, or past the depth limit. Halve along the widest axis
+        if(bestAxis < 0 || mid == first || mid == first + count) {
+            glm::vec3 extent = centroidBounds.bMax - centroidBounds.bMin;
+            int axis = extent.x > extent.y && extent.x > extent.z ? 0 : (extent.y > extent.z ? 1 : 2);
+
+            mid = first + count / 2;
+            nth_element(order.begin() + first, order.begin() + mid, order.begin() + first + count, [&](uint32_t a, uint32_t b) {
+                return centroids[a][axis] < centroids[b][axis];
+            });
+        }
+
+        node.children[0] = make_unique<BuildNode>();
+        node.children[1] = make_unique<BuildNode>();
+
+        if(count >= PARALLEL_THRESHOLD && depth < spawnDepth) {
+            thread left([&]() { buildNode(*node.children[0], first, mid - first, depth + 1, spawnDepth); });
+            buildNode(*node.children[1], mid, first + count - mid, depth + 1, spawnDepth);
+            left.join();
+        }
+        else {
+            buildNode(*node.children[0], first, mid - first, depth + 1, spawnDepth);
+            buildNode(*node.children[1], mid, first + count - mid, depth + 1, spawnDepth);
+        }
+    }
+
+    static int binIndex(float centroid, float cMin, float scale) {
+        return std::min(BIN_COUNT - 1, (int)((centroid - cMin) * scale));
+    }
+
+    //Bins the centroids along each axis and sweeps the planes between bins. The split puts bins [0, split] on the left
+    void findSplit(uint32_t first, uint32_t count, float area, const Bin& centroidBounds, int& bestAxis, int& bestSplit, float& bestCost) const {
+        for(int axis = 0; axis < 3; axis++) {
+            float cMin = centroidBounds.bMin[axis];
+            float extent = centroidBounds.bMax[axis] - cMin;
+            if(extent <= 0.0f) continue;
+
+            float scale = BIN_COUNT / extent;
+            Bin bins[BIN_COUNT];
+
+            for(uint32_t i = first; i < first + count; i++) {
+                const VoxelBox& box = (*source)[order[i]];
+                Bin& bin = bins[binIndex(centroids[order[i]][axis], cMin, scale)];
+                bin.grow(glm::vec3(box.min), glm::vec3(box.max));
+                bin.count++;
+            }
+
+            float rightArea[BIN_COUNT];
+            uint32_t rightCount[BIN_COUNT];
+            Bin right;
+            uint32_t rightTotal = 0;
+            for(int b = BIN_COUNT - 1; b > 0; b--) {
+                if(bins[b].count) right.grow(bins[b].bMin, bins[b].bMax);
+                rightTotal += bins[b].count;
+                rightArea[b] = rightTotal ? surfaceArea(right.bMin, right.bMax) : 0.0f;
+                rightCount[b] = rightTotal;
+            }
+
+            Bin left;
+            uint32_t leftTotal = 0;
+            for(int b = 0; b < BIN_COUNT - 1; b++) {
+                if(bins[b].count) left.grow(bins[b].bMin, bins[b].bMax);
+                leftTotal += bins[b].count;
+                if(leftTotal == 0 || rightCount[b + 1] == 0) continue;
+
+                float cost = TRAVERSAL_COST + INTERSECTION_COST * (leftTotal * surfaceArea(left.bMin, left.bMax) + rightCount[b + 1] * rightArea[b + 1]) / area;
+                if(cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = b;
+                }
+            }
+        }
+    }
+
+    static uint32_t countNodes(const BuildNode& node) {
+        if(!node.children[0]) return 1;
+        return 1 + countNodes(*node.children[0]) + countNodes(*node.children[1]);
+    }
+
+    //Depth first, so a left child always directly follows its parent
+    uint32_t flatten(const BuildNode& node, uint32_t depth, float rootArea) {
+        uint32_t index = (uint32_t)nodes.size();
+        nodes.push_back({node.bMin, 0, node.bMax, 0});
+
+        float areaRatio = rootArea > 0.0f ? surfaceArea(node.bMin, node.bMax) / rootArea : 1.0f;
+        stats.maxDepth = max(stats.maxDepth, depth);
+
+        if(!node.children[0]) {
+            nodes[index].leftOrFirst = (uint32_t)boxes.size();
+            nodes[index].count = node.count;
+
+            for(uint32_t i = node.first; i < node.first + node.count; i++) {
+                boxes.push_back((*source)[order[i]]);
+                boxIds.push_back(order[i]);
+            }
+
+            stats.leafCount++;
+            stats.sahCost += areaRatio * INTERSECTION_COST * node.count;
+
+            if(stats.depthHistogram.size() <= depth) stats.depthHistogram.resize(depth + 1, 0);
+            stats.depthHistogram[depth]++;
+            if(stats.leafSizeHistogram.size() <= node.count) stats.leafSizeHistogram.resize(node.count + 1, 0);
+            stats.leafSizeHistogram[node.count]++;
+
+            return index;
+        }
+
+        stats.sahCost += areaRatio * TRAVERSAL_COST;
+
+        flatten(*node.children[0], depth + 1, rootArea);
+        nodes[index].leftOrFirst = flatten(*node.children[1], depth + 1, rootArea);
+
+        return index;
+    }
+};
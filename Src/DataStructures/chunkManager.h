@@ -0,0 +1,207 @@
+#pragma once
+
+#include "chunkMap.h"
+#include "brickmap.h"
+#include "distanceField.h"
+#include "occupancyPyramid.h"
+#include "voxelBoxes.h"
+#include "parallelFor.h"
+#include "profiler.h"
+#include "grid.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+//Chunks are the size the intersection shader is specialised for, so every chunk reuses the brick map, distance field and pyramid layouts as is
+const int CHUNK_SIZE = SCENE_GRID_SIZE;
+
+//One resident chunk. Everything the gpu needs is built once on load and never touched again
+struct Chunk {
+    glm::ivec3 coord;
+
+    BrickMap brickMap;
+    DistanceField distanceField;
+    OccupancyPyramid pyramid;
+    VoxelBoxes boxes;
+
+    bool empty = true;
+    list<uint32_t>::iterator lruEntry;
+
+    //World position of voxel (0, 0, 0)
+    glm::vec3 origin() const { return glm::vec3(coord * CHUNK_SIZE); }
+
+    size_t bytes() const { return brickMap.bytes() + brickMap.colourBytes() + distanceField.bytes() + pyramid.bytes() + boxes.bytes(); }
+};
+
+//Unbounded world made of CHUNK_SIZE^3 chunks generated on demand around the camera.
+//Chunks are found through an open addressing ChunkMap and evicted least recently used first once the resident bytes go over memoryBudget
+class ChunkManager {
+    public:
+
+    //Chunks within loadRadius (xz) and verticalRadius (y) of the camera chunk are kept resident
+    int loadRadius = 3;
+    int verticalRadius = 1;
+    size_t memoryBudget = 64u << 20;
+
+    //Caps how many chunks one update generates so walking in to new terrain does not stall a frame
+    uint32_t maxLoadsPerUpdate = 16;
+
+    //voxelAt returns the palette index at a world voxel, 0 being air. Chunks are generated on several threads at once, so it has to be safe to call concurrently
+    void create(const function<int(int, int, int)>& _voxelAt) {
+        voxelAt = _voxelAt;
+    }
+
+    static glm::ivec3 chunkOf(glm::vec3 worldPos) {
+        return glm::ivec3(glm::floor(worldPos / (float)CHUNK_SIZE));
+    }
+
+    //Loads missing chunks around the camera nearest first and evicts down to the budget. Returns true when the resident set changed
+    bool update(glm::vec3 cameraPos) {
+        PROFILE_SCOPE("chunk update");
+
+        glm::ivec3 centre = chunkOf(cameraPos);
+        bool changed = false;
+
+        vector<glm::ivec3> wanted;
+        for(int x = -loadRadius; x <= loadRadius; x++) {
+            for(int y = -verticalRadius; y <= verticalRadius; y++) {
+                for(int z = -loadRadius; z <= loadRadius; z++) wanted.push_back(centre + glm::ivec3(x, y, z));
+            }
+        }
+
+        //Nearest first, so a capped update fills in what is in front of the camera before the edges
+        sort(wanted.begin(), wanted.end(), [&](glm::ivec3 a, glm::ivec3 b) {
+            glm::ivec3 da = a - centre, db = b - centre;
+            return da.x * da.x + da.y * da.y + da.z * da.z < db.x * db.x + db.y * db.y + db.z * db.z;
+        });
+
+        //Generating is the expensive part and chunks do not depend on each other, so the missing ones are built in parallel and only the bookkeeping is serial
+        vector<glm::ivec3> missing;
+        for(glm::ivec3 coord : wanted) {
+            if(missing.size() >= maxLoadsPerUpdate) break;
+            if(chunkMap.find(coord) == ChunkMap::EMPTY) missing.push_back(coord);
+        }
+
+        vector<unique_ptr<Chunk>> generated(missing.size());
+        parallelFor((uint32_t)missing.size(), [&](uint32_t i) {
+            PROFILE_SCOPE("generate chunk");
+            generated[i] = generate(missing[i]);
+        }, 1);
+
+        for(unique_ptr<Chunk>& chunk : generated) insert(move(chunk));
+        changed = !generated.empty();
+
+        //Touch from the far end so the nearest chunks end up at the front of the lru list
+        for(auto it = wanted.rbegin(); it != wanted.rend(); ++it) {
+            uint32_t slot = chunkMap.find(*it);
+            if(slot != ChunkMap::EMPTY) touch(slot);
+        }
+
+        //Never evict something inside the load radius, it would only be generated again next frame
+        while(residentBytes > memoryBudget && !lru.empty()) {
+            uint32_t slot = lru.back();
+            glm::ivec3 d = glm::abs(chunks[slot]->coord - centre);
+            if(d.x <= loadRadius && d.y <= verticalRadius && d.z <= loadRadius) break;
+
+            evict(slot);
+            changed = true;
+        }
+
+        return changed;
+    }
+
+    //Resident chunks in lru order, most recently used first
+    vector<const Chunk*> resident() const {
+        vector<const Chunk*> result;
+        for(uint32_t slot : lru) result.push_back(chunks[slot].get());
+        return result;
+    }
+
+    const Chunk* find(glm::ivec3 coord) const {
+        uint32_t slot = chunkMap.find(coord);
+        return slot == ChunkMap::EMPTY ? nullptr : chunks[slot].get();
+    }
+
+    uint32_t residentCount() const { return chunkMap.size(); }
+    size_t bytes() const { return residentBytes; }
+
+    uint64_t loadCount = 0;
+    uint64_t evictCount = 0;
+
+    private:
+
+    function<int(int, int, int)> voxelAt;
+
+    ChunkMap chunkMap;
+
+    //Slots are reused after eviction so indices stored in chunkMap and lru stay small. unique_ptr keeps chunks from moving
+    vector<unique_ptr<Chunk>> chunks;
+    vector<uint32_t> freeSlots;
+    list<uint32_t> lru;
+
+    size_t residentBytes = 0;
+
+    unique_ptr<Chunk> generate(glm::ivec3 coord) const {
+        unique_ptr<Chunk> chunk = make_unique<Chunk>();
+        chunk->coord = coord;
+
+        glm::ivec3 base = coord * CHUNK_SIZE;
+        chunk->brickMap.build(CHUNK_SIZE, [&](int x, int y, int z) { return voxelAt(base.x + x, base.y + y, base.z + z); });
+        chunk->empty = chunk->brickMap.brickCount == 0;
+
+        //The rest read the brick map instead of calling the generator again
+        const BrickMap* brickMap = &chunk->brickMap;
+        auto solidAt = [brickMap](int x, int y, int z) { return brickMap->isSolid(x, y, z); };
+
+        chunk->distanceField.build(CHUNK_SIZE, DISTANCE_FIELD_MAX, solidAt);
+        chunk->pyramid.build(CHUNK_SIZE, solidAt);
+        chunk->boxes.build(CHUNK_SIZE, solidAt);
+
+        return chunk;
+    }
+
+    uint32_t insert(unique_ptr<Chunk> chunk) {
+        uint32_t slot;
+        if(!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        else {
+            slot = (uint32_t)chunks.size();
+            chunks.emplace_back();
+        }
+
+        lru.push_front(slot);
+        chunk->lruEntry = lru.begin();
+
+        chunkMap.insert(chunk->coord, slot);
+        residentBytes += chunk->bytes();
+        loadCount++;
+
+        chunks[slot] = move(chunk);
+        return slot;
+    }
+
+    void touch(uint32_t slot) {
+        lru.splice(lru.begin(), lru, chunks[slot]->lruEntry);
+    }
+
+    void evict(uint32_t slot) {
+        Chunk& chunk = *chunks[slot];
+
+        residentBytes -= chunk.bytes();
+        chunkMap.erase(chunk.coord);
+        lru.erase(chunk.lruEntry);
+
+        chunks[slot].reset();
+        freeSlots.push_back(slot);
+        evictCount++;
+    }
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+//Open addressing hash map from chunk coordinates to a slot index. Linear probing over a power of two table,
+//erase shifts the rest of the probe run back so there are no tombstones and lookups never slow down as chunks come and go
+class ChunkMap {
+    public:
+
+    static const uint32_t EMPTY = 0xFFFFFFFFu;
+
+    ChunkMap() { clear(); }
+
+    void clear() {
+        entries.assign(16, {glm::ivec3(0), EMPTY});
+        count = 0;
+    }
+
+    //EMPTY when the chunk is not in the map
+    uint32_t find(glm::ivec3 key) const {
+        uint32_t mask = (uint32_t)entries.size() - 1;
+
+        for(uint32_t i = hash(key) & mask; ; i = (i + 1) & mask) {
+            const Entry& e = entries[i];
+            if(e.value == EMPTY) return EMPTY;
+            if(e.key == key) return e.value;
+        }
+    }
+
+    //Overwrites the value if the key is already there
+    void insert(glm::ivec3 key, uint32_t value) {
+        //Keep the load factor under 3/4, probe runs grow fast past that
+        if((count + 1) * 4 > entries.size() * 3) grow();
+
+        uint32_t mask = (uint32_t)entries.size() - 1;
+
+        for(uint32_t i = hash(key) & mask; ; i = (i + 1) & mask) {
+            Entry& e = entries[i];
+
+            if(e.value == EMPTY) {
+                e = {key, value};
+                count++;
+                return;
+            }
+
+            if(e.key == key) {
+                e.value = value;
+                return;
+            }
+        }
+    }
+
+    bool erase(glm::ivec3 key) {
+        uint32_t mask = (uint32_t)entries.size() - 1;
+        uint32_t i = hash(key) & mask;
+
+        while(true) {
+            if(entries[i].value == EMPTY) return false;
+            if(entries[i].key == key) break;
+            i = (i + 1) & mask;
+        }
+
+        //Pull later entries of the run back in to the hole unless their home slot lies cyclically in (hole, j]
+        uint32_t hole = i;
+        for(uint32_t j = (hole + 1) & mask; entries[j].value != EMPTY; j = (j + 1) & mask) {
+            uint32_t home = hash(entries[j].key) & mask;
+            bool stays = hole <= j ? (hole < home && home <= j) : (hole < home || home <= j);
+            if(stays) continue;
+
+            entries[hole] = entries[j];
+            hole = j;
+        }
+
+        entries[hole].value = EMPTY;
+        count--;
+        return true;
+    }
+
+    uint32_t size() const { return count; }
+
+    static uint32_t hash(glm::ivec3 key) {
+        uint32_t h = (uint32_t)key.x * 0x8DA6B343u ^ (uint32_t)key.y * 0xD8163841u ^ (uint32_t)key.z * 0xCB1AB31Fu;
+
+        //Murmur3 finaliser so neighbouring chunks spread over the whole table
+        h ^= h >> 16;
+        h *= 0x85EBCA6Bu;
+        h ^= h >> 13;
+        h *= 0xC2B2AE35u;
+        h ^= h >> 16;
+        return h;
+    }
+
+    private:
+
+    struct Entry {
+        glm::ivec3 key;
+        uint32_t value;
+    };
+
+    vector<Entry> entries;
+    uint32_t count = 0;
+
+    void grow() {
+        vector<Entry> old;
+        old.swap(entries);
+
+        entries.assign(old.size() * 2, {glm::ivec3(0), EMPTY});
+        count = 0;
+
+        for(const Entry& e : old) {
+            if(e.value != EMPTY) insert(e.key, e.value);
+        }
+    }
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "grid.h"
+#include "parallelFor.h"
+#include "../buffer.h"
+#include <vulkan/vulkan_core.h>
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+//Cap used for the scene grid. Half of SCENE_GRID_SIZE is already enough to clear most of the 15^3 grid in one leap
+const int DISTANCE_FIELD_MAX = 8;
+
+//Chebyshev distance from every cell of a size^3 grid to the nearest solid cell, capped at maxDistance. Solid cells are 0.
+//A cell with distance d has nothing solid within the cube of d - 1 cells around it, so a ray can leave that whole cube in one step.
+//Max(|dx|, |dy|, |dz|) is separable, it is built with one bounded 1D pass per axis and every pass runs its lines in parallel
+class DistanceField {
+    public:
+
+    vector<uint8_t> distances;
+    int size = 0;
+    int maxDistance = 0;
+
+    Buffer buf;
+
+    void build(int _size, int _maxDistance, const function<bool(int, int, int)>& solidAt) {
+        size = _size;
+        maxDistance = min(_maxDistance, 255);
+
+        distances.assign((size_t)size * size * size, (uint8_t)maxDistance);
+        computeRegion(glm::ivec3(0), glm::ivec3(size), solidAt);
+    }
+
+    template<int Dim, typename VoxelT>
+    void build(const Grid<Dim, VoxelT>& grid, int _maxDistance) {
+        build(Dim, _maxDistance, [&grid](int x, int y, int z) { return grid.get(x, y, z).colour != 0; });
+    }
+
+    //Call after cells in [lo, hi) changed, solidAt must already return the new state. Only cells that can see the edit get recomputed.
+    //The lookup is passed again rather than kept from build, whatever build read from may be gone by now
+    void update(glm::ivec3 lo, glm::ivec3 hi, const function<bool(int, int, int)>& solidAt) {
+        glm::ivec3 regionLo = glm::max(lo - maxDistance, glm::ivec3(0));
+        glm::ivec3 regionHi = glm::min(hi + maxDistance, glm::ivec3(size));
+        computeRegion(regionLo, regionHi, solidAt);
+    }
+
+    uint8_t get(int x, int y, int z) const { return distances[index(x, y, z)]; }
+    const uint8_t* data() const { return distances.data(); }
+
+    size_t bytes() const { return distances.size(); }
+
+    void createBuffer(VkDevice device, VkPhysicalDevice physicalDevice, VkCommandPool transferPool, VkQueue transferQueue) {
+        //The shader reads 4 distances per uint, pad so the last one is whole
+        vector<uint8_t> padded = distances;
+        padded.resize(max<size_t>(4, (padded.size() + 3) & ~(size_t)3), 0);
+
+        buf.createBuffer(device, physicalDevice, padded.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+        buf.populateBuffer(device, physicalDevice, padded.data(), padded.size(), transferPool, transferQueue);
+    }
+
+    void destroy(VkDevice device) {
+        buf.destroy(device);
+    }
+
+    private:
+
+    size_t index(int x, int y, int z) const { return ((size_t)x * size + y) * size + z; }
+
+    //Writes the final distances for cells in [lo, hi). A cell only sees solids within maxDistance, so each pass reads that much further out
+    void computeRegion(glm::ivec3 lo, glm::ivec3 hi, const function<bool(int, int, int)>& solid) {
+        const int cap = maxDistance;
+        glm::ivec3 outerLo = glm::max(lo - cap, glm::ivec3(0));
+        glm::ivec3 outerHi = glm::min(hi + cap, glm::ivec3(size));
+
+        glm::ivec3 outer = outerHi - outerLo;
+        glm::ivec3 inner = hi - lo;
+
+        //alongZ covers outer x and y but only inner z, alongY only inner y and z, the last pass writes straight in to distances
+        vector<uint8_t> alongZ((size_t)outer.x * outer.y * inner.z);
+        vector<uint8_t> alongY((size_t)outer.x * inner.y * inner.z);
+
+        auto zIndex = [&](int x, int y, int z) { return ((size_t)(x - outerLo.x) * outer.y + (y - outerLo.y)) * inner.z + (z - lo.z); };
+        auto yIndex = [&](int x, int y, int z) { return ((size_t)(x - outerLo.x) * inner.y + (y - lo.y)) * inner.z + (z - lo.z); };
+
+        //Pass 1: distance along z to the nearest solid, read straight from the voxels
+        parallelFor(outer.x * outer.y, [&](uint32_t line) {
+            int x = outerLo.x + line / outer.y;
+            int y = outerLo.y + line % outer.y;
+
+            vector<uint8_t> solidLine(outer.z);
+            for(int z = outerLo.z; z < outerHi.z; z++) solidLine[z - outerLo.z] = solid(x, y, z) ? 1 : 0;
+
+            for(int z = lo.z; z < hi.z; z++) {
+                int best = cap;
+                for(int dz = 0; dz < best; dz++) {
+                    int a = z - dz, b = z + dz;
+                    if((a >= outerLo.z && solidLine[a - outerLo.z]) || (b < outerHi.z && solidLine[b - outerLo.z])) {
+                        best = dz;
+                        break;
+                    }
+                }
+                alongZ[zIndex(x, y, z)] = (uint8_t)best;
+            }
+        });
+
+        //Pass 2 and 3: d(y) = min over y' of max(|y - y'|, previous(y')), the search stops once |y - y'| cant beat the best so far
+        parallelFor(outer.x * inner.z, [&](uint32_t line) {
+            int x = outerLo.x + line / inner.z;
+            int z = lo.z + line % inner.z;
+
+            for(int y = lo.y; y < hi.y; y++) {
+                int best = alongZ[zIndex(x, y, z)];
+                for(int dy = 1; dy < best; dy++) {
+                    if(y - dy >= outerLo.y) best = min(best, max(dy, (int)alongZ[zIndex(x, y - dy, z)]));
+                    if(y + dy < outerHi.y) best = min(best, max(dy, (int)alongZ[zIndex(x, y + dy, z)]));
+                }
+                alongY[yIndex(x, y, z)] = (uint8_t)best;
+            }
+        });
+
+        parallelFor(inner.y * inner.z, [&](uint32_t line) {
+            int y = lo.y + line / inner.z;
+            int z = lo.z + line % inner.z;
+
+            for(int x = lo.x; x < hi.x; x++) {
+                int best = alongY[yIndex(x, y, z)];
+                for(int dx = 1; dx < best; dx++) {
+                    if(x - dx >= outerLo.x) best = min(best, max(dx, (int)alongY[yIndex(x - dx, y, z)]));
+                    if(x + dx < outerHi.x) best = min(best, max(dx, (int)alongY[yIndex(x + dx, y, z)]));
+                }
+                distances[index(x, y, z)] = (uint8_t)best;
+            }
+        });
+    }
+};
\ No newline at end of file
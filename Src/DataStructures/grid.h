@@ -1,46 +1,111 @@
+#pragma once
+
 #include "voxel.h"
+#include "palette.h"
+#include "morton.h"
 #include "../buffer.h"
 #include <vulkan/vulkan_core.h>
 
+#include <cstdint>
+#include <functional>
 #include <iostream>
+#include <type_traits>
+
+using namespace std;
+
+//Linear is x * size * size + y * size + z, a step along x jumps size * size voxels.
+//Morton interleaves the coordinate bits so neighbours in every direction stay close, at the cost of padding to a power of two
+enum class VoxelLayout {
+    Linear,
+    Morton
+};
 
+//Dim^3 voxels with the size known at compile time, so linear index math folds to constant multiplies and fixed trip count loops unroll
+template<int Dim, typename VoxelT = Voxel>
 class Grid {
+    static_assert(Dim > 0, "Grid needs at least one voxel per axis");
+    static_assert(Dim <= 1024, "Morton codes only hold 10 bits per axis");
+    static_assert(is_trivially_copyable<VoxelT>::value && is_standard_layout<VoxelT>::value, "Voxels are uploaded as raw bytes");
+    static_assert(4 % sizeof(VoxelT) == 0 || sizeof(VoxelT) % 4 == 0, "Voxels have to pack tightly in to the uints of a storage buffer");
+
     private:
 
-    Voxel* voxels;
+    VoxelT* voxels = nullptr;
+    VoxelLayout layout = VoxelLayout::Linear;
 
     public:
 
+    static constexpr int size = Dim;
+    static constexpr uint32_t voxelCount = (uint32_t)Dim * Dim * Dim;
+    static constexpr uint32_t paddedDim = Morton::paddedSize(Dim);
+
+    static_assert((uint64_t)paddedDim * paddedDim * paddedDim <= 0xFFFFFFFFull, "Grid does not fit 32 bit indices");
+
     Buffer buf;
+    Palette palette;
+
+    static constexpr uint32_t linearIndex(int x, int y, int z) {
+        return ((uint32_t)x * Dim + (uint32_t)y) * Dim + (uint32_t)z;
+    }
 
-    void create() {
+    //Sphere in the middle of the grid, radius 4 at 15^3
+    void create(VoxelLayout _layout = VoxelLayout::Linear) {
+        uint8_t red = palette.add(glm::vec3(0.75f, 0.2f, 0.2f));
+        int centre = (Dim - 1) / 2;
+        int radius = (Dim + 1) / 4;
 
-        voxels = new Voxel[15 * 15 * 15];
+        create([&](int x, int y, int z) {
+            return (x - centre) * (x - centre) + (y - centre) * (y - centre) + (z - centre) * (z - centre) <= radius * radius ? red : 0;
+        }, _layout);
+    }
 
-        for(int x = 0; x < 15; x++) {
-            for(int y = 0; y < 15; y++) {
-                for (int z = 0; z < 15; z++) {
+    //voxelAt returns the palette index at a voxel, 0 being air. The caller fills the palette, VoxelT is built from that index
+    void create(const function<int(int, int, int)>& voxelAt, VoxelLayout _layout = VoxelLayout::Linear) {
+        layout = _layout;
+        voxels = new VoxelT[storageSize()]();
 
-                    if((x- 7) * (x - 7) + (y - 7)*(y - 7) + (z - 7)*(z - 7) <= 16) {
-                        voxels[x * 15 * 15 + y * 15 + z] = {1};
-                    }
-                    else {
-                        voxels[x * 15 * 15 + y * 15 + z] = {0};
-                    }
-                
-                }
+        for(int x = 0; x < Dim; x++) {
+            for(int y = 0; y < Dim; y++) {
+                for(int z = 0; z < Dim; z++) voxels[index(x, y, z)] = {(uint8_t)voxelAt(x, y, z)};
             }
         }
     }
 
     void createBuffer(VkDevice device, VkPhysicalDevice physicalDevice, VkCommandPool transferPool, VkQueue transferQueue) {
-        buf.createBuffer(device, physicalDevice, 15 * 15 * 15 * 4, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
-        buf.populateBuffer(device, physicalDevice, voxels, 15 * 15 * 15 * 4, transferPool, transferQueue);
+        buf.createBuffer(device, physicalDevice, storageSize() * sizeof(VoxelT), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+        buf.populateBuffer(device, physicalDevice, voxels, storageSize() * sizeof(VoxelT), transferPool, transferQueue);
+    }
+
+    //Host copy stays alive until destroy so the cpu tracer can read the exact data that was uploaded
+    const VoxelT* data() const { return voxels; }
+    VoxelT get(int x, int y, int z) const { return voxels[index(x, y, z)]; }
+
+    VoxelLayout getLayout() const { return layout; }
 
+    uint32_t index(int x, int y, int z) const {
+        static_assert(linearIndex(Dim - 1, Dim - 1, Dim - 1) == voxelCount - 1, "Linear layout has to be dense");
+
+        if(layout == VoxelLayout::Morton) return Morton::encode(x, y, z);
+        return linearIndex(x, y, z);
+    }
+
+    //Number of voxels actually stored, Morton pads 15^3 up to 16^3
+    uint32_t storageSize() const {
+        if(layout == VoxelLayout::Morton) return paddedDim * paddedDim * paddedDim;
+        return voxelCount;
+    }
+
+    void releaseVoxels() {
         delete [] voxels;
+        voxels = nullptr;
     }
 
     void destroy(VkDevice device) {
         buf.destroy(device);
+        releaseVoxels();
     }
-};
\ No newline at end of file
+};
+
+//The grid the renderer is built around. Chunks take their size from it and it reaches the intersection shader as specialization constant 0, so this is the only place to change it
+const int SCENE_GRID_SIZE = 15;
+using SceneGrid = Grid<SCENE_GRID_SIZE>;
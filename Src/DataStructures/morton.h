@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+//Z-order (Morton) codes for up to 10 bits per axis. x takes the highest bit of each triple so the ordering agrees with the linear x * size * size + y * size + z layout
+
+namespace Morton {
+
+    const uint32_t MASK_X = 0x24924924u;
+    const uint32_t MASK_Y = 0x12492492u;
+    const uint32_t MASK_Z = 0x09249249u;
+
+    //Spreads the low 8 bits of a byte out to every third bit
+    struct Tables {
+        uint32_t spread[256];
+        uint8_t compact[512];
+
+        Tables() {
+            for(uint32_t v = 0; v < 256; v++) {
+                uint32_t s = 0;
+                for(int b = 0; b < 8; b++) s |= ((v >> b) & 1u) << (3 * b);
+                spread[v] = s;
+            }
+            for(uint32_t v = 0; v < 512; v++) {
+                uint32_t c = 0;
+                for(int b = 0; b < 3; b++) c |= ((v >> (3 * b)) & 1u) << b;
+                compact[v] = (uint8_t)c;
+            }
+        }
+    };
+
+    inline const Tables& tables() {
+        static const Tables t;
+        return t;
+    }
+
+    inline uint32_t spreadTable(uint32_t v) {
+        const Tables& t = tables();
+        return t.spread[v & 0xFF] | (t.spread[(v >> 8) & 0x3] << 24);
+    }
+
+    //compact takes 9 bits (3 triples) at a time and returns the 3 bits of the lowest axis
+    inline uint32_t compactTable(uint32_t v) {
+        const Tables& t = tables();
+        return t.compact[v & 0x1FF] | (t.compact[(v >> 9) & 0x1FF] << 3) | (t.compact[(v >> 18) & 0x1FF] << 6) | (t.compact[(v >> 27) & 0x1FF] << 9);
+    }
+
+    inline uint32_t encodeTable(uint32_t x, uint32_t y, uint32_t z) {
+        return (spreadTable(x) << 2) | (spreadTable(y) << 1) | spreadTable(z);
+    }
+
+    inline void decodeTable(uint32_t code, uint32_t& x, uint32_t& y, uint32_t& z) {
+        x = compactTable(code >> 2);
+        y = compactTable(code >> 1);
+        z = compactTable(code);
+    }
+
+#if defined(__BMI2__)
+    //One pdep/pext per axis. Only worth it on cpus with a fast pdep (Intel Haswell+, AMD Zen 3+)
+    inline uint32_t encodeBMI2(uint32_t x, uint32_t y, uint32_t z) {
+        return _pdep_u32(x, MASK_X) | _pdep_u32(y, MASK_Y) | _pdep_u32(z, MASK_Z);
+    }
+
+    inline void decodeBMI2(uint32_t code, uint32_t& x, uint32_t& y, uint32_t& z) {
+        x = _pext_u32(code, MASK_X);
+        y = _pext_u32(code, MASK_Y);
+        z = _pext_u32(code, MASK_Z);
+    }
+#endif
+
+    inline uint32_t encode(uint32_t x, uint32_t y, uint32_t z) {
+#if defined(__BMI2__)
+        return encodeBMI2(x, y, z);
+#else
+        return encodeTable(x, y, z);
+#endif
+    }
+
+    inline void decode(uint32_t code, uint32_t& x, uint32_t& y, uint32_t& z) {
+#if defined(__BMI2__)
+        decodeBMI2(code, x, y, z);
+#else
+        decodeTable(code, x, y, z);
+#endif
+    }
+
+    //Step one voxel along an axis without decoding, mask is MASK_X, MASK_Y or MASK_Z. Lets a DDA walk a Morton grid as cheaply as a linear one
+    inline uint32_t increment(uint32_t code, uint32_t mask) { return (((code | ~mask) + 1) & mask) | (code & ~mask); }
+    inline uint32_t decrement(uint32_t code, uint32_t mask) { return (((code & mask) - 1) & mask) | (code & ~mask); }
+
+    //Morton storage needs a power of two cube
+    constexpr uint32_t paddedSize(uint32_t size) {
+        uint32_t p = 1;
+        while(p < size) p <<= 1;
+        return p;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "grid.h"
+#include "parallelFor.h"
+#include "../buffer.h"
+#include <vulkan/vulkan_core.h>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+//Occupancy mip chain over the grid padded to a power of two. Level l has (resolution >> l)^3 cells and a cell is set when any of its 2^3 children is.
+//Level 0 is not stored, the traversal reads full resolution occupancy straight out of the brick map at binding 3.
+//data is what goes to binding 7: levelCount, resolution, then the word offset of levels 1..levelCount, then every level as x * r * r + y * r + z bits
+class OccupancyPyramid {
+    public:
+
+    vector<uint32_t> data;
+    int resolution = 0;
+    int levelCount = 0;
+
+    Buffer buf;
+
+    //solidAt is only asked about cells inside size^3, the padding is air
+    void build(int size, const function<bool(int, int, int)>& solidAt) {
+        levelCount = 0;
+        while((1 << levelCount) < size) levelCount++;
+        resolution = 1 << levelCount;
+
+        data.assign(2 + levelCount, 0u);
+        data[0] = (uint32_t)levelCount;
+        data[1] = (uint32_t)resolution;
+
+        for(int level = 1; level <= levelCount; level++) {
+            int res = resolution >> level;
+            data[1 + level] = (uint32_t)data.size();
+            data.resize(data.size() + (res * res * res + 31) / 32, 0u);
+        }
+
+        //Each task owns one word, so no two threads ever write the same uint. Level 1 reads the voxels, the rest read the level below
+        for(int level = 1; level <= levelCount; level++) {
+            int res = resolution >> level;
+            uint32_t cells = (uint32_t)(res * res * res);
+            uint32_t offset = data[1 + level];
+
+            parallelFor((cells + 31) / 32, [&](uint32_t word) {
+                uint32_t bits = 0;
+
+                for(uint32_t b = 0; b < 32; b++) {
+                    uint32_t cell = word * 32 + b;
+                    if(cell >= cells) break;
+
+                    int x = cell / (res * res), y = (cell / res) % res, z = cell % res;
+                    bool occupied = false;
+
+                    for(int i = 0; i < 8 && !occupied; i++) {
+                        int cx = x * 2 + ((i >> 2) & 1);
+                        int cy = y * 2 + ((i >> 1) & 1);
+                        int cz = z * 2 + (i & 1);
+
+                        if(level == 1) occupied = cx < size && cy < size && cz < size && solidAt(cx, cy, cz);
+                        else occupied = get(level - 1, cx, cy, cz);
+                    }
+
+                    if(occupied) bits |= 1u << b;
+                }
+
+                data[offset + word] = bits;
+            });
+        }
+    }
+
+    template<int Dim, typename VoxelT>
+    void build(const Grid<Dim, VoxelT>& grid) {
+        build(Dim, [&grid](int x, int y, int z) { return grid.get(x, y, z).colour != 0; });
+    }
+
+    //Only for levels 1..levelCount
+    bool get(int level, int x, int y, int z) const {
+        int res = resolution >> level;
+        uint32_t bit = (uint32_t)((x * res + y) * res + z);
+        return (data[data[1 + level] + (bit >> 5)] >> (bit & 31)) & 1u;
+    }
+
+    size_t bytes() const { return data.size() * sizeof(uint32_t); }
+
+    void createBuffer(VkDevice device, VkPhysicalDevice physicalDevice, VkCommandPool transferPool, VkQueue transferQueue) {
+        buf.createBuffer(device, physicalDevice, bytes(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+        buf.populateBuffer(device, physicalDevice, data.data(), bytes(), transferPool, transferQueue);
+    }
+
+    void destroy(VkDevice device) {
+        buf.destroy(device);
+    }
+};
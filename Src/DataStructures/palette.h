@@ -0,0 +1,39 @@
+#pragma once
+
+#include "../buffer.h"
+#include <vulkan/vulkan_core.h>
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+//Colour table the 8 bit voxel values index in to. Entry 0 is air and never read
+class Palette {
+    public:
+
+    vector<glm::vec4> colours = {glm::vec4(0)};
+
+    Buffer buf;
+
+    uint8_t add(glm::vec3 colour) {
+        if(colours.size() >= 256) throw runtime_error("Palette is full");
+
+        colours.push_back(glm::vec4(colour, 1.0f));
+        return (uint8_t)(colours.size() - 1);
+    }
+
+    glm::vec3 get(uint8_t index) const { return glm::vec3(colours[index]); }
+
+    size_t bytes() const { return colours.size() * sizeof(glm::vec4); }
+
+    void createBuffer(VkDevice device, VkPhysicalDevice physicalDevice, VkCommandPool transferPool, VkQueue transferQueue) {
+        buf.createBuffer(device, physicalDevice, bytes(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+        buf.populateBuffer(device, physicalDevice, colours.data(), bytes(), transferPool, transferQueue);
+    }
+
+    void destroy(VkDevice device) {
+        buf.destroy(device);
+    }
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+//Runs fn(i) for every i in [0, count) over all cores. Small jobs do not pay for the threads, a thread is only added per grain items.
+//Use a grain of 1 when every item is heavy on its own, like a whole chunk
+inline void parallelFor(uint32_t count, const function<void(uint32_t)>& fn, uint32_t grain = 64) {
+    uint32_t threadCount = min({max(1u, thread::hardware_concurrency()), count / grain + 1, max(1u, count)});
+
+    if(threadCount == 1) {
+        for(uint32_t i = 0; i < count; i++) fn(i);
+        return;
+    }
+
+    atomic<uint32_t> next{0};
+    vector<thread> workers;
+    for(uint32_t t = 0; t < threadCount; t++) {
+        workers.emplace_back([&]() {
+            for(uint32_t i = next++; i < count; i = next++) fn(i);
+        });
+    }
+    for(thread& worker : workers) worker.join();
+}
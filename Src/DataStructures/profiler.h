@@ -0,0 +1,246 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//One timed span. name has to outlive the profiler, it is only ever a string literal. track says whose timeline it is on, see Profiler
+struct ProfileEvent {
+    const char* name;
+    uint64_t startNs;
+    uint64_t durationNs;
+    uint32_t thread;
+    uint32_t track;
+};
+
+struct Percentiles {
+    uint32_t count;
+    double p50;
+    double p95;
+    double p99;
+};
+
+//Nearest rank percentiles of samples, which it sorts
+inline Percentiles percentiles(vector<double>& samples) {
+    Percentiles result{(uint32_t)samples.size(), 0.0, 0.0, 0.0};
+    if(samples.empty()) return result;
+
+    sort(samples.begin(), samples.end());
+    auto rank = [&](double p) { return samples[(size_t)max(1.0, ceil(p * (double)samples.size())) - 1]; };
+
+    result.p50 = rank(0.50);
+    result.p95 = rank(0.95);
+    result.p99 = rank(0.99);
+    return result;
+}
+
+//Fixed size ring of the latest events, old ones are overwritten. Any number of threads push at once without a lock, a push takes its index with one
+//fetch_add and claims the slot by swapping its sequence number from the even value an earlier lap left to its own odd one. A push that finds the
+//slot still being written, or already taken by a push a lap ahead, is dropped rather than writing over it, so only one push writes a slot at a time.
+//snapshot copies out every slot that is whole, and skips one that a push is writing or has already taken again
+class EventRing {
+    public:
+
+    EventRing() : EventRing(16) {}
+    explicit EventRing(uint32_t capacityLog2) : slots(1ull << capacityLog2), mask((1ull << capacityLog2) - 1) {}
+
+    void push(const ProfileEvent& event) {
+        uint64_t index = head.fetch_add(1, memory_order_relaxed);
+        Slot& slot = slots[index & mask];
+
+        //Any whole event from an earlier lap can be overwritten, not only the one a lap before, that push may have been dropped itself
+        uint64_t current = slot.sequence.load(memory_order_relaxed);
+        do {
+            if((current & 1) || current > index * 2) {
+                droppedCount.fetch_add(1, memory_order_relaxed);
+                return;
+            }
+        } while(!slot.sequence.compare_exchange_weak(current, index * 2 + 1, memory_order_relaxed));
+        atomic_thread_fence(memory_order_release);
+
+        slot.name.store(event.name, memory_order_relaxed);
+        slot.startNs.store(event.startNs, memory_order_relaxed);
+        slot.durationNs.store(event.durationNs, memory_order_relaxed);
+        slot.thread.store(event.thread, memory_order_relaxed);
+        slot.track.store(event.track, memory_order_relaxed);
+
+        slot.sequence.store(index * 2 + 2, memory_order_release);
+    }
+
+    //Oldest first
+    vector<ProfileEvent> snapshot() const {
+        uint64_t end = head.load(memory_order_acquire);
+        uint64_t begin = end > slots.size() ? end - slots.size() : 0;
+
+        vector<ProfileEvent> events;
+        events.reserve((size_t)(end - begin));
+
+        for(uint64_t index = begin; index < end; index++) {
+            const Slot& slot = slots[index & mask];
+
+            uint64_t before = slot.sequence.load(memory_order_acquire);
+            if(before != index * 2 + 2) continue;
+
+            ProfileEvent event;
+            event.name = slot.name.load(memory_order_relaxed);
+            event.startNs = slot.startNs.load(memory_order_relaxed);
+            event.durationNs = slot.durationNs.load(memory_order_relaxed);
+            event.thread = slot.thread.load(memory_order_relaxed);
+            event.track = slot.track.load(memory_order_relaxed);
+
+            atomic_thread_fence(memory_order_acquire);
+            if(slot.sequence.load(memory_order_relaxed) != before) continue;
+
+            events.push_back(event);
+        }
+
+        return events;
+    }
+
+    uint64_t pushed() const { return head.load(memory_order_relaxed); }
+    uint64_t dropped() const { return droppedCount.load(memory_order_relaxed); }
+    size_t capacity() const { return slots.size(); }
+
+    private:
+
+    struct Slot {
+        atomic<uint64_t> sequence{0};
+        atomic<const char*> name{nullptr};
+        atomic<uint64_t> startNs{0};
+        atomic<uint64_t> durationNs{0};
+        atomic<uint32_t> thread{0};
+        atomic<uint32_t> track{0};
+    };
+
+    vector<Slot> slots;
+    uint64_t mask;
+    atomic<uint64_t> head{0};
+    atomic<uint64_t> droppedCount{0};
+};
+
+//Process wide event ring and clock. Cpu scopes are on track CPU_TRACK, the gpu profiler puts its zones on a track per queue
+class Profiler {
+    public:
+
+    static const uint32_t CPU_TRACK = 0;
+    static const uint32_t GRAPHICS_TRACK = 1;
+    static const uint32_t BUILD_TRACK = 2;
+
+    static inline EventRing events;
+
+    static uint64_t now() {
+        return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count();
+    }
+
+    //Small ids in the order threads first record something, the trace viewer shows one row per id
+    static uint32_t threadId() {
+        static atomic<uint32_t> nextId{0};
+        thread_local uint32_t id = nextId++;
+        return id;
+    }
+
+    //Durations in milliseconds of the latest maxSamples events called name on track
+    static Percentiles summary(const vector<ProfileEvent>& snapshot, const char* name, uint32_t track = CPU_TRACK, size_t maxSamples = 1000) {
+        vector<double> samples;
+        for(auto it = snapshot.rbegin(); it != snapshot.rend() && samples.size() < maxSamples; ++it) {
+            if(it->track == track && strcmp(it->name, name) == 0) samples.push_back((double)it->durationNs / 1e6);
+        }
+        return percentiles(samples);
+    }
+
+    //Every distinct name per track with its percentiles, one line each
+    static void writeSummary(ostream& out, const vector<ProfileEvent>& snapshot) {
+        vector<pair<uint32_t, string>> seen;
+        for(const ProfileEvent& event : snapshot) {
+            pair<uint32_t, string> key = {event.track, event.name};
+            if(find(seen.begin(), seen.end(), key) == seen.end()) seen.push_back(key);
+        }
+        sort(seen.begin(), seen.end());
+
+        for(const pair<uint32_t, string>& key : seen) {
+            Percentiles p = summary(snapshot, key.second.c_str(), key.first);
+            out << trackName(key.first) << " " << key.second << " : p50 " << p.p50 << " ms, p95 " << p.p95 << " ms, p99 " << p.p99 << " ms over " << p.count << endl;
+        }
+    }
+
+    //Chrome trace event format, loads in chrome://tracing and Perfetto. Every track is a process of its own so the gpu queues sit under the cpu threads
+    static void writeChromeTrace(ostream& out, const vector<ProfileEvent>& snapshot) {
+        //Microseconds with the nanoseconds after the point, the default precision would print long runs in exponent form
+        ios::fmtflags flags = out.flags();
+        streamsize precision = out.precision();
+        out << fixed << setprecision(3);
+
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+        const uint32_t tracks[] = {CPU_TRACK, GRAPHICS_TRACK, BUILD_TRACK};
+        bool first = true;
+        for(uint32_t track : tracks) {
+            out << (first ? "" : ",") << "\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << track << ",\"args\":{\"name\":\"" << trackName(track) << "\"}}";
+            first = false;
+        }
+
+        for(const ProfileEvent& event : snapshot) {
+            out << ",\n{\"name\":\"" << escape(event.name) << "\",\"ph\":\"X\",\"pid\":" << event.track << ",\"tid\":" << event.thread
+                << ",\"ts\":" << (double)event.startNs / 1000.0 << ",\"dur\":" << (double)event.durationNs / 1000.0 << "}";
+        }
+
+        out << "\n]}\n";
+
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+    static const char* trackName(uint32_t track) {
+        switch(track) {
+            case CPU_TRACK: return "CPU";
+            case GRAPHICS_TRACK: return "GPU graphics queue";
+            case BUILD_TRACK: return "GPU build queue";
+            default: return "Unknown";
+        }
+    }
+
+    private:
+
+    static inline const chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+
+    static string escape(const char* name) {
+        string result;
+        for(const char* c = name; *c; c++) {
+            if(*c == '"' || *c == '\\') result += '\\';
+            result += *c;
+        }
+        return result;
+    }
+};
+
+//Times the enclosing block on the cpu track of the calling thread
+class ProfileScope {
+    public:
+
+    explicit ProfileScope(const char* _name) : name(_name), start(Profiler::now()) {}
+
+    ~ProfileScope() {
+        Profiler::events.push({name, start, Profiler::now() - start, Profiler::threadId(), Profiler::CPU_TRACK});
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+    private:
+
+    const char* name;
+    uint64_t start;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
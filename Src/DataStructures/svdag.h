@@ -0,0 +1,250 @@
+#pragma once
+
+#include "grid.h"
+#include "parallelFor.h"
+#include "../buffer.h"
+#include "../RayTracing/gridTraversal.h"
+#include <vulkan/vulkan_core.h>
+#include <glm/glm.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+struct SVDAGStats {
+    double buildMilliseconds;
+    uint32_t nodeCount;
+    uint32_t treeNodeCount; //Nodes the same octree would have without sharing
+    size_t bytes;
+    size_t denseBytes;
+
+    double compressionRatio() const { return bytes ? (double)denseBytes / bytes : 0.0; }
+    double sharing() const { return nodeCount ? (double)treeNodeCount / nodeCount : 0.0; }
+};
+
+//Sparse voxel DAG: an octree where identical subtrees are stored once. Built bottom up, every level hash-conses its nodes against the ones already emitted.
+//nodes is a flat uint array: a node is its child mask followed by one word per set child, in child order (x << 2 | y << 1 | z).
+//Children of level 1 nodes are voxel colours, everything above points at the offset of another node. Empty children are not stored
+class SparseVoxelDAG {
+    public:
+
+    static const uint32_t EMPTY = 0xFFFFFFFFu;
+
+    vector<uint32_t> nodes;
+    uint32_t root = EMPTY;
+    SVDAGStats stats{};
+
+    Buffer buf;
+
+    //voxelAt returns the colour at a voxel, 0 being air
+    void build(int size, const function<int(int, int, int)>& voxelAt) {
+        auto start = chrono::high_resolution_clock::now();
+
+        depth = 0;
+        while((1 << depth) < size) depth++;
+        resolution = 1 << depth;
+
+        nodes.clear();
+        root = EMPTY;
+        stats.treeNodeCount = 0;
+
+        //Level 0 holds colours, every level above holds node offsets. EMPTY / 0 marks a cell with nothing in it
+        vector<uint32_t> below((size_t)resolution * resolution * resolution, 0u);
+
+        parallelFor(resolution, [&](uint32_t x) {
+            if((int)x >= size) return;
+            for(int y = 0; y < size; y++) {
+                for(int z = 0; z < size; z++) below[cellIndex(x, y, z, resolution)] = (uint32_t)voxelAt(x, y, z);
+            }
+        });
+
+        for(int level = 1; level <= depth; level++) {
+            int res = resolution >> level;
+            size_t cells = (size_t)res * res * res;
+            uint32_t emptyChild = level == 1 ? 0u : EMPTY;
+
+            //Keys are built in parallel, each cell writes only its own slot
+            vector<NodeKey> keys(cells);
+            parallelFor((uint32_t)res, [&](uint32_t x) {
+                for(int y = 0; y < res; y++) {
+                    for(int z = 0; z < res; z++) {
+                        NodeKey& key = keys[cellIndex(x, y, z, res)];
+                        key.count = 1;
+                        key.words[0] = 0;
+
+                        for(uint32_t i = 0; i < 8; i++) {
+                            uint32_t child = below[cellIndex(x * 2 + ((i >> 2) & 1), y * 2 + ((i >> 1) & 1), z * 2 + (i & 1), res * 2)];
+                            if(child == emptyChild) continue;
+
+                            key.words[0] |= 1u << i;
+                            key.words[key.count++] = child;
+                        }
+                    }
+                }
+            });
+
+            //Dedup in cell order so the output does not depend on the thread count
+            unordered_map<NodeKey, uint32_t, NodeKeyHash> unique;
+            vector<uint32_t> above(cells, EMPTY);
+
+            for(size_t c = 0; c < cells; c++) {
+                const NodeKey& key = keys[c];
+                if(key.words[0] == 0) continue;
+
+                stats.treeNodeCount++;
+
+                auto found = unique.find(key);
+                if(found != unique.end()) {
+                    above[c] = found->second;
+                    continue;
+                }
+
+                uint32_t offset = (uint32_t)nodes.size();
+                nodes.insert(nodes.end(), key.words, key.words + key.count);
+                unique.emplace(key, offset);
+                above[c] = offset;
+            }
+
+            below.swap(above);
+        }
+
+        //A size 1 grid never gets a level, the single voxel has no node to live in
+        if(depth > 0) root = below[0];
+
+        auto end = chrono::high_resolution_clock::now();
+
+        stats.buildMilliseconds = chrono::duration<double, milli>(end - start).count();
+        stats.nodeCount = countNodes();
+        stats.bytes = nodes.size() * sizeof(uint32_t);
+        stats.denseBytes = (size_t)size * size * size * sizeof(Voxel);
+    }
+
+    template<int Dim, typename VoxelT>
+    void build(const Grid<Dim, VoxelT>& grid) {
+        build(Dim, [&grid](int x, int y, int z) { return grid.get(x, y, z).colour; });
+    }
+
+    //Same stack walk as SparseVoxelOctree::traverse, children are looked up through the shared nodes. gridBox covers the padded resolution
+    float traverse(AABB gridBox, glm::vec3 origin, glm::vec3 direction, int* colour = nullptr) const {
+        if(root == EMPTY) return -1.0f;
+
+        glm::vec3 invDir = 1.0f / GridTraversal::safeDirection(direction);
+
+        struct Entry { uint32_t node; int level; glm::vec3 bMin; float size; };
+
+        Entry stack[8 * 24];
+        int top = 0;
+
+        stack[top++] = {root, depth, gridBox.bMin, gridBox.bMax.x - gridBox.bMin.x};
+
+        while(top > 0) {
+            Entry e = stack[--top];
+            uint32_t mask = nodes[e.node];
+            float half = e.size * 0.5f;
+
+            Entry children[8];
+            float childT[8];
+            int count = 0;
+            uint32_t word = e.node + 1;
+
+            for(uint32_t i = 0; i < 8; i++) {
+                if(!(mask & (1u << i))) continue;
+
+                uint32_t child = nodes[word++];
+                glm::vec3 bMin = e.bMin + glm::vec3((float)((i >> 2) & 1), (float)((i >> 1) & 1), (float)(i & 1)) * half;
+                float tNear, tFar;
+
+                if(slabs(bMin, bMin + glm::vec3(half), origin, invDir, tNear, tFar)) {
+                    children[count] = {child, e.level - 1, bMin, half};
+                    childT[count] = tNear;
+                    count++;
+                }
+            }
+
+            //Push far to near so the nearest child is popped first
+            for(int i = 1; i < count; i++) {
+                for(int j = i; j > 0 && childT[j] > childT[j - 1]; j--) {
+                    swap(childT[j], childT[j - 1]);
+                    swap(children[j], children[j - 1]);
+                }
+            }
+
+            //Children of a level 1 node are voxels. They are sorted far to near, so the last one in front of the origin is the hit
+            if(e.level == 1) {
+                for(int i = count - 1; i >= 0; i--) {
+                    if(childT[i] > 0.0f) {
+                        if(colour) *colour = (int)children[i].node;
+                        return childT[i];
+                    }
+                }
+                continue;
+            }
+
+            for(int i = 0; i < count; i++) stack[top++] = children[i];
+        }
+
+        return -1.0f;
+    }
+
+    int getResolution() const { return resolution; }
+
+    void createBuffer(VkDevice device, VkPhysicalDevice physicalDevice, VkCommandPool transferPool, VkQueue transferQueue) {
+        buf.createBuffer(device, physicalDevice, stats.bytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+        buf.populateBuffer(device, physicalDevice, nodes.data(), stats.bytes, transferPool, transferQueue);
+    }
+
+    void destroy(VkDevice device) {
+        buf.destroy(device);
+    }
+
+    private:
+
+    int depth = 0;
+    int resolution = 0;
+
+    //Mask plus up to 8 children
+    struct NodeKey {
+        uint32_t words[9];
+        uint32_t count;
+
+        bool operator==(const NodeKey& other) const {
+            return count == other.count && memcmp(words, other.words, count * sizeof(uint32_t)) == 0;
+        }
+    };
+
+    struct NodeKeyHash {
+        size_t operator()(const NodeKey& key) const {
+            uint64_t h = 0xCBF29CE484222325ull;
+            for(uint32_t i = 0; i < key.count; i++) {
+                h ^= key.words[i];
+                h *= 0x100000001B3ull;
+            }
+            return (size_t)h;
+        }
+    };
+
+    static size_t cellIndex(int x, int y, int z, int res) { return ((size_t)x * res + y) * res + z; }
+
+    uint32_t countNodes() const {
+        uint32_t count = 0;
+        for(size_t i = 0; i < nodes.size(); i += 1 + __builtin_popcount(nodes[i])) count++;
+        return count;
+    }
+
+    static bool slabs(glm::vec3 bMin, glm::vec3 bMax, glm::vec3 origin, glm::vec3 invDir, float& tNear, float& tFar) {
+        glm::vec3 t0 = (bMin - origin) * invDir;
+        glm::vec3 t1 = (bMax - origin) * invDir;
+
+        glm::vec3 tmin = glm::min(t0, t1);
+        glm::vec3 tmax = glm::max(t0, t1);
+
+        tNear = std::max(std::max(tmin.x, tmin.y), tmin.z);
+        tFar = std::min(std::min(tmax.x, tmax.y), tmax.z);
+
+        return tFar >= std::max(tNear, 0.0f);
+    }
+};
@@ -0,0 +1,244 @@
+#pragma once
+
+#include "grid.h"
+#include "../buffer.h"
+#include "../RayTracing/gridTraversal.h"
+#include <vulkan/vulkan_core.h>
+#include <glm/glm.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+//8 bytes, matches a uvec2 in a std430 buffer
+struct SVONode {
+    uint32_t firstChild; //Index of the first child, the rest follow it in child order. Leaves store the voxel colour here instead
+    uint32_t childMask;  //Bit i is set when child i exists. A node with no children is a leaf
+};
+
+struct SVOStats {
+    double buildMilliseconds;
+    uint32_t nodeCount;
+    uint32_t solidVoxels;
+    size_t bytes;
+    size_t denseBytes;
+
+    double bytesPerSolidVoxel() const { return solidVoxels ? (double)bytes / solidVoxels : 0.0; }
+    double denseBytesPerSolidVoxel() const { return solidVoxels ? (double)denseBytes / solidVoxels : 0.0; }
+};
+
+//Sparse voxel octree stored as one flat array of nodes with no pointers so it can go to the gpu as a single storage buffer.
+//Child i of a node sits at firstChild + popcount(childMask & ((1 << i) - 1)), child index bits are x << 2 | y << 1 | z
+class SparseVoxelOctree {
+    public:
+
+    vector<SVONode> nodes;
+    SVOStats stats{};
+
+    Buffer buf;
+
+    //voxelAt returns the colour at a voxel, 0 being air. Works for the dense grid or anything chunked behind a lookup.
+    //Bottom up, one 8^3 brick at a time with the bricks and the voxels in each brick in Morton order, so solid voxels come out sorted by Morton code.
+    //Every leaf merges in to the open node of each level above it, and a level is left in Morton order which is the breadth first layout.
+    //Nothing dense is kept, only the nodes themselves
+    void build(int size, const function<int(int, int, int)>& voxelAt) {
+        auto start = chrono::high_resolution_clock::now();
+
+        depth = 0;
+        while((1 << depth) < size) depth++;
+        resolution = 1 << depth;
+
+        int brickLevels = std::min(depth, 3);
+        int brick = 1 << brickLevels;
+        uint64_t brickVoxels = 1ull << (3 * brickLevels);
+        uint64_t brickCount = 1ull << (3 * (depth - brickLevels));
+
+        //Level 0 holds the leaves, open is the Morton code of the last node pushed to a level, the only one a later voxel can still join
+        vector<vector<SVONode>> levels(depth + 1);
+        vector<uint64_t> open(depth + 1, UINT64_MAX);
+
+        stats.solidVoxels = 0;
+
+        for(uint64_t brickCode = 0; brickCode < brickCount; brickCode++) {
+            int bx, by, bz;
+            decode(brickCode, bx, by, bz);
+            bx *= brick;
+            by *= brick;
+            bz *= brick;
+            if(bx >= size || by >= size || bz >= size) continue;
+
+            for(uint64_t local = 0; local < brickVoxels; local++) {
+                int lx, ly, lz;
+                decode(local, lx, ly, lz);
+
+                int x = bx + lx, y = by + ly, z = bz + lz;
+                if(x >= size || y >= size || z >= size) continue;
+
+                int colour = voxelAt(x, y, z);
+                if(colour == 0) continue;
+
+                stats.solidVoxels++;
+                levels[0].push_back({(uint32_t)colour, 0});
+
+                uint64_t code = (brickCode << (3 * brickLevels)) | local;
+                for(int level = 1; level <= depth; level++) {
+                    uint64_t parent = code >> (3 * level);
+                    uint32_t bit = 1u << ((code >> (3 * (level - 1))) & 7);
+
+                    if(open[level] == parent) {
+                        levels[level].back().childMask |= bit;
+                        break;
+                    }
+
+                    open[level] = parent;
+                    levels[level].push_back({0, bit});
+                }
+            }
+        }
+
+        nodes.clear();
+
+        if(stats.solidVoxels == 0) nodes.push_back({depth > 0 ? 1u : 0u, 0});
+        else {
+            size_t total = 0;
+            for(const vector<SVONode>& level : levels) total += level.size();
+            nodes.reserve(total);
+
+            //Root first, the children of a level are the next level in the same order, so a running count of children places them
+            for(int level = depth; level >= 0; level--) {
+                uint32_t child = (uint32_t)(nodes.size() + levels[level].size());
+
+                for(SVONode node : levels[level]) {
+                    if(level > 0) {
+                        node.firstChild = child;
+                        child += (uint32_t)__builtin_popcount(node.childMask);
+                    }
+                    nodes.push_back(node);
+                }
+
+                vector<SVONode>().swap(levels[level]);
+            }
+        }
+
+        auto end = chrono::high_resolution_clock::now();
+
+        stats.buildMilliseconds = chrono::duration<double, milli>(end - start).count();
+        stats.nodeCount = (uint32_t)nodes.size();
+        stats.bytes = nodes.size() * sizeof(SVONode);
+        stats.denseBytes = (size_t)size * size * size * sizeof(Voxel);
+    }
+
+    template<int Dim, typename VoxelT>
+    void build(const Grid<Dim, VoxelT>& grid) {
+        build(Dim, [&grid](int x, int y, int z) { return grid.get(x, y, z).colour; });
+    }
+
+    //Stack based front to back walk. Returns the distance to the first solid voxel or -1, colour gets the leaf value.
+    //gridBox covers the padded resolution, so a 15^3 grid with 1 wide voxels at (1,1,1) is {1, 17}
+    float traverse(AABB gridBox, glm::vec3 origin, glm::vec3 direction, int* colour = nullptr) const {
+        //An empty world leaves the root without children, which would otherwise read as a leaf
+        if(nodes.empty() || stats.solidVoxels == 0) return -1.0f;
+
+        glm::vec3 invDir = 1.0f / GridTraversal::safeDirection(direction);
+
+        struct Entry { uint32_t node; glm::vec3 bMin; float size; };
+
+        //Each level pushes at most 8 children on top of what is already there
+        Entry stack[8 * 24];
+        int top = 0;
+
+        stack[top++] = {0, gridBox.bMin, gridBox.bMax.x - gridBox.bMin.x};
+
+        while(top > 0) {
+            Entry e = stack[--top];
+            const SVONode& node = nodes[e.node];
+
+            if(node.childMask == 0) {
+                float tNear, tFar;
+                slabs(e.bMin, e.bMin + glm::vec3(e.size), origin, invDir, tNear, tFar);
+
+                //Same rule as the dda, a voxel that contains the origin is not a hit
+                if(tNear > 0.0f) {
+                    if(colour) *colour = (int)node.firstChild;
+                    return tNear;
+                }
+                continue;
+            }
+
+            float half = e.size * 0.5f;
+
+            Entry children[8];
+            float childT[8];
+            int count = 0;
+            uint32_t child = node.firstChild;
+
+            for(uint32_t i = 0; i < 8; i++) {
+                if(!(node.childMask & (1u << i))) continue;
+
+                glm::vec3 bMin = e.bMin + glm::vec3((float)((i >> 2) & 1), (float)((i >> 1) & 1), (float)(i & 1)) * half;
+                float tNear, tFar;
+
+                if(slabs(bMin, bMin + glm::vec3(half), origin, invDir, tNear, tFar)) {
+                    children[count] = {child, bMin, half};
+                    childT[count] = tNear;
+                    count++;
+                }
+
+                child++;
+            }
+
+            //Push far to near so the nearest child is popped first
+            for(int i = 1; i < count; i++) {
+                for(int j = i; j > 0 && childT[j] > childT[j - 1]; j--) {
+                    swap(childT[j], childT[j - 1]);
+                    swap(children[j], children[j - 1]);
+                }
+            }
+
+            for(int i = 0; i < count; i++) stack[top++] = children[i];
+        }
+
+        return -1.0f;
+    }
+
+    int getResolution() const { return resolution; }
+
+    void createBuffer(VkDevice device, VkPhysicalDevice physicalDevice, VkCommandPool transferPool, VkQueue transferQueue) {
+        buf.createBuffer(device, physicalDevice, stats.bytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+        buf.populateBuffer(device, physicalDevice, nodes.data(), stats.bytes, transferPool, transferQueue);
+    }
+
+    void destroy(VkDevice device) {
+        buf.destroy(device);
+    }
+
+    private:
+
+    int depth = 0;
+    int resolution = 0;
+
+    //Morton code to cell, x takes the highest bit of each triple like the child index
+    static void decode(uint64_t code, int& x, int& y, int& z) {
+        x = y = z = 0;
+        for(int bit = 0; code != 0; bit++, code >>= 3) {
+            x |= (int)((code >> 2) & 1) << bit;
+            y |= (int)((code >> 1) & 1) << bit;
+            z |= (int)(code & 1) << bit;
+        }
+    }
+
+    static bool slabs(glm::vec3 bMin, glm::vec3 bMax, glm::vec3 origin, glm::vec3 invDir, float& tNear, float& tFar) {
+        glm::vec3 t0 = (bMin - origin) * invDir;
+        glm::vec3 t1 = (bMax - origin) * invDir;
+
+        glm::vec3 tmin = glm::min(t0, t1);
+        glm::vec3 tmax = glm::max(t0, t1);
+
+        tNear = std::max(std::max(tmin.x, tmin.y), tmin.z);
+        tFar = std::min(std::min(tmax.x, tmax.y), tmax.z);
+
+        return tFar >= std::max(tNear, 0.0f);
+    }
+};
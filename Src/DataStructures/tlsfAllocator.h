@@ -0,0 +1,316 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+struct TlsfAllocation {
+    uint64_t offset;
+    uint32_t node; //What free takes back, NO_NODE when nothing fit
+};
+
+struct TlsfStats {
+    uint64_t capacity;
+    uint64_t usedBytes;
+    uint64_t freeBytes;
+    uint64_t largestFreeBlock;
+    uint32_t allocationCount;
+    uint32_t freeBlockCount;
+
+    double utilisation() const { return capacity ? (double)usedBytes / capacity : 0.0; }
+
+    //0 while the free space is one range, towards 1 the more it is cut up between allocations
+    double fragmentation() const { return freeBytes ? 1.0 - (double)largestFreeBlock / freeBytes : 0.0; }
+};
+
+//Two level segregated fit over the offsets [0, capacity) of some range it never touches, a VkDeviceMemory block in DeviceMemoryAllocator.
+//Free ranges sit in lists by size, the first level picks the power of two and the second splits that in SL_COUNT steps. A bitmap per level finds
+//the smallest list that is sure to fit, so allocating and freeing, merging with free neighbours, are both constant time.
+//The book keeping is all on the side, nothing is written in to the range itself
+class TlsfAllocator {
+    public:
+
+    static const uint32_t NO_NODE = 0xFFFFFFFFu;
+
+    void create(uint64_t _capacity) {
+        capacity = _capacity;
+        nodes.clear();
+        spareNodes.clear();
+        flBitmap = 0;
+        for(uint32_t fl = 0; fl < FL_COUNT; fl++) {
+            slBitmaps[fl] = 0;
+            for(uint32_t sl = 0; sl < SL_COUNT; sl++) heads[fl][sl] = NO_NODE;
+        }
+
+        usedBytes = 0;
+        allocationCount = 0;
+        freeBlockCount = 0;
+
+        if(capacity == 0) return;
+
+        uint32_t node = newNode();
+        nodes[node].offset = 0;
+        nodes[node].size = capacity;
+        insertFree(node);
+    }
+
+    //alignment has to be a power of two. The padding in front of an aligned allocation stays free, it is not part of the allocation
+    TlsfAllocation allocate(uint64_t size, uint64_t alignment = 1) {
+        if(size == 0) size = 1;
+        if(alignment == 0) alignment = 1;
+        if(size > capacity) return {0, NO_NODE};
+
+        //Any block in the list found for size + alignment - 1 has an aligned start with size behind it
+        uint64_t searchSize = alignment > 1 ? size + alignment - 1 : size;
+        uint32_t node = findFree(searchSize);
+
+        //Nothing in a list that is sure to fit. A range that only just fits sits in the list holding size or searchSize, a dedicated block sized
+        //to its one allocation among them, so those two are walked
+        if(node == NO_NODE) node = findFit(size, alignment);
+        if(node == NO_NODE) node = findFit(searchSize, alignment, size);
+        if(node == NO_NODE) return {0, NO_NODE};
+
+        removeFree(node);
+
+        uint64_t aligned = (nodes[node].offset + alignment - 1) & ~(alignment - 1);
+        uint64_t padding = aligned - nodes[node].offset;
+
+        if(padding > 0) {
+            uint32_t front = newNode();
+            nodes[front].offset = nodes[node].offset;
+            nodes[front].size = padding;
+            linkBefore(front, node);
+
+            nodes[node].offset = aligned;
+            nodes[node].size -= padding;
+            insertFree(front);
+        }
+
+        if(nodes[node].size > size) {
+            uint32_t back = newNode();
+            nodes[back].offset = aligned + size;
+            nodes[back].size = nodes[node].size - size;
+            linkAfter(back, node);
+
+            nodes[node].size = size;
+            insertFree(back);
+        }
+
+        nodes[node].free = false;
+        usedBytes += size;
+        allocationCount++;
+
+        return {aligned, node};
+    }
+
+    void free(uint32_t node) {
+        usedBytes -= nodes[node].size;
+        allocationCount--;
+
+        uint32_t prev = nodes[node].prevPhys;
+        if(prev != NO_NODE && nodes[prev].free) {
+            removeFree(prev);
+            nodes[prev].size += nodes[node].size;
+            unlink(node);
+            node = prev;
+        }
+
+        uint32_t next = nodes[node].nextPhys;
+        if(next != NO_NODE && nodes[next].free) {
+            removeFree(next);
+            nodes[node].size += nodes[next].size;
+            unlink(next);
+        }
+
+        insertFree(node);
+    }
+
+    uint64_t size(uint32_t node) const { return nodes[node].size; }
+    bool empty() const { return allocationCount == 0; }
+
+    TlsfStats stats() const {
+        TlsfStats stats{};
+        stats.capacity = capacity;
+        stats.usedBytes = usedBytes;
+        stats.freeBytes = capacity - usedBytes;
+        stats.allocationCount = allocationCount;
+        stats.freeBlockCount = freeBlockCount;
+
+        //The largest free block is in the highest list that has any
+        if(flBitmap != 0) {
+            uint32_t fl = msb(flBitmap);
+            uint32_t sl = msb(slBitmaps[fl]);
+            for(uint32_t node = heads[fl][sl]; node != NO_NODE; node = nodes[node].nextFree) {
+                if(nodes[node].size > stats.largestFreeBlock) stats.largestFreeBlock = nodes[node].size;
+            }
+        }
+
+        return stats;
+    }
+
+    private:
+
+    static const uint32_t SL_BITS = 5;
+    static const uint32_t SL_COUNT = 1u << SL_BITS;
+
+    //Sizes below SL_COUNT all share level 0, one list per size. Level fl above holds [2^(fl + SL_BITS - 1), 2^(fl + SL_BITS))
+    static const uint32_t FL_COUNT = 64 - SL_BITS + 1;
+
+    struct Node {
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        uint32_t prevPhys = NO_NODE;
+        uint32_t nextPhys = NO_NODE;
+        uint32_t prevFree = NO_NODE;
+        uint32_t nextFree = NO_NODE;
+        bool free = false;
+    };
+
+    uint64_t capacity = 0;
+    vector<Node> nodes;
+    vector<uint32_t> spareNodes;
+
+    uint64_t flBitmap = 0;
+    uint32_t slBitmaps[FL_COUNT];
+    uint32_t heads[FL_COUNT][SL_COUNT];
+
+    uint64_t usedBytes = 0;
+    uint32_t allocationCount = 0;
+    uint32_t freeBlockCount = 0;
+
+    static uint32_t msb(uint64_t v) {
+        uint32_t bit = 0;
+        for(uint32_t shift = 32; shift > 0; shift >>= 1) {
+            if(v >> shift) {
+                v >>= shift;
+                bit += shift;
+            }
+        }
+        return bit;
+    }
+
+    static uint32_t lsb(uint64_t v) { return msb(v & (~v + 1)); }
+
+    static void mapping(uint64_t size, uint32_t& fl, uint32_t& sl) {
+        if(size < SL_COUNT) {
+            fl = 0;
+            sl = (uint32_t)size;
+            return;
+        }
+
+        uint32_t top = msb(size);
+        fl = top - SL_BITS + 1;
+        sl = (uint32_t)(size >> (top - SL_BITS)) - SL_COUNT;
+    }
+
+    //First free block in the smallest list whose every block holds size. Rounding size up to the next list start is what makes that hold
+    uint32_t findFree(uint64_t size) const {
+        if(size >= SL_COUNT) {
+            uint64_t step = 1ull << (msb(size) - SL_BITS);
+            if(size > UINT64_MAX - step) return NO_NODE;
+            size += step - 1;
+        }
+
+        uint32_t fl, sl;
+        mapping(size, fl, sl);
+        if(fl >= FL_COUNT) return NO_NODE;
+
+        uint32_t slMap = slBitmaps[fl] & (~0u << sl);
+        if(slMap == 0) {
+            uint64_t flMap = fl + 1 < 64 ? flBitmap & (~0ull << (fl + 1)) : 0;
+            if(flMap == 0) return NO_NODE;
+
+            fl = lsb(flMap);
+            slMap = slBitmaps[fl];
+        }
+
+        return heads[fl][lsb(slMap)];
+    }
+
+    //First free block in the list holding listSize that has size behind its aligned start
+    uint32_t findFit(uint64_t listSize, uint64_t alignment, uint64_t size = 0) const {
+        if(size == 0) size = listSize;
+
+        uint32_t fl, sl;
+        mapping(listSize, fl, sl);
+        if(fl >= FL_COUNT) return NO_NODE;
+
+        for(uint32_t node = heads[fl][sl]; node != NO_NODE; node = nodes[node].nextFree) {
+            uint64_t aligned = (nodes[node].offset + alignment - 1) & ~(alignment - 1);
+            if(aligned + size <= nodes[node].offset + nodes[node].size) return node;
+        }
+
+        return NO_NODE;
+    }
+
+    void insertFree(uint32_t node) {
+        uint32_t fl, sl;
+        mapping(nodes[node].size, fl, sl);
+
+        nodes[node].free = true;
+        nodes[node].prevFree = NO_NODE;
+        nodes[node].nextFree = heads[fl][sl];
+        if(heads[fl][sl] != NO_NODE) nodes[heads[fl][sl]].prevFree = node;
+        heads[fl][sl] = node;
+
+        slBitmaps[fl] |= 1u << sl;
+        flBitmap |= 1ull << fl;
+        freeBlockCount++;
+    }
+
+    void removeFree(uint32_t node) {
+        uint32_t fl, sl;
+        mapping(nodes[node].size, fl, sl);
+
+        Node& n = nodes[node];
+        if(n.prevFree != NO_NODE) nodes[n.prevFree].nextFree = n.nextFree;
+        else heads[fl][sl] = n.nextFree;
+        if(n.nextFree != NO_NODE) nodes[n.nextFree].prevFree = n.prevFree;
+
+        if(heads[fl][sl] == NO_NODE) {
+            slBitmaps[fl] &= ~(1u << sl);
+            if(slBitmaps[fl] == 0) flBitmap &= ~(1ull << fl);
+        }
+
+        n.free = false;
+        n.prevFree = NO_NODE;
+        n.nextFree = NO_NODE;
+        freeBlockCount--;
+    }
+
+    uint32_t newNode() {
+        if(!spareNodes.empty()) {
+            uint32_t node = spareNodes.back();
+            spareNodes.pop_back();
+            nodes[node] = Node{};
+            return node;
+        }
+
+        nodes.emplace_back();
+        return (uint32_t)nodes.size() - 1;
+    }
+
+    void linkBefore(uint32_t node, uint32_t next) {
+        nodes[node].prevPhys = nodes[next].prevPhys;
+        nodes[node].nextPhys = next;
+        if(nodes[next].prevPhys != NO_NODE) nodes[nodes[next].prevPhys].nextPhys = node;
+        nodes[next].prevPhys = node;
+    }
+
+    void linkAfter(uint32_t node, uint32_t prev) {
+        nodes[node].nextPhys = nodes[prev].nextPhys;
+        nodes[node].prevPhys = prev;
+        if(nodes[prev].nextPhys != NO_NODE) nodes[nodes[prev].nextPhys].prevPhys = node;
+        nodes[prev].nextPhys = node;
+    }
+
+    //Takes a node that was merged in to a neighbour out of the physical order
+    void unlink(uint32_t node) {
+        Node& n = nodes[node];
+        if(n.prevPhys != NO_NODE) nodes[n.prevPhys].nextPhys = n.nextPhys;
+        if(n.nextPhys != NO_NODE) nodes[n.nextPhys].prevPhys = n.prevPhys;
+        n = Node{};
+        spareNodes.push_back(node);
+    }
+};
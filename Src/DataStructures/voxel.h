@@ -1,3 +1,8 @@
+#pragma once
+
+#include <cstdint>
+
+//Index in to the scene palette, 0 is air
 struct Voxel {
-    int colour;
+    uint8_t colour;
 };
\ No newline at end of file
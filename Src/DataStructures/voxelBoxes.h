@@ -0,0 +1,108 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+//Solid box of voxels, max is exclusive
+struct VoxelBox {
+    glm::ivec3 min;
+    glm::ivec3 max;
+};
+
+struct VoxelBoxStats {
+    double buildMilliseconds;
+    uint32_t boxCount;
+    uint32_t solidVoxels;
+
+    double voxelsPerBox() const { return boxCount ? (double)solidVoxels / boxCount : 0.0; }
+};
+
+//Covers the solid voxels of a size^3 grid with few boxes, every solid voxel in exactly one and no air in any.
+//Greedy: the first open voxel in x, y, z order grows as far as it can along z, then y, then x. Not minimal, but close on terrain and linear in the voxel count.
+//The boxes become the AABB primitives of a chunk blas, so the hardware bvh culls the air instead of the intersection shader
+class VoxelBoxes {
+    public:
+
+    vector<VoxelBox> boxes;
+    VoxelBoxStats stats{};
+
+    //FNV-1a over the box corners. The boxes only depend on which voxels are solid, so two grids with the same shape get the same hash whatever their colours
+    uint64_t contentHash = 0;
+
+    void build(int size, const function<bool(int, int, int)>& solidAt) {
+        auto start = chrono::high_resolution_clock::now();
+
+        boxes.clear();
+        stats.solidVoxels = 0;
+
+        //Solid and not in a box yet
+        vector<uint8_t> open((size_t)size * size * size, 0);
+        auto index = [size](int x, int y, int z) { return ((size_t)x * size + y) * size + z; };
+
+        for(int x = 0; x < size; x++) {
+            for(int y = 0; y < size; y++) {
+                for(int z = 0; z < size; z++) {
+                    if(!solidAt(x, y, z)) continue;
+                    open[index(x, y, z)] = 1;
+                    stats.solidVoxels++;
+                }
+            }
+        }
+
+        auto rowOpen = [&](int x, int y, int z0, int z1) {
+            for(int z = z0; z < z1; z++) if(!open[index(x, y, z)]) return false;
+            return true;
+        };
+
+        for(int x = 0; x < size; x++) {
+            for(int y = 0; y < size; y++) {
+                for(int z = 0; z < size; z++) {
+                    if(!open[index(x, y, z)]) continue;
+
+                    int z1 = z + 1;
+                    while(z1 < size && open[index(x, y, z1)]) z1++;
+
+                    int y1 = y + 1;
+                    while(y1 < size && rowOpen(x, y1, z, z1)) y1++;
+
+                    int x1 = x + 1;
+                    while(x1 < size) {
+                        bool slab = true;
+                        for(int sy = y; sy < y1 && slab; sy++) slab = rowOpen(x1, sy, z, z1);
+                        if(!slab) break;
+                        x1++;
+                    }
+
+                    for(int bx = x; bx < x1; bx++) {
+                        for(int by = y; by < y1; by++) {
+                            for(int bz = z; bz < z1; bz++) open[index(bx, by, bz)] = 0;
+                        }
+                    }
+
+                    boxes.push_back({glm::ivec3(x, y, z), glm::ivec3(x1, y1, z1)});
+                }
+            }
+        }
+
+        contentHash = 0xCBF29CE484222325ull;
+        for(const VoxelBox& box : boxes) {
+            const int corners[6] = {box.min.x, box.min.y, box.min.z, box.max.x, box.max.y, box.max.z};
+            for(int c : corners) {
+                contentHash ^= (uint32_t)c;
+                contentHash *= 0x100000001B3ull;
+            }
+        }
+
+        auto end = chrono::high_resolution_clock::now();
+
+        stats.buildMilliseconds = chrono::duration<double, milli>(end - start).count();
+        stats.boxCount = (uint32_t)boxes.size();
+    }
+
+    size_t bytes() const { return boxes.size() * sizeof(VoxelBox); }
+};
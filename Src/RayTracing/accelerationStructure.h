@@ -1,7 +1,13 @@
 
 #include <vulkan/vulkan_core.h>
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <iostream>
+#include <thread>
 #include <vector>
 #include "../buffer.h"
+#include "../DataStructures/parallelFor.h"
 
 #define LOAD_FUNC(device, name) \
 name = (PFN_##name)vkGetDeviceProcAddr(device, #name); \
@@ -15,6 +21,15 @@ struct PackedInstanceKHR {
 };
 
 
+//Input for one blas of a batched build, primitiveCount VkAabbPositionsKHR at aabbAddress. Host builds read the same boxes from hostBoxes instead
+struct BlasGeometry {
+    VkDeviceAddress aabbAddress;
+    uint32_t primitiveCount;
+    const VkAabbPositionsKHR* hostBoxes = nullptr;
+};
+
+struct BlasBatch;
+
 struct AccelerationStructure {
     VkAccelerationStructureKHR handle;
     Buffer buffer;
@@ -25,10 +40,27 @@ struct AccelerationStructure {
     static inline PFN_vkCreateAccelerationStructureKHR vkCreateAccelerationStructureKHR = nullptr;
     static inline PFN_vkCmdBuildAccelerationStructuresKHR vkCmdBuildAccelerationStructuresKHR = nullptr;
     static inline PFN_vkDestroyAccelerationStructureKHR vkDestroyAccelerationStructureKHR = nullptr;
+    static inline PFN_vkCmdWriteAccelerationStructuresPropertiesKHR vkCmdWriteAccelerationStructuresPropertiesKHR = nullptr;
+    static inline PFN_vkCmdCopyAccelerationStructureKHR vkCmdCopyAccelerationStructureKHR = nullptr;
+
+    //Host builds through VK_KHR_deferred_host_operations
+    static inline PFN_vkBuildAccelerationStructuresKHR vkBuildAccelerationStructuresKHR = nullptr;
+    static inline PFN_vkWriteAccelerationStructuresPropertiesKHR vkWriteAccelerationStructuresPropertiesKHR = nullptr;
+    static inline PFN_vkCreateDeferredOperationKHR vkCreateDeferredOperationKHR = nullptr;
+    static inline PFN_vkDestroyDeferredOperationKHR vkDestroyDeferredOperationKHR = nullptr;
+    static inline PFN_vkGetDeferredOperationMaxConcurrencyKHR vkGetDeferredOperationMaxConcurrencyKHR = nullptr;
+    static inline PFN_vkDeferredOperationJoinKHR vkDeferredOperationJoinKHR = nullptr;
+    static inline PFN_vkGetDeferredOperationResultKHR vkGetDeferredOperationResultKHR = nullptr;
+
+    //accelerationStructureHostCommands, the application enables it whenever the device has it
+    static inline bool hostCommands = false;
 
     static inline VkDevice device = nullptr;
     static inline VkPhysicalDevice physicalDevice = nullptr;
 
+    //Every build in a batch gets its own slice of one scratch buffer, each slice has to start on this
+    static inline VkDeviceSize scratchAlignment = 256;
+
     static void loadFunctions(VkDevice device, VkPhysicalDevice physicalDevice) {
         AccelerationStructure::device = device;
         AccelerationStructure::physicalDevice = physicalDevice;
@@ -38,6 +70,35 @@ struct AccelerationStructure {
         LOAD_FUNC(device, vkCreateAccelerationStructureKHR);
         LOAD_FUNC(device, vkCmdBuildAccelerationStructuresKHR);
         LOAD_FUNC(device, vkDestroyAccelerationStructureKHR);
+        LOAD_FUNC(device, vkCmdWriteAccelerationStructuresPropertiesKHR);
+        LOAD_FUNC(device, vkCmdCopyAccelerationStructureKHR);
+        LOAD_FUNC(device, vkBuildAccelerationStructuresKHR);
+        LOAD_FUNC(device, vkWriteAccelerationStructuresPropertiesKHR);
+        LOAD_FUNC(device, vkCreateDeferredOperationKHR);
+        LOAD_FUNC(device, vkDestroyDeferredOperationKHR);
+        LOAD_FUNC(device, vkGetDeferredOperationMaxConcurrencyKHR);
+        LOAD_FUNC(device, vkDeferredOperationJoinKHR);
+        LOAD_FUNC(device, vkGetDeferredOperationResultKHR);
+
+        VkPhysicalDeviceAccelerationStructureFeaturesKHR asFeatures{};
+        asFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
+
+        VkPhysicalDeviceFeatures2 features{};
+        features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features.pNext = &asFeatures;
+        vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+
+        hostCommands = asFeatures.accelerationStructureHostCommands == VK_TRUE;
+
+        VkPhysicalDeviceAccelerationStructurePropertiesKHR asProperties{};
+        asProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR;
+
+        VkPhysicalDeviceProperties2 properties{};
+        properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+        properties.pNext = &asProperties;
+        vkGetPhysicalDeviceProperties2(physicalDevice, &properties);
+
+        scratchAlignment = std::max<VkDeviceSize>(1, asProperties.minAccelerationStructureScratchOffsetAlignment);
     }
 
     static VkDeviceAddress getBLASAddress(AccelerationStructure* acccelerationStructure) {
@@ -48,221 +109,753 @@ struct AccelerationStructure {
         return vkGetAccelerationStructureDeviceAddressKHR(device, &addressInfo);
     }
 
-    //For future reference: once multiple blases will be be built, all data will be accuired from one huge buffer and hence the offesets and buildrangeinfo will be used. not yet done
-    static AccelerationStructure createBottomLevelAccelereationStructure(Buffer boundingBoxBuffer, VkCommandPool buildPool, VkQueue buildQueue) {
+    //Builds a blas over primitiveCount VkAabbPositionsKHR starting at aabbAddress and waits for it. The caller owns the boxes and has to keep them alive until then
+    static AccelerationStructure createBottomLevelAccelereationStructure(VkDeviceAddress aabbAddress, uint32_t primitiveCount, VkCommandPool buildPool, VkQueue buildQueue);
 
-        //Fill in the geometry struct which contains the data we wanna turn in to BLAS
-        VkAccelerationStructureGeometryAabbsDataKHR aabbData{};
-        aabbData.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_AABBS_DATA_KHR;
-        aabbData.data.deviceAddress = boundingBoxBuffer.getBufferAddress(device);
-        aabbData.stride = sizeof(VkAabbPositionsKHR);
-        aabbData.pNext = nullptr;
+    //Builds every blas in one vkCmdBuildAccelerationStructuresKHR call with one shared scratch buffer, see BlasBatch.
+    //With compact the blases are built to allow compaction and BlasBatch::wait copies each in to a buffer of its compacted size
+    static BlasBatch createBottomLevelAccelerationStructures(const std::vector<BlasGeometry>& geometries, VkCommandPool buildPool, VkQueue buildQueue, bool compact = false);
 
-        //More info on this shit
-        VkAccelerationStructureGeometryKHR geometry{};
-        geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-        geometry.geometryType = VK_GEOMETRY_TYPE_AABBS_KHR;
-        geometry.geometry.aabbs = aabbData;
-        geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-        geometry.pNext = nullptr;
-
-        //Gives info on how the data is laid out
-        VkAccelerationStructureBuildRangeInfoKHR buildRangeInfo{};
-        buildRangeInfo.primitiveCount = 1;
-        buildRangeInfo.primitiveOffset = 0;
-        buildRangeInfo.transformOffset = 0;
-        buildRangeInfo.firstVertex = 0;
-
-        //Information on how this data needs to be built
-        VkAccelerationStructureBuildGeometryInfoKHR buildGeometryInfo{};
-        buildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-        buildGeometryInfo.pNext = nullptr;
-        buildGeometryInfo.srcAccelerationStructure = VK_NULL_HANDLE;
-        buildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-        buildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-        buildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-        buildGeometryInfo.geometryCount = 1;
-        buildGeometryInfo.pGeometries = &geometry;
-        buildGeometryInfo.ppGeometries = nullptr;
-
-        //Gets the information on the size of scratch buffer and the size of accceleration structure in memory
-        VkAccelerationStructureBuildSizesInfoKHR sizeInfo{};
-        sizeInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-        uint32_t count = 1;
-        vkGetAccelerationStructureBuildSizesKHR(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildGeometryInfo, &count, &sizeInfo);
-
-        //Make a scratch buffer from the info gathered
-        Buffer scratchBuffer;
-        scratchBuffer.createBuffer(device, physicalDevice, sizeInfo.buildScratchSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
-
-        //assign the scratch buffer
-        buildGeometryInfo.scratchData.deviceAddress = scratchBuffer.getBufferAddress(device);
-        
-        //make the buffer in which the acceleration strcuture will reside
-        Buffer accelerationStructureBuffer;
-        accelerationStructureBuffer.createBuffer(device, physicalDevice, sizeInfo.accelerationStructureSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
-
-        //create the acceleration struture 
-        VkAccelerationStructureCreateInfoKHR accelerationCreateInfo;
-        accelerationCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
-        accelerationCreateInfo.buffer = accelerationStructureBuffer.handle;
-        accelerationCreateInfo.size = sizeInfo.accelerationStructureSize;
-        accelerationCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-        accelerationCreateInfo.pNext = VK_NULL_HANDLE;
-        accelerationCreateInfo.offset = 0;
-        accelerationCreateInfo.createFlags = 0;
-        accelerationCreateInfo.deviceAddress = 0;
-
-        VkAccelerationStructureKHR accelerationStructure;
-        vkCreateAccelerationStructureKHR(device, &accelerationCreateInfo, nullptr, &accelerationStructure);
-
-        buildGeometryInfo.dstAccelerationStructure = accelerationStructure;
-
-        //FINALLY send the acceleration strucuture off the the gpu where it is built and will stay for the rest of its life before it is destoryed 
-        VkAccelerationStructureBuildRangeInfoKHR* infos[] = { &buildRangeInfo };
-
-        CommandBuffer commandBuffer;
-        commandBuffer.createCommandBuffer(device, buildPool);
+    //Same build recorded in to commandBuffer, for whoever submits it to finish, see BlasBatch
+    static BlasBatch recordBottomLevelAccelerationStructures(const std::vector<BlasGeometry>& geometries, VkCommandBuffer commandBuffer, bool compact = false);
+
+    //Builds every blas on the cpu from hostBoxes, split in to deferred operations that every core joins, and returns once they are built.
+    //The builds land in host visible memory, uploadCommands gets a copy of each in to a device local blas, compacted straight away with compact. Needs hostCommands
+    static BlasBatch buildBottomLevelAccelerationStructuresOnHost(const std::vector<BlasGeometry>& geometries, VkCommandBuffer uploadCommands, bool compact = false);
+
+    static void destroyAccelerationStructure(AccelerationStructure accelerationStructure) {
+        accelerationStructure.buffer.destroy(device);
+        vkDestroyAccelerationStructureKHR(device, accelerationStructure.handle, nullptr);
+    }
+};
+
+//Blases recorded by one batched build. The handles can be used right away to fill in instances, but the gpu is only done building once the build is.
+//A batch the builder submitted itself signals fence, wait() blocks on it, frees the scratch and command buffer and compacts, all before a tlas over these blases is built.
+//A batch recorded in to someone else's command buffer is finished by its owner: releaseScratch once the build is done, then recordCompaction if it compacts.
+//Compacting swaps every blas for a compacted copy, so only read blases after that. A host built batch is finished the same way, it never has anything to compact
+struct BlasBatch {
+    std::vector<AccelerationStructure> blases;
+    std::vector<VkDeviceSize> sizes; //Bytes of each blas, the compacted size once compacted
+    VkDeviceSize scratchBytes = 0;
+
+    //Host built blases the upload copies from
+    std::vector<AccelerationStructure> staging;
+
+    Buffer scratchBuffer;
+    CommandBuffer commandBuffer;
+    VkCommandPool pool = VK_NULL_HANDLE;
+    VkQueue queue = VK_NULL_HANDLE;
+    VkFence fence = VK_NULL_HANDLE;
+
+    //Compacted sizes, written by the build command buffer. Null when the batch does not compact
+    VkQueryPool queryPool = VK_NULL_HANDLE;
+
+    void wait() {
+        if(fence == VK_NULL_HANDLE) return;
+
+        VkDevice device = AccelerationStructure::device;
+        vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+        vkDestroyFence(device, fence, nullptr);
+        fence = VK_NULL_HANDLE;
+
+        commandBuffer.freeCommandBuffer(device, pool);
+        releaseScratch();
+
+        if(queryPool != VK_NULL_HANDLE) compact();
+    }
+
+    //Everything only the build itself reads
+    void releaseScratch() {
+        if(scratchBytes > 0) scratchBuffer.destroy(AccelerationStructure::device);
+        scratchBytes = 0;
+
+        for(AccelerationStructure& blas : staging) AccelerationStructure::destroyAccelerationStructure(blas);
+        staging.clear();
+    }
+
+    //Only once the build is done. Records a copy of every blas in to a right sized buffer and swaps them in.
+    //Returns the originals, which the copies still read until commandBuffer has run
+    std::vector<AccelerationStructure> recordCompaction(VkCommandBuffer commandBuffer) {
+        VkDevice device = AccelerationStructure::device;
+        VkPhysicalDevice physicalDevice = AccelerationStructure::physicalDevice;
+        uint32_t count = (uint32_t)blases.size();
+
+        std::vector<VkDeviceSize> compactSizes(count);
+        vkGetQueryPoolResults(device, queryPool, 0, count, count * sizeof(VkDeviceSize), compactSizes.data(), sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+        vkDestroyQueryPool(device, queryPool, nullptr);
+        queryPool = VK_NULL_HANDLE;
+
+        std::vector<AccelerationStructure> compacted(count);
+
+        for(uint32_t i = 0; i < count; i++) {
+            compacted[i].buffer.createBuffer(device, physicalDevice, compactSizes[i], VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+
+            VkAccelerationStructureCreateInfoKHR createInfo{};
+            createInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+            createInfo.buffer = compacted[i].buffer.handle;
+            createInfo.size = compactSizes[i];
+            createInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+
+            AccelerationStructure::vkCreateAccelerationStructureKHR(device, &createInfo, nullptr, &compacted[i].handle);
+
+            VkCopyAccelerationStructureInfoKHR copyInfo{};
+            copyInfo.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR;
+            copyInfo.src = blases[i].handle;
+            copyInfo.dst = compacted[i].handle;
+            copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+
+            AccelerationStructure::vkCmdCopyAccelerationStructureKHR(commandBuffer, &copyInfo);
+        }
+
+        VkDeviceSize before = 0, after = 0;
+        for(uint32_t i = 0; i < count; i++) {
+            before += sizes[i];
+            after += compactSizes[i];
+        }
+
+        std::vector<AccelerationStructure> originals = blases;
+        blases = compacted;
+        sizes = compactSizes;
+
+        std::cout << "Compacted " << count << " blases from " << before << " to " << after << " bytes, " << before - after << " saved" << std::endl;
+
+        return originals;
+    }
+
+    private:
+
+    //Compacts in one submission of its own and waits for it
+    void compact() {
+        VkDevice device = AccelerationStructure::device;
+
+        commandBuffer.createCommandBuffer(device, pool);
         commandBuffer.beginRecording(true);
 
-        vkCmdBuildAccelerationStructuresKHR(commandBuffer.handle, 1, &buildGeometryInfo, (VkAccelerationStructureBuildRangeInfoKHR* const*)&infos);
+        std::vector<AccelerationStructure> originals = recordCompaction(commandBuffer.handle);
 
         commandBuffer.endRecording();
 
-        //submit to the queue
+        VkFenceCreateInfo fenceInfo{};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        vkCreateFence(device, &fenceInfo, nullptr, &fence);
+
         VkSubmitInfo submitInfo{};
         submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
         submitInfo.commandBufferCount = 1;
         submitInfo.pCommandBuffers = &commandBuffer.handle;
 
-        vkQueueSubmit(buildQueue, 1, &submitInfo, VK_NULL_HANDLE);
+        vkQueueSubmit(queue, 1, &submitInfo, fence);
+        vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+        vkDestroyFence(device, fence, nullptr);
+        fence = VK_NULL_HANDLE;
 
-        vkQueueWaitIdle(buildQueue);
+        commandBuffer.freeCommandBuffer(device, pool);
 
-        //Destroy all the useless shit
-        scratchBuffer.destroy(device);
-        boundingBoxBuffer.destroy(device);
+        for(AccelerationStructure& original : originals) AccelerationStructure::destroyAccelerationStructure(original);
+    }
+};
+
+inline BlasBatch AccelerationStructure::recordBottomLevelAccelerationStructures(const std::vector<BlasGeometry>& geometries, VkCommandBuffer commandBuffer, bool compact) {
+    BlasBatch batch;
+    if(geometries.empty()) return batch;
 
-        return {accelerationStructure, accelerationStructureBuffer};
+    size_t count = geometries.size();
 
+    //Filled in place, the build infos point in to these so they can not move after this
+    std::vector<VkAccelerationStructureGeometryKHR> asGeometries(count);
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildInfos(count);
+    std::vector<VkAccelerationStructureBuildRangeInfoKHR> buildRanges(count);
+    std::vector<VkAccelerationStructureBuildRangeInfoKHR*> rangePointers(count);
+    std::vector<VkDeviceSize> scratchOffsets(count);
+
+    for(size_t i = 0; i < count; i++) {
+        VkAccelerationStructureGeometryKHR& geometry = asGeometries[i];
+        geometry = {};
+        geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+        geometry.geometryType = VK_GEOMETRY_TYPE_AABBS_KHR;
+        geometry.geometry.aabbs.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_AABBS_DATA_KHR;
+        geometry.geometry.aabbs.data.deviceAddress = geometries[i].aabbAddress;
+        geometry.geometry.aabbs.stride = sizeof(VkAabbPositionsKHR);
+        geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+
+        buildRanges[i] = {};
+        buildRanges[i].primitiveCount = geometries[i].primitiveCount;
+        rangePointers[i] = &buildRanges[i];
+
+        VkAccelerationStructureBuildGeometryInfoKHR& buildInfo = buildInfos[i];
+        buildInfo = {};
+        buildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        buildInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+        if(compact) buildInfo.flags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+        buildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+        buildInfo.geometryCount = 1;
+        buildInfo.pGeometries = &geometry;
+
+        VkAccelerationStructureBuildSizesInfoKHR sizeInfo{};
+        sizeInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+        uint32_t primitiveCount = geometries[i].primitiveCount;
+        vkGetAccelerationStructureBuildSizesKHR(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo, &primitiveCount, &sizeInfo);
+
+        //Builds in one call can run at the same time, so every one gets its own aligned slice of the arena
+        scratchOffsets[i] = batch.scratchBytes;
+        batch.scratchBytes += (sizeInfo.buildScratchSize + scratchAlignment - 1) / scratchAlignment * scratchAlignment;
+
+        AccelerationStructure blas;
+        blas.buffer.createBuffer(device, physicalDevice, sizeInfo.accelerationStructureSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+
+        VkAccelerationStructureCreateInfoKHR createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+        createInfo.buffer = blas.buffer.handle;
+        createInfo.size = sizeInfo.accelerationStructureSize;
+        createInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+
+        vkCreateAccelerationStructureKHR(device, &createInfo, nullptr, &blas.handle);
+
+        buildInfo.dstAccelerationStructure = blas.handle;
+        batch.blases.push_back(blas);
+        batch.sizes.push_back(sizeInfo.accelerationStructureSize);
+    }
+
+    //One arena for the whole batch. Padded by one alignment so the base address can be rounded up as well
+    if(batch.scratchBytes > 0) {
+        batch.scratchBuffer.createBuffer(device, physicalDevice, batch.scratchBytes + scratchAlignment, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+
+        VkDeviceAddress scratchBase = batch.scratchBuffer.getBufferAddress(device);
+        scratchBase = (scratchBase + scratchAlignment - 1) / scratchAlignment * scratchAlignment;
+
+        for(size_t i = 0; i < count; i++) buildInfos[i].scratchData.deviceAddress = scratchBase + scratchOffsets[i];
     }
 
-    static AccelerationStructure createTopLevelAccelerationStructure(std::vector<AccelerationStructure> blases, std::vector<VkTransformMatrixKHR> transforms, VkCommandPool buildPool, VkQueue buildQueue, VkCommandPool transferPool, VkQueue transferQueue) {
-        std::vector<VkAccelerationStructureInstanceKHR> instances;
-
-        for(int i = 0; i < blases.size(); i++) {
-            /*PackedInstanceKHR instance;
-            memcpy(&instance.transform, &transforms[i], 48);
-            instance.blasDeviceAddress = getBLASAddress(&blases[i]);
-            instance.customIndex_mask = (1 << 24) | (0xFF);
-            instance.sbtRecordOffset_flags = VK_GEOMETRY_INSTANCE_FORCE_OPAQUE_BIT_KHR << 24; // leaving sbt offest as 0*/
-
-            VkAccelerationStructureInstanceKHR instance{};
-		    instance.transform = transforms[i];
-		    instance.instanceCustomIndex = 0;
-		    instance.mask = 0xFF;
-		    instance.instanceShaderBindingTableRecordOffset = 0;
-		    instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
-		    instance.accelerationStructureReference = getBLASAddress(&blases[i]);
-
-            instances.push_back(instance);
+    vkCmdBuildAccelerationStructuresKHR(commandBuffer, (uint32_t)count, buildInfos.data(), rangePointers.data());
+
+    //Compacted sizes are only known once the builds finish, so they are written by the same command buffer after a barrier and read back when compacting
+    if(compact) {
+        VkQueryPoolCreateInfo queryInfo{};
+        queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryInfo.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+        queryInfo.queryCount = (uint32_t)count;
+        vkCreateQueryPool(device, &queryInfo, nullptr, &batch.queryPool);
+
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+        barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        std::vector<VkAccelerationStructureKHR> handles;
+        for(const AccelerationStructure& blas : batch.blases) handles.push_back(blas.handle);
+
+        vkCmdResetQueryPool(commandBuffer, batch.queryPool, 0, (uint32_t)count);
+        vkCmdWriteAccelerationStructuresPropertiesKHR(commandBuffer, (uint32_t)count, handles.data(), VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, batch.queryPool, 0);
+    }
+
+    return batch;
+}
+
+inline BlasBatch AccelerationStructure::buildBottomLevelAccelerationStructuresOnHost(const std::vector<BlasGeometry>& geometries, VkCommandBuffer uploadCommands, bool compact) {
+    BlasBatch batch;
+    if(geometries.empty()) return batch;
+    if(!hostCommands) throw std::runtime_error("Device can not build acceleration structures on the host");
+
+    size_t count = geometries.size();
+
+    //Host scratch slices start on a cache line, so builds on different threads never share one
+    const VkDeviceSize hostAlignment = 64;
+
+    std::vector<VkAccelerationStructureGeometryKHR> asGeometries(count);
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildInfos(count);
+    std::vector<VkAccelerationStructureBuildRangeInfoKHR> buildRanges(count);
+    std::vector<VkAccelerationStructureBuildRangeInfoKHR*> rangePointers(count);
+    std::vector<VkDeviceSize> scratchOffsets(count);
+    VkDeviceSize scratchBytes = 0;
+
+    for(size_t i = 0; i < count; i++) {
+        VkAccelerationStructureGeometryKHR& geometry = asGeometries[i];
+        geometry = {};
+        geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+        geometry.geometryType = VK_GEOMETRY_TYPE_AABBS_KHR;
+        geometry.geometry.aabbs.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_AABBS_DATA_KHR;
+        geometry.geometry.aabbs.data.hostAddress = geometries[i].hostBoxes;
+        geometry.geometry.aabbs.stride = sizeof(VkAabbPositionsKHR);
+        geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+
+        buildRanges[i] = {};
+        buildRanges[i].primitiveCount = geometries[i].primitiveCount;
+        rangePointers[i] = &buildRanges[i];
+
+        VkAccelerationStructureBuildGeometryInfoKHR& buildInfo = buildInfos[i];
+        buildInfo = {};
+        buildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        buildInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+        if(compact) buildInfo.flags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+        buildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+        buildInfo.geometryCount = 1;
+        buildInfo.pGeometries = &geometry;
+
+        VkAccelerationStructureBuildSizesInfoKHR sizeInfo{};
+        sizeInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+        uint32_t primitiveCount = geometries[i].primitiveCount;
+        vkGetAccelerationStructureBuildSizesKHR(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_HOST_KHR, &buildInfo, &primitiveCount, &sizeInfo);
+
+        scratchOffsets[i] = scratchBytes;
+        scratchBytes += (sizeInfo.buildScratchSize + hostAlignment - 1) / hostAlignment * hostAlignment;
+
+        //Host commands only work on structures in host visible memory
+        AccelerationStructure blas;
+        blas.buffer.createBuffer(device, physicalDevice, sizeInfo.accelerationStructureSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false);
+
+        VkAccelerationStructureCreateInfoKHR createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+        createInfo.buffer = blas.buffer.handle;
+        createInfo.size = sizeInfo.accelerationStructureSize;
+        createInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+
+        vkCreateAccelerationStructureKHR(device, &createInfo, nullptr, &blas.handle);
+
+        buildInfo.dstAccelerationStructure = blas.handle;
+        batch.staging.push_back(blas);
+        batch.sizes.push_back(sizeInfo.accelerationStructureSize);
+    }
+
+    std::vector<uint8_t> scratch(scratchBytes + hostAlignment);
+    uintptr_t scratchBase = ((uintptr_t)scratch.data() + hostAlignment - 1) / hostAlignment * hostAlignment;
+    for(size_t i = 0; i < count; i++) buildInfos[i].scratchData.hostAddress = (void*)(scratchBase + scratchOffsets[i]);
+
+    //Each deferred operation takes a run of builds. Twice as many runs as cores, so a core that drew a run of small chunks finds another one to join
+    uint32_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+    uint32_t operationCount = (uint32_t)std::min<size_t>(count, threadCount * 2);
+
+    std::vector<VkDeferredOperationKHR> operations(operationCount, VK_NULL_HANDLE);
+    std::vector<uint8_t> deferred(operationCount, 0);
+    uint32_t concurrency = 0;
+
+    for(uint32_t o = 0; o < operationCount; o++) {
+        size_t first = count * o / operationCount;
+        size_t last = count * (o + 1) / operationCount;
+
+        if(vkCreateDeferredOperationKHR(device, nullptr, &operations[o]) != VK_SUCCESS) throw std::runtime_error("Failed to create deferred operation");
+
+        VkResult result = vkBuildAccelerationStructuresKHR(device, operations[o], (uint32_t)(last - first), &buildInfos[first], &rangePointers[first]);
+        if(result < 0) throw std::runtime_error("Failed to start host acceleration structure build");
+
+        //A driver may also just build it right here
+        if(result == VK_OPERATION_DEFERRED_KHR) {
+            deferred[o] = 1;
+
+            //Unbounded comes back as UINT32_MAX, clamped so the sum can not wrap. More workers than cores are never used anyway
+            uint32_t operationConcurrency = std::min(threadCount, std::max(1u, vkGetDeferredOperationMaxConcurrencyKHR(device, operations[o])));
+            concurrency = std::min(threadCount, concurrency + operationConcurrency);
         }
+    }
+
+    //Every worker joins every operation, starting at its own, until the driver has nothing left for it there.
+    //An idle join means the operation may have more work later, so it is joined again
+    parallelFor(std::min(threadCount, std::max(1u, concurrency)), [&](uint32_t worker) {
+        for(uint32_t k = 0; k < operationCount; k++) {
+            uint32_t o = (worker + k) % operationCount;
+            if(!deferred[o]) continue;
+
+            while(vkDeferredOperationJoinKHR(device, operations[o]) == VK_THREAD_IDLE_KHR) std::this_thread::yield();
+        }
+    }, 1);
+
+    for(uint32_t o = 0; o < operationCount; o++) {
+        VkResult result = deferred[o] ? vkGetDeferredOperationResultKHR(device, operations[o]) : VK_SUCCESS;
+        vkDestroyDeferredOperationKHR(device, operations[o], nullptr);
+        if(result != VK_SUCCESS) throw std::runtime_error("Host acceleration structure build failed");
+    }
+
+    std::vector<VkAccelerationStructureKHR> handles;
+    for(const AccelerationStructure& blas : batch.staging) handles.push_back(blas.handle);
+
+    //Compacted sizes are known on the host as soon as the builds are, so the upload is the compaction
+    if(compact) {
+        std::vector<VkDeviceSize> compactSizes(count);
+        vkWriteAccelerationStructuresPropertiesKHR(device, (uint32_t)count, handles.data(), VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, count * sizeof(VkDeviceSize), compactSizes.data(), sizeof(VkDeviceSize));
+        batch.sizes = compactSizes;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        AccelerationStructure blas;
+        blas.buffer.createBuffer(device, physicalDevice, batch.sizes[i], VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+
+        VkAccelerationStructureCreateInfoKHR createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+        createInfo.buffer = blas.buffer.handle;
+        createInfo.size = batch.sizes[i];
+        createInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+
+        vkCreateAccelerationStructureKHR(device, &createInfo, nullptr, &blas.handle);
+
+        VkCopyAccelerationStructureInfoKHR copyInfo{};
+        copyInfo.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR;
+        copyInfo.src = handles[i];
+        copyInfo.dst = blas.handle;
+        copyInfo.mode = compact ? VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR : VK_COPY_ACCELERATION_STRUCTURE_MODE_CLONE_KHR;
+
+        vkCmdCopyAccelerationStructureKHR(uploadCommands, &copyInfo);
+        batch.blases.push_back(blas);
+    }
+
+    return batch;
+}
+
+inline BlasBatch AccelerationStructure::createBottomLevelAccelerationStructures(const std::vector<BlasGeometry>& geometries, VkCommandPool buildPool, VkQueue buildQueue, bool compact) {
+    if(geometries.empty()) {
+        BlasBatch batch;
+        batch.pool = buildPool;
+        batch.queue = buildQueue;
+        return batch;
+    }
+
+    CommandBuffer commandBuffer;
+    commandBuffer.createCommandBuffer(device, buildPool);
+    commandBuffer.beginRecording(true);
+
+    BlasBatch batch = recordBottomLevelAccelerationStructures(geometries, commandBuffer.handle, compact);
+    batch.commandBuffer = commandBuffer;
+    batch.pool = buildPool;
+    batch.queue = buildQueue;
+
+    batch.commandBuffer.endRecording();
+
+    VkFenceCreateInfo fenceInfo{};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    vkCreateFence(device, &fenceInfo, nullptr, &batch.fence);
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &batch.commandBuffer.handle;
+
+    vkQueueSubmit(buildQueue, 1, &submitInfo, batch.fence);
+
+    return batch;
+}
+
+inline AccelerationStructure AccelerationStructure::createBottomLevelAccelereationStructure(VkDeviceAddress aabbAddress, uint32_t primitiveCount, VkCommandPool buildPool, VkQueue buildQueue) {
+    BlasBatch batch = createBottomLevelAccelerationStructures({{aabbAddress, primitiveCount}}, buildPool, buildQueue);
+    batch.wait();
+    return batch.blases[0];
+}
+
+//Top level structure that lives as long as the world does. Built with ALLOW_UPDATE, so moving instances only costs a refit recorded in to the frame command buffer.
+//The instance buffer is host visible and stays mapped, transforms are written straight in to it
+struct DynamicTlas {
+    AccelerationStructure structure{};
+    uint32_t instanceCount = 0;
+
+    //Refits keep the tree of the last build and only move its boxes, which get looser the further instances travel.
+    //Past this many refits in a row, or once an instance is this far from where the last build saw it, the next update rebuilds instead
+    uint32_t maxRefits = 600;
+    float rebuildDistance = 32.0f;
+
+    uint32_t refitsSinceBuild = 0;
+    uint64_t buildCount = 0;
+    uint64_t refitCount = 0;
+
+    //Records a full build in to commandBuffer. Buffers are only recreated when the instance count changes, so nothing may still be using the tlas
+    void recordBuild(VkCommandBuffer commandBuffer, const std::vector<AccelerationStructure>& blases, const std::vector<VkTransformMatrixKHR>& transforms) {
+        if(!allocated || blases.size() != instanceCount) {
+            destroy();
+            allocate((uint32_t)blases.size());
+        }
+
+        writeInstances(blases, transforms);
+        record(commandBuffer, VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR);
+        markBuilt();
+    }
+
+    //The same instances pointing at other blases, after compaction swapped them. Same count, so the buffers stay
+    void recordRelink(VkCommandBuffer commandBuffer, const std::vector<AccelerationStructure>& blases) {
+        if(blases.size() != instanceCount) throw std::runtime_error("Instance count changed, the tlas needs a full build");
+
+        for(uint32_t i = 0; i < instanceCount; i++) {
+            AccelerationStructure blas = blases[i];
+            instances[i].accelerationStructureReference = AccelerationStructure::getBLASAddress(&blas);
+        }
+
+        record(commandBuffer, VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR);
+        markBuilt();
+    }
+
+    //Writes new transforms and records a refit, or a rebuild once the refits have drifted too far, in to commandBuffer ahead of the trace.
+    //The frame that last used the tlas has to be done, its instances are overwritten in place. Returns true when it rebuilt
+    bool update(VkCommandBuffer commandBuffer, const std::vector<VkTransformMatrixKHR>& transforms) {
+        if(transforms.size() != instanceCount) throw std::runtime_error("Instance count changed, the tlas needs a full build");
+
+        bool rebuild = refitsSinceBuild >= maxRefits;
+
+        for(uint32_t i = 0; i < instanceCount; i++) {
+            instances[i].transform = transforms[i];
+
+            float dx = transforms[i].matrix[0][3] - builtPositions[i * 3 + 0];
+            float dy = transforms[i].matrix[1][3] - builtPositions[i * 3 + 1];
+            float dz = transforms[i].matrix[2][3] - builtPositions[i * 3 + 2];
+            if(dx * dx + dy * dy + dz * dz > rebuildDistance * rebuildDistance) rebuild = true;
+        }
+
+        record(commandBuffer, rebuild ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR);
+
+        //The trace reads the tlas straight after
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+        barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        if(rebuild) markBuilt();
+        else {
+            refitsSinceBuild++;
+            refitCount++;
+        }
+
+        return rebuild;
+    }
+
+    void destroy() {
+        if(!allocated) return;
+
+        VkDevice device = AccelerationStructure::device;
+        instanceBuffer.destroy(device);
+        scratchBuffer.destroy(device);
+        AccelerationStructure::destroyAccelerationStructure(structure);
+
+        instances = nullptr;
+        allocated = false;
+    }
+
+    private:
+
+    bool allocated = false;
+
+    Buffer instanceBuffer;
+    VkAccelerationStructureInstanceKHR* instances = nullptr;
+    VkDeviceAddress instanceAddress = 0;
 
-        //create a buffer on the gpu which has the data in the exact format wanted by vulkan
-        Buffer instanceBuffer;
-        instanceBuffer.createBuffer(device, physicalDevice, sizeof(VkAccelerationStructureInstanceKHR) * instances.size(), VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
-        instanceBuffer.populateBuffer(device, physicalDevice, instances.data(), sizeof(VkAccelerationStructureInstanceKHR) * instances.size(), transferPool, transferQueue);
+    Buffer scratchBuffer;
+    VkDeviceAddress scratchAddress = 0;
 
-        //Fill the data related to the instances
-        VkAccelerationStructureGeometryInstancesDataKHR instanceData{};
-        instanceData.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
-        instanceData.data.deviceAddress = instanceBuffer.getBufferAddress(device);
+    //Instance translations as of the last full build
+    std::vector<float> builtPositions;
 
+    static constexpr VkBuildAccelerationStructureFlagsKHR buildFlags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+
+    VkAccelerationStructureGeometryKHR geometry() const {
         VkAccelerationStructureGeometryKHR geometry{};
         geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
         geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
-        geometry.geometry.instances = instanceData;
-
-        VkAccelerationStructureBuildRangeInfoKHR buildRangeInfo{};
-        buildRangeInfo.primitiveCount = blases.size();
-        buildRangeInfo.firstVertex = 0;
-        buildRangeInfo.primitiveOffset = 0;
-        buildRangeInfo.transformOffset = 0;
-
-        VkAccelerationStructureBuildGeometryInfoKHR buildGeometryInfo{};
-        buildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-        buildGeometryInfo.pNext = nullptr;
-        buildGeometryInfo.srcAccelerationStructure = VK_NULL_HANDLE;
-        buildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-        buildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-        buildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-        buildGeometryInfo.geometryCount = 1;
-        buildGeometryInfo.pGeometries = &geometry;
-        buildGeometryInfo.ppGeometries = nullptr;
-
-        //Get info about the size of the acceleration structure and also the scratch buffer required
+        geometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+        geometry.geometry.instances.data.deviceAddress = instanceAddress;
+        return geometry;
+    }
+
+    void allocate(uint32_t count) {
+        VkDevice device = AccelerationStructure::device;
+        VkPhysicalDevice physicalDevice = AccelerationStructure::physicalDevice;
+
+        instanceCount = count;
+
+        //A tlas with no instances is fine but an empty buffer is not, so an all air world still gets room for one
+        uint32_t capacity = std::max(1u, count);
+        instanceBuffer.createBuffer(device, physicalDevice, capacity * sizeof(VkAccelerationStructureInstanceKHR), VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false);
+        instances = (VkAccelerationStructureInstanceKHR*)instanceBuffer.mapped();
+        memset(instances, 0, capacity * sizeof(VkAccelerationStructureInstanceKHR));
+        instanceAddress = instanceBuffer.getBufferAddress(device);
+
+        VkAccelerationStructureGeometryKHR instanceGeometry = geometry();
+
+        VkAccelerationStructureBuildGeometryInfoKHR buildInfo{};
+        buildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+        buildInfo.flags = buildFlags;
+        buildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+        buildInfo.geometryCount = 1;
+        buildInfo.pGeometries = &instanceGeometry;
+
         VkAccelerationStructureBuildSizesInfoKHR sizeInfo{};
         sizeInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-        uint32_t count = 1;
-        vkGetAccelerationStructureBuildSizesKHR(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildGeometryInfo, &count, &sizeInfo);
+        AccelerationStructure::vkGetAccelerationStructureBuildSizesKHR(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo, &count, &sizeInfo);
 
-        //Make a scratch buffer from the info gathered
-        Buffer scratchBuffer;
-        scratchBuffer.createBuffer(device, physicalDevice, sizeInfo.buildScratchSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+        //One scratch buffer kept for both, a rebuild and a refit never run at the same time
+        VkDeviceSize scratchSize = std::max(sizeInfo.buildScratchSize, sizeInfo.updateScratchSize) + AccelerationStructure::scratchAlignment;
+        scratchBuffer.createBuffer(device, physicalDevice, scratchSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
 
-        //assign the scratch buffer
-        buildGeometryInfo.scratchData.deviceAddress = scratchBuffer.getBufferAddress(device);
+        VkDeviceSize alignment = AccelerationStructure::scratchAlignment;
+        scratchAddress = (scratchBuffer.getBufferAddress(device) + alignment - 1) / alignment * alignment;
 
-        //make the buffer in which the acceleration strcuture will reside
-        Buffer accelerationStructureBuffer;
-        accelerationStructureBuffer.createBuffer(device, physicalDevice, sizeInfo.accelerationStructureSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+        structure.buffer.createBuffer(device, physicalDevice, sizeInfo.accelerationStructureSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
 
-        //create acceleeration structure
-        VkAccelerationStructureCreateInfoKHR accelerationCreateInfo;
-        accelerationCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
-        accelerationCreateInfo.buffer = accelerationStructureBuffer.handle;
-        accelerationCreateInfo.size = sizeInfo.accelerationStructureSize;
-        accelerationCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-        accelerationCreateInfo.pNext = VK_NULL_HANDLE;
-        accelerationCreateInfo.offset = 0;
-        accelerationCreateInfo.createFlags = 0;
-        accelerationCreateInfo.deviceAddress = 0;
+        VkAccelerationStructureCreateInfoKHR createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+        createInfo.buffer = structure.buffer.handle;
+        createInfo.size = sizeInfo.accelerationStructureSize;
+        createInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
 
-        VkAccelerationStructureKHR accelerationStructure;
-        vkCreateAccelerationStructureKHR(device, &accelerationCreateInfo, nullptr, &accelerationStructure);
+        AccelerationStructure::vkCreateAccelerationStructureKHR(device, &createInfo, nullptr, &structure.handle);
 
-        buildGeometryInfo.dstAccelerationStructure = accelerationStructure;
+        allocated = true;
+    }
 
-        //FINALLY send the acceleration strucuture off the the gpu where it is built and will stay for the rest of its life before it is destoryed 
-        VkAccelerationStructureBuildRangeInfoKHR* infos[] = { &buildRangeInfo };
+    //An update reads the old tree from and writes the new one to the same structure
+    void record(VkCommandBuffer commandBuffer, VkBuildAccelerationStructureModeKHR mode) {
+        VkAccelerationStructureGeometryKHR instanceGeometry = geometry();
+
+        VkAccelerationStructureBuildRangeInfoKHR buildRange{};
+        buildRange.primitiveCount = instanceCount;
+        const VkAccelerationStructureBuildRangeInfoKHR* ranges[] = {&buildRange};
+
+        VkAccelerationStructureBuildGeometryInfoKHR buildInfo{};
+        buildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+        buildInfo.flags = buildFlags;
+        buildInfo.mode = mode;
+        buildInfo.srcAccelerationStructure = mode == VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR ? structure.handle : VK_NULL_HANDLE;
+        buildInfo.dstAccelerationStructure = structure.handle;
+        buildInfo.geometryCount = 1;
+        buildInfo.pGeometries = &instanceGeometry;
+        buildInfo.scratchData.deviceAddress = scratchAddress;
+
+        AccelerationStructure::vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1, &buildInfo, ranges);
+    }
 
-        CommandBuffer commandBuffer;
-        commandBuffer.createCommandBuffer(device, buildPool);
-        commandBuffer.beginRecording(true);
+    void writeInstances(const std::vector<AccelerationStructure>& blases, const std::vector<VkTransformMatrixKHR>& transforms) {
+        for(uint32_t i = 0; i < instanceCount; i++) {
+            VkAccelerationStructureInstanceKHR& instance = instances[i];
+            instance = {};
+            instance.transform = transforms[i];
+            instance.instanceCustomIndex = i; //Which entry of the chunk table the shaders read
+            instance.mask = 0xFF;
+            instance.instanceShaderBindingTableRecordOffset = 0;
+            instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
+
+            AccelerationStructure blas = blases[i];
+            instance.accelerationStructureReference = AccelerationStructure::getBLASAddress(&blas);
+        }
+    }
 
-        vkCmdBuildAccelerationStructuresKHR(commandBuffer.handle, 1, &buildGeometryInfo, (VkAccelerationStructureBuildRangeInfoKHR* const*)&infos);
+    void markBuilt() {
+        builtPositions.resize(instanceCount * 3);
+        for(uint32_t i = 0; i < instanceCount; i++) {
+            for(int axis = 0; axis < 3; axis++) builtPositions[i * 3 + axis] = instances[i].transform.matrix[axis][3];
+        }
 
-        commandBuffer.endRecording();
+        refitsSinceBuild = 0;
+        buildCount++;
+    }
+};
 
-        //submit to the queue
-        VkSubmitInfo submitInfo{};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffer.handle;
+struct BlasCacheStats {
+    uint64_t lookups = 0;
+    uint64_t hits = 0;
+    uint32_t entries = 0;
+    uint32_t references = 0;
 
-        vkQueueSubmit(buildQueue, 1, &submitInfo, VK_NULL_HANDLE);
+    double hitRate() const { return lookups ? (double)hits / lookups : 0.0; }
+};
 
-        vkQueueWaitIdle(buildQueue);
+//Blases keyed by a hash of the boxes they are built from. Chunks with the same boxes share one blas and only differ in their instance transform.
+//Entries are reference counted, the last release destroys the blas straight away, so nothing may still be tracing against it
+class BlasCache {
+    public:
+
+    BlasCacheStats stats{};
+
+    //The entry for these boxes, added without a blas when there is none yet. A hash match only counts once the boxes compare equal, so collisions just cost a build
+    uint32_t acquire(uint64_t hash, const std::vector<VkAabbPositionsKHR>& boxes, bool& added) {
+        stats.lookups++;
+
+        auto range = lookup.equal_range(hash);
+        for(auto it = range.first; it != range.second; ++it) {
+            Entry& entry = entries[it->second];
+            if(entry.boxes.size() == boxes.size() && memcmp(entry.boxes.data(), boxes.data(), boxes.size() * sizeof(VkAabbPositionsKHR)) == 0) {
+                entry.references++;
+                stats.hits++;
+                stats.references++;
+                added = false;
+                return it->second;
+            }
+        }
 
+        uint32_t id;
+        if(!freeEntries.empty()) {
+            id = freeEntries.back();
+            freeEntries.pop_back();
+        }
+        else {
+            id = (uint32_t)entries.size();
+            entries.emplace_back();
+        }
 
-        scratchBuffer.destroy(device);
-        instanceBuffer.destroy(device);
+        Entry& entry = entries[id];
+        entry.hash = hash;
+        entry.boxes = boxes;
+        entry.references = 1;
+        entry.built = false;
+
+        lookup.emplace(hash, id);
+        stats.entries++;
+        stats.references++;
+        added = true;
+        return id;
+    }
+
+    void release(uint32_t id) {
+        Entry& entry = entries[id];
+        stats.references--;
+        if(--entry.references > 0) return;
+
+        if(entry.built) AccelerationStructure::destroyAccelerationStructure(entry.blas);
 
-        return {accelerationStructure, accelerationStructureBuffer};
+        auto range = lookup.equal_range(entry.hash);
+        for(auto it = range.first; it != range.second; ++it) {
+            if(it->second == id) {
+                lookup.erase(it);
+                break;
+            }
+        }
+
+        entry = Entry{};
+        freeEntries.push_back(id);
+        stats.entries--;
     }
 
-    static void destroyAccelerationStructure(AccelerationStructure accelerationStructure) {
-        accelerationStructure.buffer.destroy(device);
-        vkDestroyAccelerationStructureKHR(device, accelerationStructure.handle, nullptr);
+    void setBlas(uint32_t id, const AccelerationStructure& blas) {
+        entries[id].blas = blas;
+        entries[id].built = true;
+    }
+
+    const AccelerationStructure& blas(uint32_t id) const { return entries[id].blas; }
+    const std::vector<VkAabbPositionsKHR>& boxes(uint32_t id) const { return entries[id].boxes; }
+
+    //Ids stay below this, sized for per entry tables
+    uint32_t capacity() const { return (uint32_t)entries.size(); }
+
+    void destroy() {
+        for(Entry& entry : entries) {
+            if(entry.built) AccelerationStructure::destroyAccelerationStructure(entry.blas);
+        }
+
+        entries.clear();
+        freeEntries.clear();
+        lookup.clear();
+        stats.entries = 0;
+        stats.references = 0;
     }
-};
\ No newline at end of file
+
+    private:
+
+    struct Entry {
+        uint64_t hash = 0;
+        std::vector<VkAabbPositionsKHR> boxes;
+        AccelerationStructure blas{};
+        uint32_t references = 0;
+        bool built = false;
+    };
+
+    std::vector<Entry> entries;
+    std::vector<uint32_t> freeEntries;
+    std::unordered_multimap<uint64_t, uint32_t> lookup;
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "../commandBuffer.h"
+#include <vulkan/vulkan_core.h>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+//Runs acceleration structure builds on their own queue so they overlap with rendering.
+//Every submission signals the next value of one timeline semaphore. Nothing here waits on the cpu, the frame that needs a build
+//waits on its value on the gpu, and resources a build used are freed once the semaphore has passed it
+class BuildScheduler {
+    public:
+
+    void create(VkDevice _device, VkQueue _queue, VkCommandPool _pool) {
+        device = _device;
+        queue = _queue;
+        pool = _pool;
+
+        VkSemaphoreTypeCreateInfo typeInfo{};
+        typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+        typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        typeInfo.initialValue = 0;
+
+        VkSemaphoreCreateInfo createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        createInfo.pNext = &typeInfo;
+
+        if(vkCreateSemaphore(device, &createInfo, nullptr, &timeline) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create build timeline semaphore");
+        }
+    }
+
+    //A one shot command buffer from the build pool, already recording
+    VkCommandBuffer begin() {
+        CommandBuffer commandBuffer;
+        commandBuffer.createCommandBuffer(device, pool);
+        commandBuffer.beginRecording(true);
+        return commandBuffer.handle;
+    }
+
+    //Ends and submits commandBuffer, returns the timeline value it signals when done. The command buffer is freed after that
+    uint64_t submit(VkCommandBuffer commandBuffer) {
+        if(vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) throw std::runtime_error("Failed to record build command buffer");
+
+        uint64_t value = ++submitted;
+
+        VkTimelineSemaphoreSubmitInfo timelineInfo{};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.signalSemaphoreValueCount = 1;
+        timelineInfo.pSignalSemaphoreValues = &value;
+
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.pNext = &timelineInfo;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &commandBuffer;
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &timeline;
+
+        if(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) throw std::runtime_error("Failed to submit build");
+
+        pending.push_back({value, [this, commandBuffer]() { vkFreeCommandBuffers(device, pool, 1, &commandBuffer); }});
+        return value;
+    }
+
+    //Runs fn once the timeline has reached value, from collect
+    void onComplete(uint64_t value, const std::function<void()>& fn) {
+        pending.push_back({value, fn});
+    }
+
+    uint64_t completedValue() const {
+        uint64_t value = 0;
+        vkGetSemaphoreCounterValue(device, timeline, &value);
+        return value;
+    }
+
+    bool reached(uint64_t value) const { return value == 0 || completedValue() >= value; }
+
+    //Frees whatever finished builds were holding on to. Cheap, call it once a frame
+    void collect() {
+        if(pending.empty()) return;
+
+        uint64_t completed = completedValue();
+        std::vector<Pending> stillPending;
+
+        for(Pending& p : pending) {
+            if(p.value <= completed) p.fn();
+            else stillPending.push_back(p);
+        }
+
+        pending.swap(stillPending);
+    }
+
+    //Blocks until value is reached. Only for teardown, frames wait on the gpu instead
+    void wait(uint64_t value) const {
+        VkSemaphoreWaitInfo waitInfo{};
+        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        waitInfo.semaphoreCount = 1;
+        waitInfo.pSemaphores = &timeline;
+        waitInfo.pValues = &value;
+
+        vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+    }
+
+    VkSemaphore semaphore() const { return timeline; }
+    uint64_t lastSubmitted() const { return submitted; }
+
+    void destroy() {
+        wait(submitted);
+        collect();
+        vkDestroySemaphore(device, timeline, nullptr);
+    }
+
+    private:
+
+    struct Pending {
+        uint64_t value;
+        std::function<void()> fn;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    VkQueue queue = VK_NULL_HANDLE;
+    VkCommandPool pool = VK_NULL_HANDLE;
+
+    VkSemaphore timeline = VK_NULL_HANDLE;
+    uint64_t submitted = 0;
+
+    std::vector<Pending> pending;
+};
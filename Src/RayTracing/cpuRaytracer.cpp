@@ -0,0 +1,137 @@
+#include "cpuRaytracer.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+void CpuRayTracer::createRayTracer(const BrickMap& brickMap, const Palette& palette, const DistanceField& distanceField, const OccupancyPyramid& pyramid, glm::vec3 _gridMin, float _voxelWidth) {
+    brickMapData = brickMap.data;
+    brickColours = brickMap.colours;
+    paletteColours = palette.colours;
+    distances = distanceField.distances;
+    distanceFieldSize = distanceField.size;
+    pyramidData = pyramid.data;
+    bricksPerAxis = brickMap.bricksPerAxis;
+    gridMin = _gridMin;
+    voxelWidth = _voxelWidth;
+}
+
+void CpuRayTracer::useBoxes(const VoxelBoxes& boxes) {
+    boxBVH.build(boxes);
+}
+
+glm::vec3 CpuRayTracer::tracePixel(const CameraConstants& camCons, uint32_t x, uint32_t y, uint32_t width, uint32_t height) const {
+    const glm::vec2 pixelCenter = glm::vec2((float)x, (float)y) + glm::vec2(0.5f);
+    const glm::vec2 inUV = glm::vec2(pixelCenter.x / (float)width, pixelCenter.y / (float)height);
+    glm::vec2 d = glm::vec2(inUV.x * 2.0f - 1.0f, inUV.y * 2.0f - 1.0f);
+
+    glm::vec4 origin = camCons.inverseView * glm::vec4(0, 0, 0, 1);
+    glm::vec4 target = camCons.inverseProj * glm::vec4(d.x, d.y, 1, 1);
+    glm::vec4 direction = camCons.inverseView * glm::vec4(glm::normalize(glm::vec3(target)), 0);
+
+    uint32_t hitVoxel = 0;
+    float t;
+
+    if(boxBVH.nodes.empty()) {
+        //The blas is a single aabb around the grid, so the intersection shader is the only thing deciding hits
+        t = GridTraversal::pyramidIntersection(pyramidData.data(), brickMapData.data(), bricksPerAxis, gridMin, voxelWidth, glm::vec3(origin), glm::vec3(direction), &hitVoxel, distances.data(), distanceFieldSize);
+    }
+    else {
+        //Boxes are in voxel units. Scaling the direction too keeps t in world units, then the brick comes from level 0 of the pyramid like in the shader
+        glm::ivec3 cell;
+        t = boxBVH.traverse((glm::vec3(origin) - gridMin) / voxelWidth, glm::vec3(direction) / voxelWidth, nullptr, &cell);
+        t = GridTraversal::boxHitVoxel(pyramidData.data(), brickMapData.data(), bricksPerAxis, t, cell, &hitVoxel);
+    }
+
+    if(!(t > 0.0f && t >= tMin && t <= tMax)) return missColour;
+
+    uint8_t index = getPaletteIndex(&brickColours[(size_t)hitVoxelBrick(hitVoxel) * BRICK_COLOUR_WORDS], hitVoxelBit(hitVoxel));
+    return glm::vec3(paletteColours[index]);
+}
+
+void CpuRayTracer::renderTile(const CameraConstants& camCons, uint32_t tile, uint32_t tilesX) {
+    uint32_t startX = (tile % tilesX) * tileSize;
+    uint32_t startY = (tile / tilesX) * tileSize;
+    uint32_t endX = min(startX + tileSize, imgWidth);
+    uint32_t endY = min(startY + tileSize, imgHeight);
+
+    for(uint32_t y = startY; y < endY; y++) {
+        for(uint32_t x = startX; x < endX; x++) {
+            image[y * imgWidth + x] = tracePixel(camCons, x, y, imgWidth, imgHeight);
+        }
+    }
+}
+
+CpuRenderStats CpuRayTracer::render(const CameraConstants& camCons, uint32_t width, uint32_t height) {
+    imgWidth = width;
+    imgHeight = height;
+    image.assign(width * height, glm::vec3(0));
+
+    const uint32_t tilesX = (width + tileSize - 1) / tileSize;
+    const uint32_t tilesY = (height + tileSize - 1) / tileSize;
+    const uint32_t tileCount = tilesX * tilesY;
+
+    uint32_t threadCount = max(1u, thread::hardware_concurrency());
+    threadCount = min(threadCount, tileCount);
+
+    auto start = chrono::high_resolution_clock::now();
+
+    //Threads pull tiles off a shared counter so a slow tile doesnt hold up the rest of the frame
+    atomic<uint32_t> nextTile{0};
+
+    vector<thread> workers;
+    for(uint32_t i = 0; i < threadCount; i++) {
+        workers.emplace_back([&]() {
+            for(uint32_t tile = nextTile++; tile < tileCount; tile = nextTile++) {
+                renderTile(camCons, tile, tilesX);
+            }
+        });
+    }
+
+    for(thread& worker : workers) worker.join();
+
+    auto end = chrono::high_resolution_clock::now();
+
+    CpuRenderStats stats{};
+    stats.milliseconds = chrono::duration<double, milli>(end - start).count();
+    stats.tileCount = tileCount;
+    stats.threadCount = threadCount;
+
+    return stats;
+}
+
+void CpuRayTracer::writePPM(const string& filePath) const {
+    ofstream file(filePath, ios::binary);
+
+    if(!file.is_open()) throw runtime_error("Failed to open image file");
+
+    file << "P6\n" << imgWidth << " " << imgHeight << "\n255\n";
+
+    vector<unsigned char> row(imgWidth * 3);
+
+    for(uint32_t y = 0; y < imgHeight; y++) {
+        for(uint32_t x = 0; x < imgWidth; x++) {
+            glm::vec3 colour = image[y * imgWidth + x];
+            for(int c = 0; c < 3; c++) {
+                row[x * 3 + c] = (unsigned char)(clamp(colour[c], 0.0f, 1.0f) * 255.0f + 0.5f);
+            }
+        }
+        file.write((const char*)row.data(), row.size());
+    }
+}
+
+void CpuRayTracer::writePFM(const string& filePath) const {
+    ofstream file(filePath, ios::binary);
+
+    if(!file.is_open()) throw runtime_error("Failed to open image file");
+
+    //Negative scale means little endian. PFM stores the rows bottom to top
+    file << "PF\n" << imgWidth << " " << imgHeight << "\n-1.0\n";
+
+    for(uint32_t y = imgHeight; y-- > 0;) {
+        file.write((const char*)&image[y * imgWidth], imgWidth * sizeof(glm::vec3));
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "gridTraversal.h"
+#include "../Camera.h"
+#include "../DataStructures/brickmap.h"
+#include "../DataStructures/bvh.h"
+#include "../DataStructures/distanceField.h"
+#include "../DataStructures/occupancyPyramid.h"
+#include "../DataStructures/palette.h"
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//Colour written by Shaders/miss.rmiss, hits take theirs from the palette like Shaders/closestHit.rchit
+const glm::vec3 missColour = glm::vec3(0.6f, 0.8f, 0.93f);
+
+struct CpuRenderStats {
+    double milliseconds;
+    uint32_t tileCount;
+    uint32_t threadCount;
+};
+
+//Reference implementation of the ray tracing pipeline that runs without a gpu. Used as a fallback and as a baseline to compare the gpu against
+class CpuRayTracer {
+    public:
+
+    //Takes a copy of the buffers the gpu gets at bindings 3 to 7. gridMin and voxelWidth place the grid in the world like the blas does
+    void createRayTracer(const BrickMap& brickMap, const Palette& palette, const DistanceField& distanceField, const OccupancyPyramid& pyramid, glm::vec3 gridMin, float voxelWidth);
+
+    //Optional, boxes have to cover the same grid. Rays then go through a BoxBVH over them instead of the pyramid walk, like a chunk blas over its merged boxes
+    void useBoxes(const VoxelBoxes& boxes);
+    const BVHStats& getBoxStats() const { return boxBVH.stats; }
+
+    //Splits the image in to tiles and spreads them over every core
+    CpuRenderStats render(const CameraConstants& camCons, uint32_t width, uint32_t height);
+
+    //Same as one invocation of raygen.rgen
+    glm::vec3 tracePixel(const CameraConstants& camCons, uint32_t x, uint32_t y, uint32_t width, uint32_t height) const;
+
+    void writePPM(const string& filePath) const;
+    void writePFM(const string& filePath) const;
+
+    const vector<glm::vec3>& getImage() const { return image; }
+
+    private:
+
+    //Ray interval used by traceRayEXT in raygen.rgen
+    static constexpr float tMin = 0.001f;
+    static constexpr float tMax = 1000.0f;
+
+    static const uint32_t tileSize = 16;
+
+    vector<uint32_t> brickMapData;
+    vector<uint32_t> brickColours;
+    vector<glm::vec4> paletteColours;
+    vector<uint8_t> distances;
+    int distanceFieldSize;
+    vector<uint32_t> pyramidData;
+    int bricksPerAxis;
+    glm::vec3 gridMin;
+    float voxelWidth;
+    BoxBVH boxBVH;
+
+    uint32_t imgWidth = 0;
+    uint32_t imgHeight = 0;
+    vector<glm::vec3> image;
+
+    void renderTile(const CameraConstants& camCons, uint32_t tile, uint32_t tilesX);
+};
@@ -0,0 +1,399 @@
+#pragma once
+
+#include "../DataStructures/brick.h"
+#include <glm/glm.hpp>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+//CPU port of the traversal in Shaders/intersection.rint.
+//Every expression is evaluated in the same order as the shader (and -std=c++17 keeps gcc from contracting into fma) to keep the two close.
+//Nothing compares the cpu against the gpu though, the benchmark only checks the cpu paths against each other, so expect them to match closely but not exactly
+struct AABB {
+    glm::vec3 bMin;
+    glm::vec3 bMax;
+};
+
+struct GridTraversal {
+
+    static constexpr float MIN_DIRECTION = 1e-8f;
+
+    static float safeComponent(float d) {
+        if(std::abs(d) < MIN_DIRECTION) return d < 0.0f ? -MIN_DIRECTION : MIN_DIRECTION;
+        return d;
+    }
+
+    static glm::vec3 safeDirection(glm::vec3 direction) {
+        return glm::vec3(safeComponent(direction.x), safeComponent(direction.y), safeComponent(direction.z));
+    }
+
+    static bool insideCells(glm::ivec3 voxel, int count) {
+        return voxel.x >= 0 && voxel.y >= 0 && voxel.z >= 0 && voxel.x < count && voxel.y < count && voxel.z < count;
+    }
+
+    //Reads the field DistanceField builds, laid out like the dense voxels. Cells past its edge never leap
+    static int emptyDistance(const uint8_t* distances, int fieldSize, glm::ivec3 cell) {
+        if(distances == nullptr || cell.x >= fieldSize || cell.y >= fieldSize || cell.z >= fieldSize) return 1;
+        return distances[((size_t)cell.x * fieldSize + cell.y) * fieldSize + cell.z];
+    }
+
+    //Nothing is solid within distance - 1 cells of voxel, so the ray leaves that whole cube in one step instead of one per cell.
+    //cellMin is where cell (0, 0, 0) starts. voxel ends up on the first cell past the cube and t, tMax are set up to carry on stepping from there
+    static void leapEmptyCube(int distance, glm::ivec3& voxel, glm::ivec3 stepDir, glm::vec3 cellMin, float voxelWidth, glm::vec3 origin, glm::vec3 dir, glm::vec3 invDir, float& t, glm::vec3& tMax) {
+        glm::ivec3 reach = glm::ivec3(distance - 1);
+        glm::ivec3 farCell = voxel + stepDir * reach;
+        glm::vec3 exitBoundary = cellMin + (glm::vec3(farCell) + glm::vec3(glm::greaterThan(stepDir, glm::ivec3(0)))) * voxelWidth;
+        glm::vec3 tExit = (exitBoundary - origin) * invDir;
+
+        int axis = 2;
+        if(tExit.x < tExit.y && tExit.x < tExit.z) axis = 0;
+        else if(tExit.y < tExit.z) axis = 1;
+
+        t = tExit[axis];
+        glm::vec3 entry = origin + dir * t;
+        glm::vec3 start = glm::floor((entry - cellMin) / voxelWidth);
+        glm::ivec3 landed = glm::clamp(glm::ivec3(start), voxel - reach, voxel + reach);
+        landed[axis] = voxel[axis] + stepDir[axis] * distance;
+        voxel = landed;
+
+        glm::vec3 nextBoundary = cellMin + (glm::vec3(voxel) + glm::vec3(glm::greaterThan(stepDir, glm::ivec3(0)))) * voxelWidth;
+        tMax = (nextBoundary - origin) * invDir;
+    }
+
+    //Hit against one box of solid voxels in unit voxel space, mirrors solidBoxIntersection in the shader. Every voxel of the box is solid, so the hit is where the ray enters it.
+    //A ray starting inside does not hit the voxel it starts in, same as the dda, but the next one if that is still in the box. boxMax is exclusive
+    static float solidBoxIntersection(glm::ivec3 boxMin, glm::ivec3 boxMax, glm::vec3 origin, glm::vec3 direction, glm::ivec3* hitCell = nullptr) {
+        glm::vec3 dir = safeDirection(direction);
+        glm::vec3 invDir = 1.0f / dir;
+
+        glm::vec3 t0 = (glm::vec3(boxMin) - origin) * invDir;
+        glm::vec3 t1 = (glm::vec3(boxMax) - origin) * invDir;
+
+        glm::vec3 tmin = glm::min(t0, t1);
+        glm::vec3 tmax = glm::max(t0, t1);
+
+        float tNear = std::max(std::max(tmin.x, tmin.y), tmin.z);
+        float tFar = std::min(std::min(tmax.x, tmax.y), tmax.z);
+
+        if(tFar < std::max(tNear, 0.0f)) return -1.0f;
+
+        if(tNear > 0.0f) {
+            glm::vec3 entry = origin + dir * tNear;
+            if(hitCell) *hitCell = glm::clamp(glm::ivec3(glm::floor(entry)), boxMin, boxMax - 1);
+            return tNear;
+        }
+
+        glm::ivec3 stepDir(dir.x < 0.0f ? -1 : 1, dir.y < 0.0f ? -1 : 1, dir.z < 0.0f ? -1 : 1);
+        glm::ivec3 cell = glm::clamp(glm::ivec3(glm::floor(origin)), boxMin, boxMax - 1);
+
+        glm::vec3 boundary = glm::vec3(cell + glm::ivec3(glm::greaterThan(stepDir, glm::ivec3(0))));
+        glm::vec3 tExit = (boundary - origin) * invDir;
+
+        int axis = 2;
+        if(tExit.x < tExit.y && tExit.x < tExit.z) axis = 0;
+        else if(tExit.y < tExit.z) axis = 1;
+
+        if(tExit[axis] >= tFar) return -1.0f;
+
+        cell[axis] += stepDir[axis];
+        if(hitCell) *hitCell = cell;
+        return tExit[axis];
+    }
+
+    //Returns the distance to the first occupied voxel or -1. voxels is laid out as x * n * n + y * n + z like the buffer at binding 3.
+    //With distances (a DistanceField over the same n^3 cells) empty space is crossed a cube at a time
+    static float gridIntersection(const int* voxels, AABB gridBox, int numOfVoxel, glm::vec3 origin, glm::vec3 direction, const uint8_t* distances = nullptr) {
+        glm::vec3 dir = safeDirection(direction);
+        glm::vec3 invDir = 1.0f / dir;
+
+        glm::vec3 t0 = (gridBox.bMin - origin) * invDir;
+        glm::vec3 t1 = (gridBox.bMax - origin) * invDir;
+
+        glm::vec3 tmin = glm::min(t0, t1);
+        glm::vec3 tmax = glm::max(t0, t1);
+
+        float tNear = std::max(std::max(tmin.x, tmin.y), tmin.z);
+        float tFar = std::min(std::min(tmax.x, tmax.y), tmax.z);
+
+        if(tFar < std::max(tNear, 0.0f)) return -1.0f;
+
+        float voxelWidth = (gridBox.bMax.x - gridBox.bMin.x) / (float)numOfVoxel;
+
+        float t = std::max(tNear, 0.0f);
+        glm::vec3 entry = origin + dir * t;
+        glm::vec3 start = glm::floor((entry - gridBox.bMin) / voxelWidth);
+        glm::ivec3 voxel = glm::clamp(glm::ivec3(start), glm::ivec3(0), glm::ivec3(numOfVoxel - 1));
+
+        glm::ivec3 stepDir(dir.x < 0.0f ? -1 : 1, dir.y < 0.0f ? -1 : 1, dir.z < 0.0f ? -1 : 1);
+        glm::vec3 tDelta = glm::abs(invDir) * voxelWidth;
+        glm::vec3 nextBoundary = gridBox.bMin + (glm::vec3(voxel) + glm::vec3(glm::greaterThan(stepDir, glm::ivec3(0)))) * voxelWidth;
+        glm::vec3 tMax = (nextBoundary - origin) * invDir;
+
+        for(int i = 0; i < 3 * numOfVoxel; i++) {
+            if(t > 0.0f && voxels[numOfVoxel * numOfVoxel * voxel.x + numOfVoxel * voxel.y + voxel.z] != 0) return t;
+
+            int distance = emptyDistance(distances, numOfVoxel, voxel);
+            if(distance > 1) {
+                leapEmptyCube(distance, voxel, stepDir, gridBox.bMin, voxelWidth, origin, dir, invDir, t, tMax);
+                if(!insideCells(voxel, numOfVoxel)) break;
+                continue;
+            }
+
+            if(tMax.x < tMax.y && tMax.x < tMax.z) {
+                t = tMax.x;
+                voxel.x += stepDir.x;
+                tMax.x += tDelta.x;
+                if(voxel.x < 0 || voxel.x >= numOfVoxel) break;
+            }
+            else if(tMax.y < tMax.z) {
+                t = tMax.y;
+                voxel.y += stepDir.y;
+                tMax.y += tDelta.y;
+                if(voxel.y < 0 || voxel.y >= numOfVoxel) break;
+            }
+            else {
+                t = tMax.z;
+                voxel.z += stepDir.z;
+                tMax.z += tDelta.z;
+                if(voxel.z < 0 || voxel.z >= numOfVoxel) break;
+            }
+        }
+
+        return -1.0f;
+    }
+
+    static bool voxelSet(const uint32_t* brickMap, int bricksPerAxis, uint32_t brick, glm::ivec3 voxel) {
+        int bit = brickBit(voxel.x, voxel.y, voxel.z);
+        uint32_t word = brickMap[bricksPerAxis * bricksPerAxis * bricksPerAxis + brick * BRICK_WORDS + (bit >> 5)];
+        return (word & (1u << (bit & 31))) != 0u;
+    }
+
+    //Fine walk through one brick starting at distance t, -1 once the ray leaves the brick. hitVoxel gets packHitVoxel of the voxel that was hit.
+    //brickCell is the grid cell at the brick's corner, used to look the walk up in distances
+    static float brickIntersection(const uint32_t* brickMap, int bricksPerAxis, uint32_t brick, glm::vec3 brickMin, float voxelWidth, glm::vec3 origin, glm::vec3 dir, glm::vec3 invDir, float t, uint32_t* hitVoxel = nullptr, const uint8_t* distances = nullptr, int fieldSize = 0, glm::ivec3 brickCell = glm::ivec3(0)) {
+        glm::vec3 entry = origin + dir * t;
+        glm::vec3 start = glm::floor((entry - brickMin) / voxelWidth);
+        glm::ivec3 voxel = glm::clamp(glm::ivec3(start), glm::ivec3(0), glm::ivec3(BRICK_SIZE - 1));
+
+        glm::ivec3 stepDir(dir.x < 0.0f ? -1 : 1, dir.y < 0.0f ? -1 : 1, dir.z < 0.0f ? -1 : 1);
+        glm::vec3 tDelta = glm::abs(invDir) * voxelWidth;
+        glm::vec3 nextBoundary = brickMin + (glm::vec3(voxel) + glm::vec3(glm::greaterThan(stepDir, glm::ivec3(0)))) * voxelWidth;
+        glm::vec3 tMax = (nextBoundary - origin) * invDir;
+
+        for(int i = 0; i < 3 * BRICK_SIZE; i++) {
+            if(t > 0.0f && voxelSet(brickMap, bricksPerAxis, brick, voxel)) {
+                if(hitVoxel) *hitVoxel = packHitVoxel(brick, brickBit(voxel.x, voxel.y, voxel.z));
+                return t;
+            }
+
+            //Leaving the brick mid leap is fine, the coarse walk picks the ray up in the next brick
+            int distance = emptyDistance(distances, fieldSize, brickCell + voxel);
+            if(distance > 1) {
+                leapEmptyCube(distance, voxel, stepDir, brickMin, voxelWidth, origin, dir, invDir, t, tMax);
+                if(!insideCells(voxel, BRICK_SIZE)) break;
+                continue;
+            }
+
+            if(tMax.x < tMax.y && tMax.x < tMax.z) {
+                t = tMax.x;
+                voxel.x += stepDir.x;
+                tMax.x += tDelta.x;
+                if(voxel.x < 0 || voxel.x >= BRICK_SIZE) break;
+            }
+            else if(tMax.y < tMax.z) {
+                t = tMax.y;
+                voxel.y += stepDir.y;
+                tMax.y += tDelta.y;
+                if(voxel.y < 0 || voxel.y >= BRICK_SIZE) break;
+            }
+            else {
+                t = tMax.z;
+                voxel.z += stepDir.z;
+                tMax.z += tDelta.z;
+                if(voxel.z < 0 || voxel.z >= BRICK_SIZE) break;
+            }
+        }
+
+        return -1.0f;
+    }
+
+    //Two level walk over the buffer BrickMap uploads to binding 3. Empty bricks cost one coarse step, distances (binding 6) lets the fine walk skip empty cells
+    static float brickMapIntersection(const uint32_t* brickMap, int bricksPerAxis, glm::vec3 gridMin, float voxelWidth, glm::vec3 origin, glm::vec3 direction, uint32_t* hitVoxel = nullptr, const uint8_t* distances = nullptr, int fieldSize = 0) {
+        glm::vec3 dir = safeDirection(direction);
+        glm::vec3 invDir = 1.0f / dir;
+
+        float brickWidth = voxelWidth * (float)BRICK_SIZE;
+        glm::vec3 gridMax = gridMin + glm::vec3(brickWidth * (float)bricksPerAxis);
+
+        glm::vec3 t0 = (gridMin - origin) * invDir;
+        glm::vec3 t1 = (gridMax - origin) * invDir;
+
+        glm::vec3 tmin = glm::min(t0, t1);
+        glm::vec3 tmax = glm::max(t0, t1);
+
+        float tNear = std::max(std::max(tmin.x, tmin.y), tmin.z);
+        float tFar = std::min(std::min(tmax.x, tmax.y), tmax.z);
+
+        if(tFar < std::max(tNear, 0.0f)) return -1.0f;
+
+        float t = std::max(tNear, 0.0f);
+        glm::vec3 entry = origin + dir * t;
+        glm::vec3 start = glm::floor((entry - gridMin) / brickWidth);
+        glm::ivec3 brick = glm::clamp(glm::ivec3(start), glm::ivec3(0), glm::ivec3(bricksPerAxis - 1));
+
+        glm::ivec3 stepDir(dir.x < 0.0f ? -1 : 1, dir.y < 0.0f ? -1 : 1, dir.z < 0.0f ? -1 : 1);
+        glm::vec3 tDelta = glm::abs(invDir) * brickWidth;
+        glm::vec3 nextBoundary = gridMin + (glm::vec3(brick) + glm::vec3(glm::greaterThan(stepDir, glm::ivec3(0)))) * brickWidth;
+        glm::vec3 tMax = (nextBoundary - origin) * invDir;
+
+        for(int i = 0; i < 3 * bricksPerAxis; i++) {
+            uint32_t index = brickMap[bricksPerAxis * bricksPerAxis * brick.x + bricksPerAxis * brick.y + brick.z];
+
+            if(index != EMPTY_BRICK) {
+                glm::vec3 brickMin = gridMin + glm::vec3(brick) * brickWidth;
+                float hit = brickIntersection(brickMap, bricksPerAxis, index, brickMin, voxelWidth, origin, dir, invDir, t, hitVoxel, distances, fieldSize, brick * BRICK_SIZE);
+                if(hit > 0.0f) return hit;
+            }
+
+            if(tMax.x < tMax.y && tMax.x < tMax.z) {
+                t = tMax.x;
+                brick.x += stepDir.x;
+                tMax.x += tDelta.x;
+                if(brick.x < 0 || brick.x >= bricksPerAxis) break;
+            }
+            else if(tMax.y < tMax.z) {
+                t = tMax.y;
+                brick.y += stepDir.y;
+                tMax.y += tDelta.y;
+                if(brick.y < 0 || brick.y >= bricksPerAxis) break;
+            }
+            else {
+                t = tMax.z;
+                brick.z += stepDir.z;
+                tMax.z += tDelta.z;
+                if(brick.z < 0 || brick.z >= bricksPerAxis) break;
+            }
+        }
+
+        return -1.0f;
+    }
+
+    //Full resolution occupancy comes from the brick map, coarser levels from the pyramid OccupancyPyramid uploads to binding 7
+    static bool pyramidOccupied(const uint32_t* pyramid, const uint32_t* brickMap, int bricksPerAxis, int level, glm::ivec3 cell, uint32_t* brickIndex = nullptr) {
+        if(level == 0) {
+            glm::ivec3 brick = cell / BRICK_SIZE;
+            if(!insideCells(brick, bricksPerAxis)) return false;
+
+            uint32_t index = brickMap[bricksPerAxis * bricksPerAxis * brick.x + bricksPerAxis * brick.y + brick.z];
+            if(index == EMPTY_BRICK) return false;
+
+            if(brickIndex) *brickIndex = index;
+            return voxelSet(brickMap, bricksPerAxis, index, cell - brick * BRICK_SIZE);
+        }
+
+        int res = (int)pyramid[1] >> level;
+        uint32_t bit = (uint32_t)((cell.x * res + cell.y) * res + cell.z);
+        return ((pyramid[pyramid[1 + level] + (bit >> 5)] >> (bit & 31)) & 1u) != 0u;
+    }
+
+    //Turns a hit on a merged box in to the voxel the intersection shader reports, the brick comes from level 0 of the pyramid. A cell the brick map
+    //has as air is no hit at all, reporting it would shade voxel 0 of brick 0
+    static float boxHitVoxel(const uint32_t* pyramid, const uint32_t* brickMap, int bricksPerAxis, float t, glm::ivec3 cell, uint32_t* hitVoxel = nullptr) {
+        uint32_t brick = 0;
+        if(!(t > 0.0f) || !pyramidOccupied(pyramid, brickMap, bricksPerAxis, 0, cell, &brick)) return -1.0f;
+
+        if(hitVoxel) {
+            glm::ivec3 local = cell - (cell / BRICK_SIZE) * BRICK_SIZE;
+            *hitVoxel = packHitVoxel(brick, brickBit(local.x, local.y, local.z));
+        }
+        return t;
+    }
+
+    //Multi level DDA. Starts at the coarsest level, drops a level whenever the current cell is occupied and climbs back up once the ray leaves its parent,
+    //so empty space is crossed at the coarsest level that is still empty and full resolution steps only happen next to surfaces.
+    //voxel always holds the full resolution cell, coarser cells are voxel >> level. distances (binding 6) still lets level 0 leap
+    static float pyramidIntersection(const uint32_t* pyramid, const uint32_t* brickMap, int bricksPerAxis, glm::vec3 gridMin, float voxelWidth, glm::vec3 origin, glm::vec3 direction, uint32_t* hitVoxel = nullptr, const uint8_t* distances = nullptr, int fieldSize = 0) {
+        int levelCount = (int)pyramid[0];
+        int resolution = (int)pyramid[1];
+
+        glm::vec3 dir = safeDirection(direction);
+        glm::vec3 invDir = 1.0f / dir;
+
+        glm::vec3 gridMax = gridMin + glm::vec3(voxelWidth * (float)resolution);
+
+        glm::vec3 t0 = (gridMin - origin) * invDir;
+        glm::vec3 t1 = (gridMax - origin) * invDir;
+
+        glm::vec3 tmin = glm::min(t0, t1);
+        glm::vec3 tmax = glm::max(t0, t1);
+
+        float tNear = std::max(std::max(tmin.x, tmin.y), tmin.z);
+        float tFar = std::min(std::min(tmax.x, tmax.y), tmax.z);
+
+        if(tFar < std::max(tNear, 0.0f)) return -1.0f;
+
+        float t = std::max(tNear, 0.0f);
+        glm::vec3 entry = origin + dir * t;
+        glm::vec3 start = glm::floor((entry - gridMin) / voxelWidth);
+        glm::ivec3 voxel = glm::clamp(glm::ivec3(start), glm::ivec3(0), glm::ivec3(resolution - 1));
+
+        glm::ivec3 stepDir(dir.x < 0.0f ? -1 : 1, dir.y < 0.0f ? -1 : 1, dir.z < 0.0f ? -1 : 1);
+        glm::ivec3 positive = glm::ivec3(glm::greaterThan(stepDir, glm::ivec3(0)));
+
+        int level = levelCount;
+
+        for(int i = 0; i < 4 * resolution * (levelCount + 1); i++) {
+            glm::ivec3 cell(voxel.x >> level, voxel.y >> level, voxel.z >> level);
+            uint32_t brick = 0;
+
+            if(pyramidOccupied(pyramid, brickMap, bricksPerAxis, level, cell, &brick)) {
+                if(level > 0) {
+                    level--;
+                    continue;
+                }
+
+                if(t > 0.0f) {
+                    if(hitVoxel) {
+                        glm::ivec3 local = voxel - (voxel / BRICK_SIZE) * BRICK_SIZE;
+                        *hitVoxel = packHitVoxel(brick, brickBit(local.x, local.y, local.z));
+                    }
+                    return t;
+                }
+            }
+
+            glm::ivec3 parent(voxel.x >> (level + 1), voxel.y >> (level + 1), voxel.z >> (level + 1));
+
+            int distance = level == 0 ? emptyDistance(distances, fieldSize, voxel) : 1;
+            if(distance > 1) {
+                glm::vec3 unusedTMax;
+                leapEmptyCube(distance, voxel, stepDir, gridMin, voxelWidth, origin, dir, invDir, t, unusedTMax);
+            }
+            else {
+                //Step out of the whole cell in one go, landing on the first full resolution voxel past it
+                int cellWidth = 1 << level;
+                glm::ivec3 cellLo = cell * cellWidth;
+                glm::vec3 boundary = gridMin + glm::vec3((cell + positive) * cellWidth) * voxelWidth;
+                glm::vec3 tExit = (boundary - origin) * invDir;
+
+                int axis = 2;
+                if(tExit.x < tExit.y && tExit.x < tExit.z) axis = 0;
+                else if(tExit.y < tExit.z) axis = 1;
+
+                t = tExit[axis];
+                glm::vec3 exitPoint = origin + dir * t;
+                glm::vec3 landedStart = glm::floor((exitPoint - gridMin) / voxelWidth);
+                glm::ivec3 landed = glm::clamp(glm::ivec3(landedStart), cellLo, cellLo + glm::ivec3(cellWidth - 1));
+                landed[axis] = stepDir[axis] > 0 ? cellLo[axis] + cellWidth : cellLo[axis] - 1;
+                voxel = landed;
+            }
+
+            if(!insideCells(voxel, resolution)) break;
+
+            //Only climb once the ray has left the parent, the neighbour inside the same occupied parent still needs this level
+            glm::ivec3 newParent(voxel.x >> (level + 1), voxel.y >> (level + 1), voxel.z >> (level + 1));
+            if(level < levelCount && newParent != parent) level++;
+        }
+
+        return -1.0f;
+    }
+};
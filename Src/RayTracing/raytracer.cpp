@@ -1,4 +1,5 @@
 #include "raytracer.h"
+#include <chrono>
 #include <cstdint>
 #include <glm/matrix.hpp>
 #include <iostream>
@@ -6,13 +7,15 @@
 #include <vector>
 #include <vulkan/vulkan_core.h>
 
-void RayTracer::createRayTracer(VkDevice _device, VkPhysicalDevice _physicalDevice, VkQueue _graphicsQueue, VkCommandPool _graphicsPool, VkQueue _transferQueue, VkCommandPool _transferPool, VkSurfaceFormatKHR format, VkExtent2D extent, GLFWwindow* _window) {
+void RayTracer::createRayTracer(VkDevice _device, VkPhysicalDevice _physicalDevice, VkQueue _graphicsQueue, VkCommandPool _graphicsPool, VkQueue _transferQueue, VkCommandPool _transferPool, VkQueue _computeQueue, VkCommandPool _computePool, VkSurfaceFormatKHR format, VkExtent2D extent, GLFWwindow* _window) {
     device = _device;
     physicalDevice = _physicalDevice;
     graphicsQueue = _graphicsQueue;
     graphicsPool = _graphicsPool;
     transferQueue = _transferQueue;
     transferPool = _transferPool;
+    computeQueue = _computeQueue;
+    computePool = _computePool;
     window = _window;
 
     loadFunctions();
@@ -25,6 +28,9 @@ void RayTracer::createRayTracer(VkDevice _device, VkPhysicalDevice _physicalDevi
 	deviceProperties2.pNext = &rayTracingPipelineProperties;
 	vkGetPhysicalDeviceProperties2(physicalDevice, &deviceProperties2);
 
+    VkDeviceSize uboAlignment = deviceProperties2.properties.limits.minUniformBufferOffsetAlignment;
+    uboStride = (sizeof(CameraConstants) + uboAlignment - 1) / uboAlignment * uboAlignment;
+
 	// Get acceleration structure properties, which will be used later on in the sample
 	accelerationStructureFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
 	VkPhysicalDeviceFeatures2 deviceFeatures2{};
@@ -34,47 +40,27 @@ void RayTracer::createRayTracer(VkDevice _device, VkPhysicalDevice _physicalDevi
 
     cam.Initialize();
 
-    int test[15 * 15 * 15];
-
-    for(int x = 0; x < 15; x++) {
-        for(int y = 0; y < 15; y++) {
-            for (int z = 0; z < 15; z++) {
-                if((x- 7) * (x - 7) + (y - 7)*(y - 7) + (z - 7)*(z - 7) <= 16) {
-                    test[15 * 15 * x + 15 * y + z] = 1;
-                }
-                else {
-                    test[15 * 15 * x + 15 * y + z] = 0;
-                }
-            }
-        }
-    }
-
-    testBuffer.createBuffer(device, physicalDevice, 15 * 15 * 15 * 4, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
-    testBuffer.populateBuffer(device, physicalDevice, (const void*)test, 15 * 15 * 15 * 4, transferPool, transferQueue);
+    VkSemaphoreTypeCreateInfo frameTypeInfo{};
+    frameTypeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    frameTypeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    frameTypeInfo.initialValue = 0;
 
-    //Create the acceleration structure
-    VkAabbPositionsKHR aabb = { 1, 1, 1, 16, 16, 16};
+    VkSemaphoreCreateInfo frameSemaphoreInfo{};
+    frameSemaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    frameSemaphoreInfo.pNext = &frameTypeInfo;
 
-    Buffer boundingBoxBuffer;
-    boundingBoxBuffer.createBuffer(device, physicalDevice, sizeof(VkAabbPositionsKHR) , VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
-    boundingBoxBuffer.populateBuffer(device, physicalDevice, (const void*)&aabb, sizeof(VkAabbPositionsKHR), transferPool, transferQueue);
+    VK_CHECK(vkCreateSemaphore(device, &frameSemaphoreInfo, nullptr, &frameTimeline), "Failed to create frame timeline semaphore");
 
-    blases.push_back(AccelerationStructure::createBottomLevelAccelereationStructure(boundingBoxBuffer, graphicsPool, graphicsQueue));
-
-    VkTransformMatrixKHR t = {
-        1, 0, 0, 0,
-        0, 1, 0, 0,
-        0, 0, 1, 0
-    };
-
-    vector<VkTransformMatrixKHR> transforms;
-    transforms.push_back(t);
-
-    tlas = AccelerationStructure::createTopLevelAccelerationStructure(blases, transforms, graphicsPool, graphicsQueue, transferPool, transferQueue);
+    buildScheduler.create(device, computeQueue, computePool);
+    staging.create(device, physicalDevice, STAGING_RING_SIZE, buildScheduler.semaphore(), [this]() { flushUploads(); });
+    gpuProfiler.create(device, physicalDevice, graphicsQueue, graphicsPool);
+    createWorld();
 
     createImage(format, extent);
+    if(window == nullptr) createReadbacks();
     createUBOBuffer();
     createDescritorSets();
+    uploadWorld();
     createRayTracingPipeline();
     createShaderBindingTable();
 }
@@ -111,12 +97,13 @@ VkShaderModule RayTracer::createShaderModule(const string& filePath) {
 	return shaderModule;
 }
 
-VkPipelineShaderStageCreateInfo RayTracer::createShaderStageCreateInfo(VkShaderModule shaderModule, VkShaderStageFlagBits flags) {
+VkPipelineShaderStageCreateInfo RayTracer::createShaderStageCreateInfo(VkShaderModule shaderModule, VkShaderStageFlagBits flags, const VkSpecializationInfo* specialization) {
 	VkPipelineShaderStageCreateInfo createInfo{};
 	createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 	createInfo.module = shaderModule;
 	createInfo.stage = flags;
 	createInfo.pName = "main";
+	createInfo.pSpecializationInfo = specialization;
 
 	return createInfo;
 }
@@ -295,17 +282,22 @@ void RayTracer::createImage(VkSurfaceFormatKHR format, VkExtent2D extent) {
     imgExtent = extent;
 }
 
+void RayTracer::createReadbacks() {
+    //rgba16f, 8 bytes a pixel. Coherent so the host reads it straight after the fence without an invalidate
+    VkDeviceSize size = (VkDeviceSize)imgExtent.width * imgExtent.height * 8;
+
+    readbacks.resize(framesInFlight);
+    for(Buffer& readback : readbacks) {
+        readback.createBuffer(device, physicalDevice, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false);
+    }
+}
+
 void RayTracer::createUBOBuffer() {
-    ubo.createBuffer(device, physicalDevice, sizeof(CameraConstants), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, false);
+    ubo.createBuffer(device, physicalDevice, framesInFlight * uboStride, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false);
 
-    CameraConstants camCons{};
-    camCons.inverseView = glm::inverse(glm::mat4(1));
-    camCons.inverseProj = glm::inverse(glm::perspective(glm::radians(45.0f), (float)imgExtent.width / (float) imgExtent.height, 0.1f, 100.0f));
+    CameraConstants camCons = CameraConstants::create(glm::mat4(1), (float)imgExtent.width / (float) imgExtent.height);
 
-    void* mapped;
-    vkMapMemory(device, ubo.bufferMemory, 0, sizeof(camCons), 0, &mapped);
-    memcpy(mapped, &camCons, sizeof(camCons));
-    vkUnmapMemory(device, ubo.bufferMemory);
+    for(uint32_t slot = 0; slot < framesInFlight; slot++) memcpy((uint8_t*)ubo.mapped() + slot * uboStride, &camCons, sizeof(camCons));
 }
 
 void RayTracer::createDescritorSets() {
@@ -323,8 +315,9 @@ void RayTracer::createDescritorSets() {
     imgBindings.descriptorCount = 1;
     imgBindings.pImmutableSamplers = nullptr;
 
+    //Dynamic, the offset in to the camera ring is given when the set is bound
     VkDescriptorSetLayoutBinding camBindings{};
-    camBindings.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    camBindings.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     camBindings.binding = 2;
     camBindings.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
     camBindings.descriptorCount = 1;
@@ -337,11 +330,56 @@ void RayTracer::createDescritorSets() {
     storage.descriptorCount = 1;
     storage.pImmutableSamplers = nullptr;
 
-    VkDescriptorSetLayoutBinding bindingInfo[] = {asBindings, imgBindings, camBindings, storage};
+    //Palette indices and the palette are only needed once a hit is found
+    VkDescriptorSetLayoutBinding colourBindings{};
+    colourBindings.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    colourBindings.binding = 4;
+    colourBindings.stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
+    colourBindings.descriptorCount = 1;
+    colourBindings.pImmutableSamplers = nullptr;
+
+    VkDescriptorSetLayoutBinding paletteBindings{};
+    paletteBindings.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    paletteBindings.binding = 5;
+    paletteBindings.stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
+    paletteBindings.descriptorCount = 1;
+    paletteBindings.pImmutableSamplers = nullptr;
+
+    VkDescriptorSetLayoutBinding distanceBindings{};
+    distanceBindings.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    distanceBindings.binding = 6;
+    distanceBindings.stageFlags = VK_SHADER_STAGE_INTERSECTION_BIT_KHR;
+    distanceBindings.descriptorCount = 1;
+    distanceBindings.pImmutableSamplers = nullptr;
+
+    VkDescriptorSetLayoutBinding pyramidBindings{};
+    pyramidBindings.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pyramidBindings.binding = 7;
+    pyramidBindings.stageFlags = VK_SHADER_STAGE_INTERSECTION_BIT_KHR;
+    pyramidBindings.descriptorCount = 1;
+    pyramidBindings.pImmutableSamplers = nullptr;
+
+    //Per instance offsets in to bindings 3, 4, 6, 7 and 9, indexed by gl_InstanceCustomIndexEXT
+    VkDescriptorSetLayoutBinding chunkTableBindings{};
+    chunkTableBindings.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    chunkTableBindings.binding = 8;
+    chunkTableBindings.stageFlags = VK_SHADER_STAGE_INTERSECTION_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
+    chunkTableBindings.descriptorCount = 1;
+    chunkTableBindings.pImmutableSamplers = nullptr;
+
+    //The merged boxes every chunk blas is built from, gl_PrimitiveID picks one
+    VkDescriptorSetLayoutBinding boxBindings{};
+    boxBindings.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    boxBindings.binding = 9;
+    boxBindings.stageFlags = VK_SHADER_STAGE_INTERSECTION_BIT_KHR;
+    boxBindings.descriptorCount = 1;
+    boxBindings.pImmutableSamplers = nullptr;
+
+    VkDescriptorSetLayoutBinding bindingInfo[] = {asBindings, imgBindings, camBindings, storage, colourBindings, paletteBindings, distanceBindings, pyramidBindings, chunkTableBindings, boxBindings};
 
     VkDescriptorSetLayoutCreateInfo layoutCreateInfo{};
     layoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-    layoutCreateInfo.bindingCount = 4;
+    layoutCreateInfo.bindingCount = 10;
     layoutCreateInfo.pBindings = bindingInfo;
     layoutCreateInfo.pNext = nullptr;
 
@@ -357,10 +395,10 @@ void RayTracer::createDescritorSets() {
 
     VkDescriptorPoolSize camPoolSize{};
     camPoolSize.descriptorCount = 1;
-    camPoolSize.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    camPoolSize.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 
     VkDescriptorPoolSize storagePoolSize{};
-    storagePoolSize.descriptorCount = 1;
+    storagePoolSize.descriptorCount = 7;
     storagePoolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 
     VkDescriptorPoolSize poolSizes[] = { asPoolSize, imgPoolSize, camPoolSize, storagePoolSize};
@@ -383,33 +421,20 @@ void RayTracer::createDescritorSets() {
 
     VK_CHECK(vkAllocateDescriptorSets(device, &allocInfo, &set0), "Failed to allocate descriptor set");
 
-    VkWriteDescriptorSetAccelerationStructureKHR desASInfo{};
-    desASInfo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
-    desASInfo.accelerationStructureCount = 1;
-    desASInfo.pAccelerationStructures = &tlas.handle;
-    desASInfo.pNext = nullptr;
-
     VkDescriptorImageInfo imgInfo{};
     imgInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
     imgInfo.imageView = frameView;
 
+    //One slice, the dynamic offset picks which
     VkDescriptorBufferInfo camInfo{};
     camInfo.buffer = ubo.handle;
     camInfo.offset = 0;
     camInfo.range = sizeof(CameraConstants);
 
-    VkDescriptorBufferInfo storageInfo{};
-    storageInfo.buffer = testBuffer.handle;
-    storageInfo.offset = 0;
-    storageInfo.range = 15 * 15 * 15 * 4;
-    
-    VkWriteDescriptorSet asWrite{};
-    asWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    asWrite.descriptorCount = 1;
-    asWrite.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
-    asWrite.dstBinding = 0;
-    asWrite.dstSet = set0;
-    asWrite.pNext = &desASInfo;
+    VkDescriptorBufferInfo paletteInfo{};
+    paletteInfo.buffer = palette.buf.handle;
+    paletteInfo.offset = 0;
+    paletteInfo.range = VK_WHOLE_SIZE;
 
     VkWriteDescriptorSet imgWrite{};
     imgWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
@@ -422,59 +447,416 @@ void RayTracer::createDescritorSets() {
     VkWriteDescriptorSet camWrite{};
     camWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
     camWrite.descriptorCount = 1;
-    camWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    camWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     camWrite.dstBinding = 2;
     camWrite.dstSet = set0;
     camWrite.pBufferInfo = &camInfo;
 
-    VkWriteDescriptorSet storageWrite{};
-    storageWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    storageWrite.descriptorCount = 1;
-    storageWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    storageWrite.dstBinding = 3;
-    storageWrite.dstSet = set0;
-    storageWrite.pBufferInfo = &storageInfo;
+    VkWriteDescriptorSet paletteWrite{};
+    paletteWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    paletteWrite.descriptorCount = 1;
+    paletteWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    paletteWrite.dstBinding = 5;
+    paletteWrite.dstSet = set0;
+    paletteWrite.pBufferInfo = &paletteInfo;
 
-    VkWriteDescriptorSet writeInfo[] = {asWrite, imgWrite, camWrite, storageWrite};
+    VkWriteDescriptorSet writeInfo[] = {imgWrite, camWrite, paletteWrite};
 
-    vkUpdateDescriptorSets(device, 4, writeInfo, 0, VK_NULL_HANDLE);
+    vkUpdateDescriptorSets(device, 3, writeInfo, 0, VK_NULL_HANDLE);
 }
 
-void RayTracer::updateDescriptorSets(float deltaTime) {
-    CameraConstants camCons{};
-    camCons.inverseView = glm::inverse(glm::mat4(1));
-    camCons.inverseProj = glm::inverse(glm::perspective(glm::radians(45.0f), (float)imgExtent.width / (float) imgExtent.height, 0.1f, 100.0f));
+//Rolling hills of stone under dirt under grass, plus the old sphere floating above the origin
+static int worldVoxel(int x, int y, int z, uint8_t grass, uint8_t dirt, uint8_t stone, uint8_t red) {
+    float height = -6.0f + 3.0f * sinf((float)x * 0.15f) * cosf((float)z * 0.11f) + 2.0f * sinf((float)(x + z) * 0.05f);
 
-    glm::mat4 view;
+    if((float)y < height - 3.0f) return stone;
+    if((float)y < height - 1.0f) return dirt;
+    if((float)y < height) return grass;
 
-    cam.UpdateCamera(deltaTime, window, &view);
+    if((x - 8) * (x - 8) + (y - 8) * (y - 8) + (z - 8) * (z - 8) <= 16) return red;
 
-    camCons.inverseView = glm::inverse(view);
+    return 0;
+}
 
-    void* mapped;
-    vkMapMemory(device, ubo.bufferMemory, 0, sizeof(camCons), 0, &mapped);
-    memcpy(mapped, &camCons, sizeof(camCons));
-    vkUnmapMemory(device, ubo.bufferMemory);
-    
+void RayTracer::createWorld() {
+    uint8_t grass = palette.add(glm::vec3(0.3f, 0.6f, 0.2f));
+    uint8_t dirt = palette.add(glm::vec3(0.45f, 0.3f, 0.15f));
+    uint8_t stone = palette.add(glm::vec3(0.5f, 0.5f, 0.5f));
+    uint8_t red = palette.add(glm::vec3(0.75f, 0.2f, 0.2f));
+    palette.createBuffer(device, physicalDevice, transferPool, transferQueue);
 
-    VkDescriptorBufferInfo camInfo{};
-    camInfo.buffer = ubo.handle;
-    camInfo.offset = 0;
-    camInfo.range = sizeof(CameraConstants);
-    
+    chunkManager.create([=](int x, int y, int z) { return worldVoxel(x, y, z, grass, dirt, stone, red); });
+    chunkManager.update(cam.worldPos());
+}
 
-    VkWriteDescriptorSet camWrite{};
-    camWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    camWrite.descriptorCount = 1;
-    camWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    camWrite.dstBinding = 2;
-    camWrite.dstSet = set0;
-    camWrite.pBufferInfo = &camInfo;
+//Storage buffers can not be empty, an all air world still binds one uint
+static void uploadStorage(Buffer& buf, vector<uint32_t> data, VkDevice device, VkPhysicalDevice physicalDevice, StagingRing& staging) {
+    if(data.empty()) data.push_back(0u);
+    buf.createBuffer(device, physicalDevice, data.size() * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+    staging.upload(buf.handle, 0, data.data(), data.size() * sizeof(uint32_t));
+}
 
-    VkWriteDescriptorSet writeInfo[] = {camWrite};
+void RayTracer::flushUploads() {
+    if(staging.empty()) return;
 
-    vkUpdateDescriptorSets(device, 1, writeInfo, 0, VK_NULL_HANDLE);
+    VkCommandBuffer uploadCommands = buildScheduler.begin();
+    uint32_t zone = gpuProfiler.begin(uploadCommands, "staging copies", Profiler::BUILD_TRACK);
+    staging.record(uploadCommands);
+    gpuProfiler.end(uploadCommands, zone);
 
+    uint64_t value = buildScheduler.submit(uploadCommands);
+    staging.submitted(value);
+    gpuProfiler.submitted(uploadCommands, buildScheduler.semaphore(), value);
+}
+
+void RayTracer::uploadWorld() {
+    vector<uint32_t> brickData, colourData, distanceData, pyramidData;
+    vector<VkAabbPositionsKHR> boxData;
+    vector<ChunkRecord> records;
+    vector<VkTransformMatrixKHR> transforms;
+    instanceEntries.clear();
+
+    //Where each blas cache entry used by this upload has its boxes in boxData, written once however many chunks share it
+    const uint32_t NO_BOXES = 0xFFFFFFFFu;
+    vector<uint32_t> entryBoxOffsets;
+    vector<uint32_t> newEntries;
+
+    //All air chunks stay resident so they are not generated again, but get no instance
+    for(const Chunk* chunk : chunkManager.resident()) {
+        if(chunk->empty) continue;
+
+        ChunkRecord record{};
+        record.brickMapOffset = (uint32_t)brickData.size();
+        record.colourOffset = (uint32_t)colourData.size();
+        record.distanceOffset = (uint32_t)distanceData.size();
+        record.pyramidOffset = (uint32_t)pyramidData.size();
+
+        brickData.insert(brickData.end(), chunk->brickMap.data.begin(), chunk->brickMap.data.end());
+        colourData.insert(colourData.end(), chunk->brickMap.colours.begin(), chunk->brickMap.colours.end());
+        pyramidData.insert(pyramidData.end(), chunk->pyramid.data.begin(), chunk->pyramid.data.end());
+
+        //Distances are read 4 to a uint, each chunk starts on a fresh one
+        size_t distanceStart = distanceData.size();
+        distanceData.resize(distanceStart + (chunk->distanceField.bytes() + 3) / 4, 0u);
+        memcpy(&distanceData[distanceStart], chunk->distanceField.data(), chunk->distanceField.bytes());
+
+        bool wholeChunk = chunk->boxes.boxes.size() > MAX_CHUNK_BOXES;
+
+        //A chunk keeps its cache entry while resident, only chunks new since the last upload look one up
+        uint32_t entry = chunkBlasEntries.find(chunk->coord);
+        if(entry == ChunkMap::EMPTY) {
+            //Boxes are in chunk space, the instance transform moves them in to place. Every noisy chunk is the same single box, so they all share hash 0
+            vector<VkAabbPositionsKHR> boxes;
+            uint64_t hash = 0;
+
+            if(wholeChunk) boxes.push_back({0, 0, 0, (float)CHUNK_SIZE, (float)CHUNK_SIZE, (float)CHUNK_SIZE});
+            else {
+                for(const VoxelBox& box : chunk->boxes.boxes) {
+                    boxes.push_back({(float)box.min.x, (float)box.min.y, (float)box.min.z, (float)box.max.x, (float)box.max.y, (float)box.max.z});
+                }
+                hash = chunk->boxes.contentHash;
+            }
+
+            bool added;
+            entry = blasCache.acquire(hash, boxes, added);
+            if(added) newEntries.push_back(entry);
+
+            chunkBlasEntries.insert(chunk->coord, entry);
+            instancedCoords.push_back(chunk->coord);
+        }
+
+        if(entryBoxOffsets.size() < blasCache.capacity()) entryBoxOffsets.resize(blasCache.capacity(), NO_BOXES);
+        if(entryBoxOffsets[entry] == NO_BOXES) {
+            entryBoxOffsets[entry] = (uint32_t)boxData.size();
+            const vector<VkAabbPositionsKHR>& boxes = blasCache.boxes(entry);
+            boxData.insert(boxData.end(), boxes.begin(), boxes.end());
+        }
+
+        record.boxOffset = wholeChunk ? WHOLE_CHUNK_BOX : entryBoxOffsets[entry];
+        instanceEntries.push_back(entry);
+
+        records.push_back(record);
+
+        glm::vec3 origin = chunk->origin();
+        VkTransformMatrixKHR t = {
+            1, 0, 0, origin.x,
+            0, 1, 0, origin.y,
+            0, 0, 1, origin.z
+        };
+
+        transforms.push_back(t);
+    }
+
+    //Chunks evicted since the last upload give up their blas. Done after the lookups so a new chunk can still pick up a blas an evicted one leaves behind
+    size_t kept = 0;
+    for(glm::ivec3 coord : instancedCoords) {
+        if(chunkManager.find(coord)) {
+            instancedCoords[kept++] = coord;
+            continue;
+        }
+
+        blasCache.release(chunkBlasEntries.find(coord));
+        chunkBlasEntries.erase(coord);
+    }
+    instancedCoords.resize(kept);
+
+    if(records.empty()) records.push_back({});
+    if(boxData.empty()) boxData.push_back({});
+
+    //The same buffer is the blas build input and binding 9, where the intersection shader reads back the box it was called for
+    worldBoxBuf.createBuffer(device, physicalDevice, boxData.size() * sizeof(VkAabbPositionsKHR), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+    staging.upload(worldBoxBuf.handle, 0, boxData.data(), boxData.size() * sizeof(VkAabbPositionsKHR));
+
+    uploadStorage(worldBrickBuf, brickData, device, physicalDevice, staging);
+    uploadStorage(worldColourBuf, colourData, device, physicalDevice, staging);
+    uploadStorage(worldDistanceBuf, distanceData, device, physicalDevice, staging);
+    uploadStorage(worldPyramidBuf, pyramidData, device, physicalDevice, staging);
+
+    chunkTableBuf.createBuffer(device, physicalDevice, records.size() * sizeof(ChunkRecord), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+    staging.upload(chunkTableBuf.handle, 0, records.data(), records.size() * sizeof(ChunkRecord));
+
+    VkDeviceAddress boxAddress = worldBoxBuf.getBufferAddress(device);
+    vector<BlasGeometry> geometries;
+
+    for(uint32_t entry : newEntries) {
+        const vector<VkAabbPositionsKHR>& boxes = blasCache.boxes(entry);
+        geometries.push_back({boxAddress + entryBoxOffsets[entry] * sizeof(VkAabbPositionsKHR), (uint32_t)boxes.size(), boxes.data()});
+    }
+
+    //The world buffers, the blases of boxes the cache has not seen and the tlas over every instance go to the build queue in one submission,
+    //which the next frame waits for on the gpu. The copies go first, the builds read the boxes they bring
+    VkCommandBuffer buildCommands = buildScheduler.begin();
+    uint32_t copyZone = gpuProfiler.begin(buildCommands, "world copies", Profiler::BUILD_TRACK);
+    staging.record(buildCommands);
+    gpuProfiler.end(buildCommands, copyZone);
+
+    //A host build is done by the time it returns and only leaves the copies to the device in buildCommands
+    bool hostBuild = hostBlasBuilds && AccelerationStructure::hostCommands;
+    uint32_t blasZone = gpuProfiler.begin(buildCommands, hostBuild ? "blas copies" : "blas builds", Profiler::BUILD_TRACK);
+    if(hostBuild) pendingBatch = AccelerationStructure::buildBottomLevelAccelerationStructuresOnHost(geometries, buildCommands, compactBlases);
+    else pendingBatch = AccelerationStructure::recordBottomLevelAccelerationStructures(geometries, buildCommands, compactBlases);
+    gpuProfiler.end(buildCommands, blasZone);
+    pendingEntries = newEntries;
+    for(size_t i = 0; i < newEntries.size(); i++) blasCache.setBlas(newEntries[i], pendingBatch.blases[i]);
+
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    vkCmdPipelineBarrier(buildCommands, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    vector<AccelerationStructure> instanceBlases;
+    for(uint32_t entry : instanceEntries) instanceBlases.push_back(blasCache.blas(entry));
+
+    //The tlas outlives the world, only its instances are rewritten
+    instanceTransforms = transforms;
+    uploadedTransforms = transforms;
+    transformsDirty = false;
+    uint32_t tlasZone = gpuProfiler.begin(buildCommands, "tlas build", Profiler::BUILD_TRACK);
+    tlas.recordBuild(buildCommands, instanceBlases, instanceTransforms);
+    gpuProfiler.end(buildCommands, tlasZone);
+
+    worldReadyValue = buildScheduler.submit(buildCommands);
+    staging.submitted(worldReadyValue);
+    gpuProfiler.submitted(buildCommands, buildScheduler.semaphore(), worldReadyValue);
+    worldBuildPending = true;
+
+    const BlasCacheStats& cacheStats = blasCache.stats;
+    cout << "World upload : " << instanceEntries.size() << " chunk instances over " << cacheStats.entries << " blases, " << newEntries.size() << " built" << (hostBuild ? " on the host" : "") << ", blas cache hit rate "
+         << cacheStats.hitRate() * 100.0 << "% (" << cacheStats.hits << " of " << cacheStats.lookups << ")" << endl;
+
+    writeWorldDescriptors();
+
+    Buffer::allocator.printStats("after world upload");
+    cout << "Staging : " << staging.stats.bytes / 1024 << " KiB in " << staging.stats.copies << " copies over " << staging.stats.submissions << " submissions, "
+         << staging.stats.stalls << " waits for ring space" << endl;
+}
+
+void RayTracer::finishWorldBuild() {
+    worldBuildPending = false;
+    pendingBatch.releaseScratch();
+
+    //Compacted sizes are readable now. The copies and the tlas pointed at them go out as one more build, the originals go once it is done
+    if(pendingBatch.queryPool != VK_NULL_HANDLE) {
+        //The relink rebuilds the tlas in place, the frames in flight still trace it
+        waitForFrames(frameValue - 1);
+
+        VkCommandBuffer buildCommands = buildScheduler.begin();
+        uint32_t zone = gpuProfiler.begin(buildCommands, "blas compaction", Profiler::BUILD_TRACK);
+
+        vector<AccelerationStructure> originals = pendingBatch.recordCompaction(buildCommands);
+        for(size_t i = 0; i < pendingEntries.size(); i++) blasCache.setBlas(pendingEntries[i], pendingBatch.blases[i]);
+
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+        barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+        vkCmdPipelineBarrier(buildCommands, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        vector<AccelerationStructure> instanceBlases;
+        for(uint32_t entry : instanceEntries) instanceBlases.push_back(blasCache.blas(entry));
+        tlas.recordRelink(buildCommands, instanceBlases);
+        gpuProfiler.end(buildCommands, zone);
+
+        worldReadyValue = buildScheduler.submit(buildCommands);
+        gpuProfiler.submitted(buildCommands, buildScheduler.semaphore(), worldReadyValue);
+        buildScheduler.onComplete(worldReadyValue, [originals]() {
+            for(AccelerationStructure original : originals) AccelerationStructure::destroyAccelerationStructure(original);
+        });
+    }
+
+    pendingBatch = BlasBatch{};
+    pendingEntries.clear();
+}
+
+void RayTracer::benchmarkBlasBuilds() {
+    const int REGION = 128;
+    const int REPEATS = 3;
+    const int chunkSizes[] = {8, 16, 32, 64};
+
+    auto solidAt = [](int x, int y, int z) { return worldVoxel(x, y, z, 1, 1, 1, 1) != 0; };
+    auto now = []() { return chrono::high_resolution_clock::now(); };
+    auto milliseconds = [](auto start, auto end) { return chrono::duration<double, milli>(end - start).count(); };
+
+    //Nothing else on the build queue while timing
+    buildScheduler.wait(buildScheduler.lastSubmitted());
+    buildScheduler.collect();
+
+    cout << "BLAS builds of a " << REGION << "x32x" << REGION << " slab of terrain, best of " << REPEATS << (AccelerationStructure::hostCommands ? "" : ", the device has no host builds") << endl;
+
+    for(int size : chunkSizes) {
+        //Boxes in chunk space like the world's, all air chunks get no blas
+        vector<VkAabbPositionsKHR> boxData;
+        vector<pair<size_t, uint32_t>> chunkRanges;
+        int layers = max(1, 16 / size);
+
+        for(int cx = 0; cx < REGION / size; cx++) {
+            for(int cy = -layers; cy < layers; cy++) {
+                for(int cz = 0; cz < REGION / size; cz++) {
+                    glm::ivec3 base = glm::ivec3(cx, cy, cz) * size;
+
+                    VoxelBoxes boxes;
+                    boxes.build(size, [&](int x, int y, int z) { return solidAt(base.x + x, base.y + y, base.z + z); });
+                    if(boxes.boxes.empty()) continue;
+
+                    chunkRanges.push_back({boxData.size(), (uint32_t)boxes.boxes.size()});
+                    for(const VoxelBox& box : boxes.boxes) {
+                        boxData.push_back({(float)box.min.x, (float)box.min.y, (float)box.min.z, (float)box.max.x, (float)box.max.y, (float)box.max.z});
+                    }
+                }
+            }
+        }
+
+        Buffer boxBuf;
+        boxBuf.createBuffer(device, physicalDevice, boxData.size() * sizeof(VkAabbPositionsKHR), VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+        staging.upload(boxBuf.handle, 0, boxData.data(), boxData.size() * sizeof(VkAabbPositionsKHR));
+        flushUploads();
+        buildScheduler.wait(buildScheduler.lastSubmitted());
+        VkDeviceAddress boxAddress = boxBuf.getBufferAddress(device);
+
+        vector<BlasGeometry> geometries;
+        for(const pair<size_t, uint32_t>& range : chunkRanges) geometries.push_back({boxAddress + range.first * sizeof(VkAabbPositionsKHR), range.second, &boxData[range.first]});
+
+        auto destroyBatch = [](BlasBatch& batch) {
+            batch.releaseScratch();
+            for(AccelerationStructure& blas : batch.blases) AccelerationStructure::destroyAccelerationStructure(blas);
+        };
+
+        double deviceBest = 1e30, hostBest = 1e30, hostUploadBest = 1e30;
+
+        for(int r = 0; r < REPEATS; r++) {
+            auto start = now();
+            VkCommandBuffer commands = buildScheduler.begin();
+            BlasBatch batch = AccelerationStructure::recordBottomLevelAccelerationStructures(geometries, commands);
+            buildScheduler.wait(buildScheduler.submit(commands));
+            deviceBest = min(deviceBest, milliseconds(start, now()));
+
+            buildScheduler.collect();
+            destroyBatch(batch);
+
+            if(!AccelerationStructure::hostCommands) continue;
+
+            //Host build on its own, then with the copies to the device on top
+            start = now();
+            commands = buildScheduler.begin();
+            BlasBatch hostBatch = AccelerationStructure::buildBottomLevelAccelerationStructuresOnHost(geometries, commands);
+            hostBest = min(hostBest, milliseconds(start, now()));
+            buildScheduler.wait(buildScheduler.submit(commands));
+            hostUploadBest = min(hostUploadBest, milliseconds(start, now()));
+
+            buildScheduler.collect();
+            destroyBatch(hostBatch);
+        }
+
+        boxBuf.destroy(device);
+
+        double chunkCount = (double)chunkRanges.size();
+        cout << "Chunk " << size << "^3 : " << chunkRanges.size() << " blases, " << boxData.size() << " boxes | device " << deviceBest << " ms, " << chunkCount / deviceBest * 1000.0 << " blases/s";
+        if(AccelerationStructure::hostCommands) {
+            cout << " | host " << hostBest << " ms, " << chunkCount / hostBest * 1000.0 << " blases/s, " << hostUploadBest << " ms with the upload";
+        }
+        cout << endl;
+    }
+}
+
+void RayTracer::destroyWorld() {
+    worldBrickBuf.destroy(device);
+    worldColourBuf.destroy(device);
+    worldDistanceBuf.destroy(device);
+    worldPyramidBuf.destroy(device);
+    chunkTableBuf.destroy(device);
+    worldBoxBuf.destroy(device);
+}
+
+void RayTracer::writeWorldDescriptors() {
+    VkWriteDescriptorSetAccelerationStructureKHR desASInfo{};
+    desASInfo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
+    desASInfo.accelerationStructureCount = 1;
+    desASInfo.pAccelerationStructures = &tlas.structure.handle;
+    desASInfo.pNext = nullptr;
+
+    VkWriteDescriptorSet asWrite{};
+    asWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    asWrite.descriptorCount = 1;
+    asWrite.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+    asWrite.dstBinding = 0;
+    asWrite.dstSet = set0;
+    asWrite.pNext = &desASInfo;
+
+    Buffer* buffers[] = {&worldBrickBuf, &worldColourBuf, &worldDistanceBuf, &worldPyramidBuf, &chunkTableBuf, &worldBoxBuf};
+    uint32_t bindings[] = {3, 4, 6, 7, 8, 9};
+
+    VkDescriptorBufferInfo bufferInfos[6]{};
+    VkWriteDescriptorSet writeInfo[7] = {asWrite};
+
+    for(int i = 0; i < 6; i++) {
+        bufferInfos[i].buffer = buffers[i]->handle;
+        bufferInfos[i].offset = 0;
+        bufferInfos[i].range = VK_WHOLE_SIZE;
+
+        VkWriteDescriptorSet& write = writeInfo[i + 1];
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.descriptorCount = 1;
+        write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        write.dstBinding = bindings[i];
+        write.dstSet = set0;
+        write.pBufferInfo = &bufferInfos[i];
+    }
+
+    //No frame in flight uses the set while the world changes
+    vkUpdateDescriptorSets(device, 7, writeInfo, 0, VK_NULL_HANDLE);
+}
+
+void RayTracer::updateCamera(float deltaTime, uint32_t frameSlot) {
+    glm::mat4 view;
+
+    //Headless there is no input to move it
+    if(window != nullptr) cam.UpdateCamera(deltaTime, window, &view);
+    else view = cam.viewMatrix();
+
+    CameraConstants camCons = CameraConstants::create(view, (float)imgExtent.width / (float) imgExtent.height);
+
+    memcpy((uint8_t*)ubo.mapped() + cameraOffset(frameSlot), &camCons, sizeof(camCons));
 }
 
 void RayTracer::createRayTracingPipeline() {
@@ -497,8 +879,18 @@ void RayTracer::createRayTracingPipeline() {
     VkShaderModule closestHitMod = createShaderModule("Shaders/closestHit.spv");
     shaderCreateInfos[iClosestHit] = createShaderStageCreateInfo(closestHitMod, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR);
 
+    //GRID_SIZE is constant_id 0 in the intersection shader. It has to outlive vkCreateRayTracingPipelinesKHR, which happens below in this function
+    int32_t gridSize = CHUNK_SIZE;
+    VkSpecializationMapEntry gridSizeEntry = {0, 0, sizeof(int32_t)};
+
+    VkSpecializationInfo intersectionSpecialization{};
+    intersectionSpecialization.mapEntryCount = 1;
+    intersectionSpecialization.pMapEntries = &gridSizeEntry;
+    intersectionSpecialization.dataSize = sizeof(int32_t);
+    intersectionSpecialization.pData = &gridSize;
+
     VkShaderModule intersectionMod = createShaderModule("Shaders/intersection.spv");
-    shaderCreateInfos[iIntersection] = createShaderStageCreateInfo(intersectionMod, VK_SHADER_STAGE_INTERSECTION_BIT_KHR);
+    shaderCreateInfos[iIntersection] = createShaderStageCreateInfo(intersectionMod, VK_SHADER_STAGE_INTERSECTION_BIT_KHR, &intersectionSpecialization);
 
     VkRayTracingShaderGroupCreateInfoKHR group{};
     group.sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
@@ -565,20 +957,15 @@ void RayTracer::createShaderBindingTable() {
     vector<uint8_t> shaderHandles(groupCount * handleSize);
     VK_CHECK(vkGetRayTracingShaderGroupHandlesKHR(device, rayTracingPipeline, 0, groupCount, shaderHandles.size(), shaderHandles.data()), "Failed to get shader handles");
 
-    sbtBuffer.createBuffer(device, physicalDevice, groupCount * baseAligment, VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false);
+    sbtBuffer.createBuffer(device, physicalDevice, groupCount * baseAligment, VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false, baseAligment);
 
     //Put the data in the buffer
-    void* mappedData = nullptr;
-    vkMapMemory(device, sbtBuffer.bufferMemory, 0, groupCount * handleAlignemt, 0, &mappedData);
-
-    uint8_t* pData = reinterpret_cast<uint8_t*>(mappedData);
+    uint8_t* pData = reinterpret_cast<uint8_t*>(sbtBuffer.mapped());
 
     for (uint32_t i = 0; i < groupCount; i++) {
         memcpy(pData + i * baseAligment, shaderHandles.data() + i * handleSize, handleSize);
     }
 
-    vkUnmapMemory(device, sbtBuffer.bufferMemory);
-
     VkDeviceAddress sbtAddress = sbtBuffer.getBufferAddress(device);
 
     //Finally get the device addresses and shit idk wtf
@@ -617,62 +1004,150 @@ void RayTracer::handleResize(VkSurfaceFormatKHR format, VkExtent2D extent) {
     vkUpdateDescriptorSets(device, 1, &imgWrite, 0, VK_NULL_HANDLE);
 }
 
-void RayTracer::recordCommandBuffer(CommandBuffer commandBuffer, VkImage swapchainImage) {
+void RayTracer::recordCommandBuffer(CommandBuffer commandBuffer, VkImage swapchainImage, uint32_t frameSlot) {
+    PROFILE_SCOPE("record commands");
+
     commandBuffer.beginRecording(false);
 
+    //Moved instances are refit in to the tlas ahead of the trace that reads it. Not while a build still reads the instance buffer, the refit waits a frame.
+    //The instances are written on the cpu, so the frame with the last refit has to be done reading them. The refit itself is ordered after the traces of
+    //earlier frames on the queue, they end in barriers over all commands
+    if(transformsDirty && buildScheduler.reached(worldReadyValue)) {
+        waitForFrames(instanceReadFrame);
+        GpuZone zone(gpuProfiler, commandBuffer.handle, "tlas refit", Profiler::GRAPHICS_TRACK);
+        tlas.update(commandBuffer.handle, instanceTransforms);
+        transformsDirty = false;
+        instanceReadFrame = frameValue;
+    }
+
     vkCmdBindPipeline(commandBuffer.handle, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, rayTracingPipeline);
-    vkCmdBindDescriptorSets(commandBuffer.handle, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, rayTracingPipelineLayout, 0, 1, &set0, 0, 0);
+    uint32_t cameraSlice = cameraOffset(frameSlot);
+    vkCmdBindDescriptorSets(commandBuffer.handle, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, rayTracingPipelineLayout, 0, 1, &set0, 1, &cameraSlice);
 
+    uint32_t traceZone = gpuProfiler.begin(commandBuffer.handle, "trace rays", Profiler::GRAPHICS_TRACK);
     vkCmdTraceRaysKHR(commandBuffer.handle, &rgenRegion, &missRegion, &hitRegion, &callRegion, imgExtent.width, imgExtent.height, 1);
+    gpuProfiler.end(commandBuffer.handle, traceZone);
 
-    //Now we shall begin copying the generated img to the swapchain. 
     VkImageSubresourceRange subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
 
-    //Change the layouts of the images to help copying
-    setImgLayout(commandBuffer, swapchainImage, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, subresourceRange);
-    //Change the layout of the created image
-    setImgLayout(commandBuffer, frame, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, subresourceRange);
+    if(swapchainImage == VK_NULL_HANDLE) {
+        GpuZone zone(gpuProfiler, commandBuffer.handle, "copy to readback", Profiler::GRAPHICS_TRACK);
+
+        setImgLayout(commandBuffer, frame, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, subresourceRange);
 
-    //Now we shall do the actual copy operation 
-    VkImageCopy copyRegion{};
-	copyRegion.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
-	copyRegion.srcOffset = { 0, 0, 0 };
-	copyRegion.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
-	copyRegion.dstOffset = { 0, 0, 0 };
-	copyRegion.extent = { imgExtent.width, imgExtent.height, 1 };
+        VkBufferImageCopy copyRegion{};
+        copyRegion.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+        copyRegion.imageExtent = { imgExtent.width, imgExtent.height, 1 };
 
-    vkCmdCopyImage(commandBuffer.handle, frame, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, swapchainImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+        vkCmdCopyImageToBuffer(commandBuffer.handle, frame, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readbacks[frameSlot].handle, 1, &copyRegion);
 
-    //Set the layout of the images back
-    setImgLayout(commandBuffer, swapchainImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, subresourceRange);
-    setImgLayout(commandBuffer, frame, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL, subresourceRange);
+        setImgLayout(commandBuffer, frame, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL, subresourceRange);
+
+        //The copy has to be visible to the host once the fence says the frame is done
+        VkMemoryBarrier hostBarrier{};
+        hostBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer.handle, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &hostBarrier, 0, nullptr, 0, nullptr);
+    }
+    else {
+        uint32_t copyZone = gpuProfiler.begin(commandBuffer.handle, "copy to swapchain", Profiler::GRAPHICS_TRACK);
+
+        //Now we shall begin copying the generated img to the swapchain. 
+        //Change the layouts of the images to help copying
+        setImgLayout(commandBuffer, swapchainImage, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, subresourceRange);
+        //Change the layout of the created image
+        setImgLayout(commandBuffer, frame, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, subresourceRange);
+
+        //Now we shall do the actual copy operation 
+        VkImageCopy copyRegion{};
+        copyRegion.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+        copyRegion.srcOffset = { 0, 0, 0 };
+        copyRegion.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+        copyRegion.dstOffset = { 0, 0, 0 };
+        copyRegion.extent = { imgExtent.width, imgExtent.height, 1 };
+
+        vkCmdCopyImage(commandBuffer.handle, frame, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, swapchainImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+
+        //Set the layout of the images back
+        setImgLayout(commandBuffer, swapchainImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, subresourceRange);
+        setImgLayout(commandBuffer, frame, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL, subresourceRange);
+        gpuProfiler.end(commandBuffer.handle, copyZone);
+    }
 
     commandBuffer.endRecording();
-}
 
-void RayTracer::drawFrame(CommandBuffer commandBuffer, VkImage swapchainImage, float deltaTime) {
+    //Read back once the frame's submission reaches its value on the frame timeline
+    gpuProfiler.submitted(commandBuffer.handle, frameTimeline, frameValue);
+}
 
-    updateDescriptorSets(deltaTime);
+void RayTracer::waitForFrames(uint64_t value) {
+    if(value == 0) return;
 
-    recordCommandBuffer(commandBuffer, swapchainImage);
+    VkSemaphoreWaitInfo waitInfo{};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &frameTimeline;
+    waitInfo.pValues = &value;
 
+    VK_CHECK(vkWaitSemaphores(device, &waitInfo, UINT64_MAX), "Failed to wait for frames in flight");
 }
 
-void RayTracer::cleanup() {
+void RayTracer::drawFrame(CommandBuffer commandBuffer, VkImage swapchainImage, float deltaTime, uint32_t frameSlot) {
+    frameValue++;
 
-    testBuffer.destroy(device);
+    updateCamera(deltaTime, frameSlot);
 
-    AccelerationStructure::destroyAccelerationStructure(tlas);
+    buildScheduler.collect();
+    gpuProfiler.collect();
 
-    for(AccelerationStructure as : blases) {
-        AccelerationStructure::destroyAccelerationStructure(as);
+    //The other slots may still be tracing the world, so it is only changed once the frames before this one are done. Those waited for every build
+    //before them, so the old world buffers can go straight away after. The resident set only changes once the last upload's blases are settled,
+    //compaction may still swap them
+    if(worldBuildPending) {
+        if(buildScheduler.reached(worldReadyValue)) finishWorldBuild();
+    }
+    else if(chunkManager.update(cam.worldPos())) {
+        PROFILE_SCOPE("world upload");
+        waitForFrames(frameValue - 1);
+        destroyWorld();
+        uploadWorld();
     }
 
+    //Whatever was staged outside a world upload goes in one submission for the frame
+    flushUploads();
+
+    recordCommandBuffer(commandBuffer, swapchainImage, frameSlot);
+
+}
+
+void RayTracer::setInstanceTransform(uint32_t instance, const VkTransformMatrixKHR& transform) {
+    instanceTransforms.at(instance) = transform;
+    transformsDirty = true;
+}
+
+void RayTracer::cleanup() {
+
+    buildScheduler.destroy();
+    staging.destroy();
+    gpuProfiler.destroy();
+    if(pendingBatch.queryPool != VK_NULL_HANDLE) vkDestroyQueryPool(device, pendingBatch.queryPool, nullptr);
+    pendingBatch.releaseScratch();
+
+    destroyWorld();
+    tlas.destroy();
+    blasCache.destroy();
+    palette.destroy(device);
+
     vkDestroyImage(device, frame, nullptr);
     vkDestroyImageView(device, frameView, nullptr);
     vkFreeMemory(device, imgMemory, nullptr);
 
+    for(Buffer& readback : readbacks) readback.destroy(device);
+    readbacks.clear();
+
     ubo.destroy(device);
+    vkDestroySemaphore(device, frameTimeline, nullptr);
 
     vkDestroyDescriptorSetLayout(device, set0Layout, nullptr);
     vkDestroyDescriptorPool(device, descriptorPool, nullptr);
@@ -2,15 +2,19 @@
 
 #include "../buffer.h"
 #include "../commandBuffer.h"
-#include <GLFW/glfw3.h>
+#include "../window.h"
 #include <vulkan/vulkan_core.h>
 #include <stdexcept>
 #include <vector>
 #include <fstream>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
-#include "../DataStructures/grid.h"
+#include "../DataStructures/chunkManager.h"
+#include "../DataStructures/palette.h"
 #include "accelerationStructure.h"
+#include "buildScheduler.h"
+#include "../stagingRing.h"
+#include "../gpuProfiler.h"
 #include "../Camera.h"
 
 using namespace std;
@@ -18,9 +22,20 @@ using namespace std;
 #define VK_CHECK(name, err) \
 if(name != VK_SUCCESS) { throw runtime_error(err); }
 
-struct CameraConstants {
-    glm::mat4 inverseView;
-    glm::mat4 inverseProj;
+//boxOffset of a chunk that is drawn as one box covering all of it, the intersection shader walks its pyramid instead
+const uint32_t WHOLE_CHUNK_BOX = 0xFFFFFFFFu;
+
+//Past this many merged boxes a chunk is noisy enough that one box and the pyramid walk beat a bvh over the boxes
+const uint32_t MAX_CHUNK_BOXES = 1024;
+
+//One entry of the table at binding 8, where each instance finds its chunk in the shared buffers. Matches ChunkRecord in the shaders, 32 bytes in std430
+struct ChunkRecord {
+    uint32_t brickMapOffset;
+    uint32_t colourOffset;
+    uint32_t distanceOffset;
+    uint32_t pyramidOffset;
+    uint32_t boxOffset;
+    uint32_t padding[3];
 };
 
 struct ShaderBindingTable {
@@ -38,13 +53,45 @@ class RayTracer {
 
     Camera cam;
 
-    void createRayTracer(VkDevice _device, VkPhysicalDevice _physicalDevice, VkQueue _graphicsQueue, VkCommandPool _graphicsPool, VkQueue _transferQueue, VkCommandPool _transferPool, VkSurfaceFormatKHR format, VkExtent2D extent, GLFWwindow* window);
-    void drawFrame(CommandBuffer commandBuffer, VkImage swapchainImage, float deltaTime);
+    //window is null when rendering headless, the camera then stays where it is and every frame is copied to a readback buffer instead of a swapchain image
+    void createRayTracer(VkDevice _device, VkPhysicalDevice _physicalDevice, VkQueue _graphicsQueue, VkCommandPool _graphicsPool, VkQueue _transferQueue, VkCommandPool _transferPool, VkQueue _computeQueue, VkCommandPool _computePool, VkSurfaceFormatKHR format, VkExtent2D extent, GLFWwindow* window);
+    //frameSlot picks the camera slice, the caller has waited for the last frame that used the slot. Headless swapchainImage is VK_NULL_HANDLE
+    void drawFrame(CommandBuffer commandBuffer, VkImage swapchainImage, float deltaTime, uint32_t frameSlot);
     void cleanup();
 
     //Handling resize
     void handleResize(VkSurfaceFormatKHR format, VkExtent2D extent);
 
+    //Moves one chunk instance, picked up as a tlas refit by the next frame. Instances are in the order of the chunk table and reset on every world upload
+    void setInstanceTransform(uint32_t instance, const VkTransformMatrixKHR& transform);
+    uint32_t instanceCount() const { return (uint32_t)instanceTransforms.size(); }
+    //Where the last world upload placed the instance, before anything moved it
+    const VkTransformMatrixKHR& uploadedTransform(uint32_t instance) const { return uploadedTransforms.at(instance); }
+    const DynamicTlas& topLevel() const { return tlas; }
+
+    //The frame submission waits on this semaphore reaching buildWaitValue before it builds or traces, that is the only sync between rendering and the build queue.
+    //Everything on the build queue is something the next frame reads, so it waits for the last of it
+    VkSemaphore buildSemaphore() const { return buildScheduler.semaphore(); }
+    uint64_t buildWaitValue() const { return buildScheduler.lastSubmitted(); }
+
+    //The submission of the frame drawFrame recorded signals frameSignalValue on this semaphore. Shared state the frames read, the world buffers and the tlas,
+    //is only changed once the frames before have reached their value, so the other slots can stay in flight in the meantime
+    VkSemaphore frameSemaphore() const { return frameTimeline; }
+    uint64_t frameSignalValue() const { return frameValue; }
+
+    //How many frames the caller keeps in flight, one camera slice each. Set before createRayTracer
+    void setFramesInFlight(uint32_t count) { framesInFlight = count; }
+
+    //Headless, the frame last drawn in the slot as rgba half floats, tightly packed rows of frameExtent. Only whole once the slot's fence has signalled
+    const void* readback(uint32_t frameSlot) const { return readbacks.at(frameSlot).mapped(); }
+    VkExtent2D frameExtent() const { return imgExtent; }
+
+    //Chunk blases are built on the cpu and only copied to the gpu, which leaves the gpu to render while chunks stream in. Ignored when the device can not build on the host
+    void setHostBlasBuilds(bool enabled) { hostBlasBuilds = enabled; }
+
+    //Builds the blases of the same terrain cut in to chunks of several sizes on the device and on the host and prints the throughput of each
+    void benchmarkBlasBuilds();
+
     private:
 
     VkDevice device;
@@ -56,6 +103,19 @@ class RayTracer {
     VkCommandPool transferPool;
     VkQueue transferQueue;
 
+    //Acceleration structure builds go here, see BuildScheduler
+    VkCommandPool computePool;
+    VkQueue computeQueue;
+    BuildScheduler buildScheduler;
+
+    //Uploads go through here and are copied on the build queue, in the world build's submission or in one of their own per frame
+    StagingRing staging;
+    static const VkDeviceSize STAGING_RING_SIZE = 64ull * 1024 * 1024;
+    void flushUploads();
+
+    //Timestamps around the trace, the copy to the swapchain and the builds, read back once a frame in drawFrame
+    GpuProfiler gpuProfiler;
+
     GLFWwindow* window;
 
     //Pipeline creation function
@@ -69,13 +129,22 @@ class RayTracer {
 
     //functions for pipeline creation
     VkShaderModule createShaderModule(const string& filePath);
-    VkPipelineShaderStageCreateInfo createShaderStageCreateInfo(VkShaderModule shaderModule, VkShaderStageFlagBits flags);
+    VkPipelineShaderStageCreateInfo createShaderStageCreateInfo(VkShaderModule shaderModule, VkShaderStageFlagBits flags, const VkSpecializationInfo* specialization = nullptr);
 
-    //Descriptor sets
+    //Descriptor sets. Written when what they point at changes, never per frame, binding 2 is moved to the frame's camera slice with a dynamic offset
     VkDescriptorPool descriptorPool;
     VkDescriptorSet set0;
     VkDescriptorSetLayout set0Layout;
 
+    //Frames in flight
+    uint32_t framesInFlight = 2;
+    VkSemaphore frameTimeline;
+    uint64_t frameValue = 0;
+    uint64_t instanceReadFrame = 0; //Last frame that refit the tlas, its build reads the instance buffer the next refit writes on the cpu
+
+    //Blocks until every frame up to value is done with. Only when the world changes, frames otherwise wait on their own slot
+    void waitForFrames(uint64_t value);
+
     //Raytracing pipeline
     vector<VkRayTracingShaderGroupCreateInfoKHR> shaderGroups;
     VkPipelineLayout rayTracingPipelineLayout;
@@ -85,10 +154,46 @@ class RayTracer {
     VkPhysicalDeviceRayTracingPipelinePropertiesKHR rayTracingPipelineProperties{};
     VkPhysicalDeviceAccelerationStructureFeaturesKHR accelerationStructureFeatures{};
 
-    //Testing
-    vector<AccelerationStructure> blases;
-    AccelerationStructure tlas;
-    Buffer testBuffer;
+    //World. Every resident chunk that is not all air is one instance of the blas over its merged boxes, its data is packed in to the world buffers
+    ChunkManager chunkManager;
+    Palette palette;
+
+    //Chunks with the same boxes share a blas. chunkBlasEntries maps every instanced chunk to its cache entry until it is evicted
+    BlasCache blasCache;
+    ChunkMap chunkBlasEntries;
+    vector<glm::ivec3> instancedCoords;
+
+    //Chunk blases live as long as some resident chunk uses them, copying them down to their compacted size is worth the extra pass
+    bool compactBlases = true;
+    bool hostBlasBuilds = false;
+
+    //Built once per world upload and refit in place when instances move
+    DynamicTlas tlas;
+    vector<VkTransformMatrixKHR> instanceTransforms;
+    vector<VkTransformMatrixKHR> uploadedTransforms;
+    bool transformsDirty = false;
+
+    Buffer worldBrickBuf;
+    Buffer worldColourBuf;
+    Buffer worldDistanceBuf;
+    Buffer worldPyramidBuf;
+    Buffer chunkTableBuf;
+    Buffer worldBoxBuf;
+
+    //Timeline value of the last build the world needs. The blases of an upload stay in pendingBatch until it is reached, so they can be compacted
+    uint64_t worldReadyValue = 0;
+    bool worldBuildPending = false;
+    BlasBatch pendingBatch;
+    vector<uint32_t> pendingEntries;
+    vector<uint32_t> instanceEntries; //Blas cache entry of every instance, in instance order
+
+    void createWorld();
+
+    //Packs the resident chunks in to the world buffers, submits their blases and the tlas over them to the build queue and points the descriptors at the new buffers
+    void uploadWorld();
+    void finishWorldBuild();
+    void destroyWorld();
+    void writeWorldDescriptors();
 
     //Images shit
     VkImage frame;
@@ -96,6 +201,10 @@ class RayTracer {
     VkImageView frameView;
     VkExtent2D imgExtent;
 
+    //One host visible copy of the frame per slot when there is no swapchain to copy it to
+    vector<Buffer> readbacks;
+    void createReadbacks();
+
     uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties);
     void setImgLayout(CommandBuffer commandBuffer, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, VkImageSubresourceRange subResourcesRange, VkPipelineStageFlags srcFlags = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VkPipelineStageFlags dstFlags = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
 
@@ -116,20 +225,25 @@ class RayTracer {
     //The storage image which the pipeline will write too
     void createImage(VkSurfaceFormatKHR format, VkExtent2D extent);
 
-    //Creaete the camera buffers for the descriptor
+    //Camera constants, a ring of one slice per frame slot in persistently mapped memory. Slices are uboStride apart to keep to minUniformBufferOffsetAlignment,
+    //the frame in a slot binds its slice as the dynamic offset of binding 2
     Buffer ubo;
+    VkDeviceSize uboStride;
     void createUBOBuffer();
+    uint32_t cameraOffset(uint32_t frameSlot) const { return (uint32_t)(frameSlot * uboStride); }
 
     //Creation of descriptor sets
     void createDescritorSets();
-    void updateDescriptorSets(float deltaTime);
+
+    //Moves the camera and writes it to the slot's slice, the slot's last frame is done with it
+    void updateCamera(float deltaTime, uint32_t frameSlot);
 
     //Pipeline and binidng table. Binding table is used for fast look up of shaders
     void createRayTracingPipeline();
     void createShaderBindingTable();
 
     //Rendering code
-    void recordCommandBuffer(CommandBuffer commandBuffer, VkImage swapchainImage);
+    void recordCommandBuffer(CommandBuffer commandBuffer, VkImage swapchainImage, uint32_t frameSlot);
 
     //FINISHHHHHH 
     void destroyAccelerationStructure(AccelerationStructure acccelerationStructure);
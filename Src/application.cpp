@@ -1,31 +1,51 @@
 #include "application.h"
-#include <GLFW/glfw3.h>
 
+#include <chrono>
+#include <cmath>
 #include <cstdint>
+#include <iomanip>
 #include <map>
+#include <sstream>
 #include <stdexcept>
 #include <utility>
 #include <vulkan/vulkan_core.h>
 
 void Application::run() {
+#ifdef HEADLESS_ONLY
+	if(!headless()) throw runtime_error("This build has no window, pass --headless n");
+#endif
 
-    init_window();
+	//Headless glfw is never initialised, so it runs without a display server
+	if(!headless()) init_window();
 
 	//All functions here will initialize vulkan
 	create_instance();
-	createSurface();
+	if(!headless()) createSurface();
 	setupDebugMessenger();
 	pickPhysicalDevices();
 	createLogicalDevice();
 
-	createSwapchain();
-	createImageViews();
+	VkSurfaceFormatKHR frameFormat = headlessFormat;
+	VkExtent2D frameExtent = headlessExtent;
+
+	if(!headless()) {
+		createSwapchain();
+		createImageViews();
+		createRenderSemaphores();
+
+		frameFormat = swapchainFormat;
+		frameExtent = swapchainExtent;
+	}
 
 	createCommandPools();
 
-	raytracer.createRayTracer(device, physicalDevice, graphicsQueue, graphicsPool, transferQueue, transferPool, swapchainFormat, swapchainExtent, window);
+	raytracer.setHostBlasBuilds(hostBlasBuilds);
+	raytracer.setFramesInFlight(framesInFlight);
+	raytracer.createRayTracer(device, physicalDevice, graphicsQueue, graphicsPool, transferQueue, transferPool, computeQueue, computePool, frameFormat, frameExtent, window);
 
-    main_loop();
+	if(blasBenchmark) raytracer.benchmarkBlasBuilds();
+	else if(headless()) renderHeadless();
+	else main_loop();
 
 	raytracer.cleanup();
 
@@ -33,6 +53,7 @@ void Application::run() {
 }
 
 void Application::init_window() {
+#ifndef HEADLESS_ONLY
     glfwInit();
 
 	glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
@@ -46,6 +67,7 @@ void Application::init_window() {
 	glfwSetCursorPosCallback(window, mousePosCallBack);
 
 	glfwSwapBuffers(window);
+#endif
 }
 
 bool Application::checkValidationLayerSupport() {
@@ -73,11 +95,18 @@ bool Application::checkValidationLayerSupport() {
 }
 
 vector<const char*> Application::getRequiredExtensions() {
-	uint32_t glfwExtensionCount = 0;
-	const char** glfwExtensions;
-	glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+	vector<const char*> extensions;
 
-	vector<const char*> extensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
+	//The surface extensions only matter with a window, and asking glfw for them needs it initialised
+#ifndef HEADLESS_ONLY
+	if(!headless()) {
+		uint32_t glfwExtensionCount = 0;
+		const char** glfwExtensions;
+		glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+
+		extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+	}
+#endif
 
 	if (enableValidationLayers) extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
 
@@ -98,11 +127,6 @@ void Application::create_instance() {
 	app_info.pEngineName = "No Engine";
 	app_info.apiVersion = VK_API_VERSION_1_2;
 
-	//get the extensions
-	uint32_t glfwExtensionCount = 0;
-	const char** glfw_extensions;
-	glfw_extensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-
 	VkInstanceCreateInfo create_info{};
 	create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
 	create_info.pApplicationInfo = &app_info;
@@ -159,13 +183,21 @@ QueueFamily Application::findQueueFamilies(VkPhysicalDevice dev) {
 
 		if(properties.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
 			queueFamily.graphicsFamily = i;
+			queueFamily.computeFamily = i;
+			queueFamily.computeQueueIndex = properties.queueCount > 1 ? 1 : 0;
 		}
 
-		VkBool32 presetationQueuePresent = false;
-		vkGetPhysicalDeviceSurfaceSupportKHR(dev, i, surface, &presetationQueuePresent);
+		//Headless nothing is presented, the graphics family stands in so the queue setup needs no case of its own
+		if(surface == VK_NULL_HANDLE) {
+			queueFamily.presentationFamily = queueFamily.graphicsFamily;
+		}
+		else {
+			VkBool32 presetationQueuePresent = false;
+			vkGetPhysicalDeviceSurfaceSupportKHR(dev, i, surface, &presetationQueuePresent);
 
-		if(presetationQueuePresent) {
-			queueFamily.presentationFamily = i;
+			if(presetationQueuePresent) {
+				queueFamily.presentationFamily = i;
+			}
 		}
 
 		if(properties.queueFlags & VK_QUEUE_TRANSFER_BIT && !(properties.queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
@@ -178,6 +210,9 @@ QueueFamily Application::findQueueFamilies(VkPhysicalDevice dev) {
 
 	}
 
+	//Devices with one family for everything, software ones like lavapipe among them, upload on the graphics queue
+	if(!queueFamily.transferFamily.has_value()) queueFamily.transferFamily = queueFamily.graphicsFamily;
+
 	return queueFamily;
 }
 
@@ -205,6 +240,16 @@ SwapChainSupportDetails Application::querySwapChainSupport(VkPhysicalDevice dev)
 	return details;
 }
 
+//Without a surface there is no swapchain, so the device is created without the extension
+vector<const char*> Application::requiredDeviceExtensions() {
+	vector<const char*> extensions;
+	for(const char* extension : deviceExtensions) {
+		if(headless() && strcmp(extension, VK_KHR_SWAPCHAIN_EXTENSION_NAME) == 0) continue;
+		extensions.push_back(extension);
+	}
+	return extensions;
+}
+
 bool Application::checkDeviceExtensionsSupport(VkPhysicalDevice dev) {
 	uint32_t extensionCount;
 	vkEnumerateDeviceExtensionProperties(dev, nullptr, &extensionCount, nullptr);
@@ -212,7 +257,8 @@ bool Application::checkDeviceExtensionsSupport(VkPhysicalDevice dev) {
 	vector<VkExtensionProperties> extensions(extensionCount);
 	vkEnumerateDeviceExtensionProperties(dev, nullptr,&extensionCount, extensions.data());
 
-	set<string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+	vector<const char*> required = requiredDeviceExtensions();
+	set<string> requiredExtensions(required.begin(), required.end());
 
 	for(const auto& extension: extensions) {
 		requiredExtensions.erase(extension.extensionName);
@@ -231,11 +277,14 @@ int Application::rateSuitability(VkPhysicalDevice dev) {
 	if(!checkDeviceExtensionsSupport(dev)) return 0;
 	
 
-	SwapChainSupportDetails details = querySwapChainSupport(dev);
+	if(!headless()) {
+		SwapChainSupportDetails details = querySwapChainSupport(dev);
 
-	if(details.presetMode.empty() || details.formats.empty()) return 0;
+		if(details.presetMode.empty() || details.formats.empty()) return 0;
+	}
 
-	int score = 0;
+	//Any device that gets this far can run it, a discrete one is preferred
+	int score = 1;
 
 	if(deviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) score += 100;
 
@@ -270,19 +319,34 @@ void Application::createLogicalDevice() {
 	set<uint32_t> uniqueQueueFamilies = { indices.graphicsFamily.value(), indices.presentationFamily.value(), indices.transferFamily.value() };
 	float queuePriority = 1.0f;
 
+	//Builds run below rendering when they get a queue of their own
+	float graphicsPriorities[] = {1.0f, 0.5f};
+
 	for (uint32_t queueFamily : uniqueQueueFamilies) {
 		VkDeviceQueueCreateInfo queueCreateInfo{};
 		queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
 		queueCreateInfo.queueFamilyIndex = queueFamily;
 		queueCreateInfo.queueCount = 1;
 		queueCreateInfo.pQueuePriorities = &queuePriority;
+
+		if(queueFamily == indices.graphicsFamily.value()) {
+			queueCreateInfo.queueCount = indices.computeQueueIndex + 1;
+			queueCreateInfo.pQueuePriorities = graphicsPriorities;
+		}
+
 		queueCreateInfos.push_back(queueCreateInfo);	
 	}
 
+	//Timeline semaphores, the frame waits on acceleration structure builds through one
+	VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures{};
+	timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+	timelineFeatures.timelineSemaphore = VK_TRUE;
+
 	// Buffer Device Address feature
 	VkPhysicalDeviceBufferDeviceAddressFeatures bufferDeviceAddressFeatures{};
 	bufferDeviceAddressFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
 	bufferDeviceAddressFeatures.bufferDeviceAddress = VK_TRUE;
+	bufferDeviceAddressFeatures.pNext = &timelineFeatures;
 
 	// Acceleration Structure feature
 	VkPhysicalDeviceAccelerationStructureFeaturesKHR accelStructFeatures{};
@@ -290,6 +354,17 @@ void Application::createLogicalDevice() {
 	accelStructFeatures.accelerationStructure = VK_TRUE;
 	accelStructFeatures.pNext = &bufferDeviceAddressFeatures;
 
+	//Host builds are optional, only turned on when the device has them
+	VkPhysicalDeviceAccelerationStructureFeaturesKHR supportedAccelStructFeatures{};
+	supportedAccelStructFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
+
+	VkPhysicalDeviceFeatures2 supportedFeatures{};
+	supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+	supportedFeatures.pNext = &supportedAccelStructFeatures;
+	vkGetPhysicalDeviceFeatures2(physicalDevice, &supportedFeatures);
+
+	accelStructFeatures.accelerationStructureHostCommands = supportedAccelStructFeatures.accelerationStructureHostCommands;
+
 	// Ray Tracing Pipeline feature
 	VkPhysicalDeviceRayTracingPipelineFeaturesKHR rayTracingPipelineFeatures{};
 	rayTracingPipelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR;
@@ -307,8 +382,9 @@ void Application::createLogicalDevice() {
 	createInfo.pQueueCreateInfos = queueCreateInfos.data();
 	createInfo.pEnabledFeatures = VK_NULL_HANDLE;
 
-	createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-	createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+	vector<const char*> extensions = requiredDeviceExtensions();
+	createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+	createInfo.ppEnabledExtensionNames = extensions.data();
 	createInfo.pNext = &deviceFeatures2;
 
 	if (enableValidationLayers) {
@@ -326,12 +402,15 @@ void Application::createLogicalDevice() {
 	vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
 	vkGetDeviceQueue( device, indices.presentationFamily.value(),0, &presentationQueue);
 	vkGetDeviceQueue(device, indices.transferFamily.value(), 0,&transferQueue);
+	vkGetDeviceQueue(device, indices.computeFamily.value(), indices.computeQueueIndex, &computeQueue);
 }
 
 void Application::createSurface() {
+#ifndef HEADLESS_ONLY
 	if(glfwCreateWindowSurface(instance,window, nullptr, &surface) != VK_SUCCESS) {
 		throw runtime_error("Failed to create surface");
 	}
+#endif
 }
 
 VkSurfaceFormatKHR Application::chooseSurfaceFormat(const vector<VkSurfaceFormatKHR>& formats) {
@@ -354,8 +433,10 @@ VkExtent2D Application::chooseSwapChainExtent(VkSurfaceCapabilitiesKHR capabilit
 
 	if(capabilities.currentExtent.width != numeric_limits<uint32_t>::max()) return capabilities.currentExtent;
 
-	int width, height;
+	int width = 0, height = 0;
+#ifndef HEADLESS_ONLY
 	glfwGetFramebufferSize(window, &width, &height);
+#endif
 
 	VkExtent2D extent = { static_cast<uint32_t>(width), static_cast<uint32_t>(height)};
 
@@ -428,6 +509,7 @@ void Application::recreateSwapchain() {
 
     createSwapchain();
     createImageViews();
+    createRenderSemaphores();
 }
 
 void Application::createImageViews() {
@@ -476,94 +558,397 @@ void Application::createCommandPools() {
 	if(vkCreateCommandPool(device, &transferPoolInfo, nullptr, &transferPool) != VK_SUCCESS) {
 		throw runtime_error("Failed to create transfer pool");
 	}
+
+	VkCommandPoolCreateInfo computePoolInfo{};
+	computePoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	computePoolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	computePoolInfo.queueFamilyIndex = familes.computeFamily.value();
+
+	if(vkCreateCommandPool(device, &computePoolInfo, nullptr, &computePool) != VK_SUCCESS) {
+		throw runtime_error("Failed to create compute pool");
+	}
 }
 
-////////////////////////////////////////// IMPROVE SRNCRONIZATION THIS SHIT IS ASSS IMPROVE THIS PLEASEE REMBER TO IMPROVE THIS HAHAHAHAHHAHAHAHAHAHH H HH FU FENUFNFE JFE FUCKKKKKKKKKKKKKKKKKKKKKKKKKKKK ///////////////////////////////////////////////////
-void Application::main_loop() {
+void Application::createFrameSlots() {
 	VkFenceCreateInfo fenceCreateInfo{};
 	fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
 	fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
-	VkFence inFlightFence;
-	VK_CHECK(vkCreateFence(device, &fenceCreateInfo, nullptr, &inFlightFence), "failed to create fence");
+	VkSemaphoreCreateInfo semCreateInfo{};
+	semCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+	frameSlots.resize(framesInFlight);
+
+	for(FrameSlot& slot : frameSlots) {
+		VK_CHECK(vkCreateFence(device, &fenceCreateInfo, nullptr, &slot.inFlight), "failed to create fence");
+		VK_CHECK(vkCreateSemaphore(device, &semCreateInfo, nullptr, &slot.imageAvailable), "Failed to create semaphore");
+		slot.commandBuffer.createCommandBuffer(device, graphicsPool);
+	}
+}
+
+void Application::destroyFrameSlots() {
+	for(FrameSlot& slot : frameSlots) {
+		slot.commandBuffer.freeCommandBuffer(device, graphicsPool);
+		vkDestroyFence(device, slot.inFlight, nullptr);
+		vkDestroySemaphore(device, slot.imageAvailable, nullptr);
+	}
 
+	frameSlots.clear();
+}
+
+void Application::createRenderSemaphores() {
 	VkSemaphoreCreateInfo semCreateInfo{};
 	semCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-	VkSemaphore imageSemaphore, renderSemaphore;
-	VK_CHECK(vkCreateSemaphore(device, &semCreateInfo, nullptr, &imageSemaphore), "Failed to create semaphore");
-	VK_CHECK(vkCreateSemaphore(device, &semCreateInfo, nullptr, &renderSemaphore), "Failed to create semaphore");
+	renderSemaphores.resize(swapchainImages.size());
+	for(VkSemaphore& semaphore : renderSemaphores) {
+		VK_CHECK(vkCreateSemaphore(device, &semCreateInfo, nullptr, &semaphore), "Failed to create semaphore");
+	}
+}
 
-	CommandBuffer commandBuffer;
-	commandBuffer.createCommandBuffer(device, graphicsPool);
+void Application::main_loop() {
+#ifndef HEADLESS_ONLY
+	createFrameSlots();
 
 	float lastFrame = 0;
+	uint32_t slotIndex = 0;
+
+	using Clock = chrono::steady_clock;
+	auto ms = [](Clock::time_point a, Clock::time_point b) { return chrono::duration<double, milli>(b - a).count(); };
 
-	VkResult resize;
+	FrameStats stats;
+	Clock::time_point statsStart = Clock::now();
+	Clock::time_point lastFrameStart = statsStart;
+	Clock::time_point lastSummary = statsStart;
+	bool exportKeyDown = false;
+
+	VkResult result;
 
 	while(!glfwWindowShouldClose(window)){
+		PROFILE_SCOPE("frame");
+		Clock::time_point frameStart = Clock::now();
+
 		float deltaTime = glfwGetTime() - lastFrame;
 		lastFrame = glfwGetTime();
-		
-		vkWaitForFences(device, 1, &inFlightFence, VK_TRUE, UINT64_MAX);
-		vkResetFences(device, 1, &inFlightFence);
 
-		vkResetCommandBuffer( commandBuffer.handle, 0);
+		FrameSlot& slot = frameSlots[slotIndex];
+
+		//Only the frame last recorded in to this slot has to be done, the ones in the other slots stay in flight
+		{
+			PROFILE_SCOPE("wait for frame slot");
+			vkWaitForFences(device, 1, &slot.inFlight, VK_TRUE, UINT64_MAX);
+		}
+		Clock::time_point fenceDone = Clock::now();
 
 		uint32_t imageIndex;
-    	resize = vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, imageSemaphore, VK_NULL_HANDLE, &imageIndex);
+		{
+			PROFILE_SCOPE("acquire image");
+			result = vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, slot.imageAvailable, VK_NULL_HANDLE, &imageIndex);
+		}
+		Clock::time_point acquired = Clock::now();
 
-		if(resize == VK_ERROR_OUT_OF_DATE_KHR || resize == VK_SUBOPTIMAL_KHR) {
+		//Nothing was acquired, so the semaphore is not signalled and the fence is left as it was for the next try. A suboptimal image is still
+		//acquired and goes ahead, the swapchain is recreated after its present
+		if(result == VK_ERROR_OUT_OF_DATE_KHR) {
 			recreateSwapchain();
+			continue;
+		}
+
+		vkResetFences(device, 1, &slot.inFlight);
+		vkResetCommandBuffer(slot.commandBuffer.handle, 0);
+
+		if(animate) animateInstances(lastFrame);
+
+		{
+			PROFILE_SCOPE("draw frame");
+			raytracer.drawFrame(slot.commandBuffer, swapchainImages[imageIndex], deltaTime, slotIndex);
+		}
+		Clock::time_point recorded = Clock::now();
+
+		{
+			PROFILE_SCOPE("submit and present");
+
+			//Besides the swapchain image, the frame waits for the acceleration structures it traces on the build timeline. The value of the binary semaphore is ignored
+			VkSemaphore waitSemaphores[] = {slot.imageAvailable, raytracer.buildSemaphore()};
+			uint64_t waitValues[] = {0, raytracer.buildWaitValue()};
+			VkPipelineStageFlags stageFlags[] = {VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR};
+
+			//And signals the frame timeline, which the raytracer waits on before it changes what the frames in flight read
+			VkSemaphore signalSemaphores[] = {renderSemaphores[imageIndex], raytracer.frameSemaphore()};
+			uint64_t signalValues[] = {0, raytracer.frameSignalValue()};
+
+			VkTimelineSemaphoreSubmitInfo timelineInfo{};
+			timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+			timelineInfo.waitSemaphoreValueCount = 2;
+			timelineInfo.pWaitSemaphoreValues = waitValues;
+			timelineInfo.signalSemaphoreValueCount = 2;
+			timelineInfo.pSignalSemaphoreValues = signalValues;
+
+			VkSubmitInfo submitInfo{};
+			submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+			submitInfo.pNext = &timelineInfo;
+			submitInfo.signalSemaphoreCount = 2;
+			submitInfo.pSignalSemaphores = signalSemaphores;
+			submitInfo.waitSemaphoreCount = 2;
+			submitInfo.pWaitSemaphores = waitSemaphores;
+			submitInfo.commandBufferCount = 1;
+			submitInfo.pCommandBuffers = &slot.commandBuffer.handle;
+			submitInfo.pWaitDstStageMask = stageFlags;
+
+			VK_CHECK(vkQueueSubmit(graphicsQueue, 1, &submitInfo, slot.inFlight), "Failed to submit to queue");
+
+			VkPresentInfoKHR presentInfo{};
+			presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+
+			presentInfo.swapchainCount = 1;
+			presentInfo.pSwapchains = &swapchain;
+			presentInfo.pImageIndices = &imageIndex;
+			presentInfo.pResults = nullptr;
+
+			presentInfo.waitSemaphoreCount = 1;
+			presentInfo.pWaitSemaphores = &renderSemaphores[imageIndex];
+
+			result = vkQueuePresentKHR(presentationQueue, &presentInfo);
+		}
+		Clock::time_point presented = Clock::now();
+
+		if(result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) recreateSwapchain();
+
+		slotIndex = (slotIndex + 1) % framesInFlight;
+
+		//Reports come every couple of seconds, a line per frame would be a synchronous write to stdout in the loop being measured
+		if(frameStats) {
+			double frameMs = ms(lastFrameStart, frameStart);
+			stats.frames++;
+			stats.frameMs += frameMs;
+			stats.worstFrameMs = max(stats.worstFrameMs, frameMs);
+			stats.fenceWaitMs += ms(frameStart, fenceDone);
+			stats.acquireMs += ms(fenceDone, acquired);
+			stats.recordMs += ms(acquired, recorded);
+			stats.presentMs += ms(recorded, presented);
+
+			double seconds = ms(statsStart, frameStart) / 1000.0;
+			if(seconds >= 2.0) {
+				printFrameStats(stats, seconds);
+				stats = FrameStats{};
+				statsStart = frameStart;
+			}
+		}
+
+		if(ms(lastSummary, frameStart) >= 2000.0) {
+			printProfileSummary();
+			lastSummary = frameStart;
 		}
 
-		raytracer.drawFrame(commandBuffer, swapchainImages[imageIndex], deltaTime);
+		//F9 exports what the profiler has of the last few thousand frames
+		bool exportKey = glfwGetKey(window, GLFW_KEY_F9) == GLFW_PRESS;
+		if(exportKey && !exportKeyDown) writeProfile(tracePath.empty() ? "trace.json" : tracePath);
+		exportKeyDown = exportKey;
 
-		VkPipelineStageFlags stageFlags[] = {VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR};
+		lastFrameStart = frameStart;
 
-		VkSubmitInfo submitInfo{};
-		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-		submitInfo.signalSemaphoreCount = 1;
-		submitInfo.pSignalSemaphores = &renderSemaphore;
-		submitInfo.waitSemaphoreCount = 1;
-		submitInfo.pWaitSemaphores = &imageSemaphore;
-		submitInfo.commandBufferCount = 1;
-		submitInfo.pCommandBuffers = &commandBuffer.handle;
-		submitInfo.pWaitDstStageMask = stageFlags;
+		glfwSwapBuffers(window);
+		glfwPollEvents();
+	}
 
-		VK_CHECK(vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFence), "Failed to submit to queue");
+	vkDeviceWaitIdle(device);
 
-		VkPresentInfoKHR presentInfo{};
-		presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+	destroyFrameSlots();
 
-		presentInfo.swapchainCount = 1;
-		presentInfo.pSwapchains = &swapchain;
-		presentInfo.pImageIndices = &imageIndex;
-		presentInfo.pResults = nullptr;
+	if(animate) printTlasStats();
+	if(!tracePath.empty()) writeProfile(tracePath);
+#endif
+}
 
-		presentInfo.waitSemaphoreCount = 1;
-		presentInfo.pWaitSemaphores = &renderSemaphore;
+void Application::renderHeadless() {
+	createFrameSlots();
 
-		resize = vkQueuePresentKHR(presentationQueue, &presentInfo);
+	FrameWriter writer;
+	if(!headlessOutput.empty()) writer.start();
 
-		resize = vkQueueWaitIdle(presentationQueue);
+	//Number of the frame last drawn in each slot, -1 once it has been handed to the writer
+	vector<int64_t> slotFrames(framesInFlight, -1);
 
-		if(resize == VK_ERROR_OUT_OF_DATE_KHR) recreateSwapchain();
+	auto readBack = [&](uint32_t slotIndex) {
+		if(slotFrames[slotIndex] < 0) return;
 
-		cout << "FPS : " << (1 / deltaTime) << endl;
+		if(!headlessOutput.empty()) {
+			PROFILE_SCOPE("read back frame");
 
+			ostringstream path;
+			path << headlessOutput << "_" << setw(4) << setfill('0') << slotFrames[slotIndex] << ".ppm";
 
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+			VkExtent2D extent = raytracer.frameExtent();
+			writer.write(path.str(), extent.width, extent.height, raytracer.readback(slotIndex));
+		}
+
+		slotFrames[slotIndex] = -1;
+	};
+
+	//A fixed step, nothing moves the camera so runs render the same frames and compare with each other
+	const float deltaTime = 1.0f / 60.0f;
+
+	using Clock = chrono::steady_clock;
+	auto ms = [](Clock::time_point a, Clock::time_point b) { return chrono::duration<double, milli>(b - a).count(); };
+
+	FrameStats stats;
+	Clock::time_point start = Clock::now();
+	Clock::time_point lastFrameStart = start;
+
+	for(uint32_t frame = 0; frame < headlessFrames; frame++) {
+		PROFILE_SCOPE("frame");
+		Clock::time_point frameStart = Clock::now();
+
+		uint32_t slotIndex = frame % framesInFlight;
+		FrameSlot& slot = frameSlots[slotIndex];
+
+		{
+			PROFILE_SCOPE("wait for frame slot");
+			vkWaitForFences(device, 1, &slot.inFlight, VK_TRUE, UINT64_MAX);
+		}
+		Clock::time_point fenceDone = Clock::now();
+
+		//The slot's last frame is done, its readback is copied out before this frame's copy goes to the same buffer
+		readBack(slotIndex);
+
+		vkResetFences(device, 1, &slot.inFlight);
+		vkResetCommandBuffer(slot.commandBuffer.handle, 0);
+
+		if(animate) animateInstances((float)frame * deltaTime);
+
+		{
+			PROFILE_SCOPE("draw frame");
+			raytracer.drawFrame(slot.commandBuffer, VK_NULL_HANDLE, deltaTime, slotIndex);
+		}
+		slotFrames[slotIndex] = frame;
+		Clock::time_point recorded = Clock::now();
+
+		{
+			PROFILE_SCOPE("submit");
+
+			//Same as a windowed frame less the swapchain image, it waits on the builds and signals the frame timeline
+			VkSemaphore waitSemaphore = raytracer.buildSemaphore();
+			uint64_t waitValue = raytracer.buildWaitValue();
+			VkPipelineStageFlags stageFlags = VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
+
+			VkSemaphore signalSemaphore = raytracer.frameSemaphore();
+			uint64_t signalValue = raytracer.frameSignalValue();
+
+			VkTimelineSemaphoreSubmitInfo timelineInfo{};
+			timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+			timelineInfo.waitSemaphoreValueCount = 1;
+			timelineInfo.pWaitSemaphoreValues = &waitValue;
+			timelineInfo.signalSemaphoreValueCount = 1;
+			timelineInfo.pSignalSemaphoreValues = &signalValue;
+
+			VkSubmitInfo submitInfo{};
+			submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+			submitInfo.pNext = &timelineInfo;
+			submitInfo.signalSemaphoreCount = 1;
+			submitInfo.pSignalSemaphores = &signalSemaphore;
+			submitInfo.waitSemaphoreCount = 1;
+			submitInfo.pWaitSemaphores = &waitSemaphore;
+			submitInfo.commandBufferCount = 1;
+			submitInfo.pCommandBuffers = &slot.commandBuffer.handle;
+			submitInfo.pWaitDstStageMask = &stageFlags;
+
+			VK_CHECK(vkQueueSubmit(graphicsQueue, 1, &submitInfo, slot.inFlight), "Failed to submit to queue");
+		}
+		Clock::time_point submitted = Clock::now();
+
+		//Frame times run from one frame's start to the next, so the first frame is left out of the averages
+		if(frame > 0) {
+			double frameMs = ms(lastFrameStart, frameStart);
+			stats.frames++;
+			stats.frameMs += frameMs;
+			stats.worstFrameMs = max(stats.worstFrameMs, frameMs);
+			stats.fenceWaitMs += ms(frameStart, fenceDone);
+			stats.recordMs += ms(fenceDone, recorded);
+			stats.presentMs += ms(recorded, submitted);
+		}
+
+		lastFrameStart = frameStart;
+	}
+
+	//The last frames are still in their slots, oldest first
+	for(uint32_t i = 0; i < framesInFlight; i++) {
+		uint32_t slotIndex = (headlessFrames + i) % framesInFlight;
+		vkWaitForFences(device, 1, &frameSlots[slotIndex].inFlight, VK_TRUE, UINT64_MAX);
+		readBack(slotIndex);
 	}
+	Clock::time_point rendered = Clock::now();
 
 	vkDeviceWaitIdle(device);
+	destroyFrameSlots();
 
-	commandBuffer.freeCommandBuffer(device, graphicsPool);
+	writer.finish();
+	Clock::time_point written = Clock::now();
 
-	vkDestroyFence(device, inFlightFence, nullptr);
-	vkDestroySemaphore(device, imageSemaphore, nullptr);
-	vkDestroySemaphore(device, renderSemaphore, nullptr);
+	double seconds = ms(start, rendered) / 1000.0;
+	VkExtent2D extent = raytracer.frameExtent();
+
+	cout << "Headless " << headlessFrames << " frames at " << extent.width << "x" << extent.height << " in " << seconds << " s, " << (double)headlessFrames / seconds << " frames a second" << endl;
+	printFrameStats(stats, seconds);
+	printProfileSummary();
+	if(animate) printTlasStats();
+
+	if(!headlessOutput.empty()) {
+		const FrameWriterStats& writerStats = writer.getStats();
+		cout << "Wrote " << writerStats.frames << " frames, " << (double)writerStats.bytes / (1024.0 * 1024.0) << " MB, the last " << ms(rendered, written)
+		     << " ms after rendering finished. Rendering waited on the disk " << writerStats.stalls << " times" << endl;
+	}
+
+	//Every zone's percentiles, which writeProfile prints as well
+	if(!tracePath.empty()) writeProfile(tracePath);
+	else Profiler::writeSummary(cout, Profiler::events.snapshot());
+}
+
+void Application::animateInstances(float time) {
+	//Out of phase with each other and a couple of voxels at most, well inside the tlas rebuild distance, so frames refit and only maxRefits rebuilds
+	for(uint32_t instance = 0; instance < raytracer.instanceCount(); instance++) {
+		VkTransformMatrixKHR transform = raytracer.uploadedTransform(instance);
+		transform.matrix[1][3] += 2.0f * sinf(time * 2.0f + (float)instance * 0.7f);
+		raytracer.setInstanceTransform(instance, transform);
+	}
+}
+
+void Application::printTlasStats() {
+	const DynamicTlas& tlas = raytracer.topLevel();
+	cout << "TLAS over " << tlas.instanceCount << " instances : " << tlas.refitCount << " refits, " << tlas.buildCount << " builds" << endl;
+}
+
+void Application::printProfileSummary() {
+	vector<ProfileEvent> snapshot = Profiler::events.snapshot();
+
+	Percentiles frame = Profiler::summary(snapshot, "frame");
+	Percentiles trace = Profiler::summary(snapshot, "trace rays", Profiler::GRAPHICS_TRACK);
+
+	cout << "Frame time p50 " << frame.p50 << " ms, p95 " << frame.p95 << " ms, p99 " << frame.p99 << " ms over " << frame.count << " frames, trace rays p50 " << trace.p50
+	     << " ms, p99 " << trace.p99 << " ms" << endl;
+}
+
+void Application::writeProfile(const string& path) {
+	vector<ProfileEvent> snapshot = Profiler::events.snapshot();
+
+	ofstream file(path);
+	if(!file) {
+		cerr << "Failed to open " << path << " for the profile" << endl;
+		return;
+	}
+
+	Profiler::writeChromeTrace(file, snapshot);
+
+	cout << "Profile of " << snapshot.size() << " events written to " << path << endl;
+	Profiler::writeSummary(cout, snapshot);
+}
+
+void Application::printFrameStats(const FrameStats& stats, double seconds) {
+	if(stats.frames == 0) return;
+
+	double n = (double)stats.frames;
+	cout << "Frames in flight " << framesInFlight << " : " << stats.frames << " frames in " << seconds << " s, " << stats.frameMs / n << " ms a frame (worst " << stats.worstFrameMs
+	     << " ms), cpu waiting on fences " << stats.fenceWaitMs / n << " ms, on acquire " << stats.acquireMs / n << " ms, recording " << stats.recordMs / n
+	     << " ms, submit and present " << stats.presentMs / n << " ms, cpu/gpu overlap " << stats.overlap() * 100.0 << "%" << endl;
 }
 
 void Application::cleanupSwapchain() {
@@ -571,6 +956,9 @@ void Application::cleanupSwapchain() {
 		vkDestroyImageView(device, imageView, nullptr);
 	}
 
+	for(VkSemaphore semaphore : renderSemaphores) vkDestroySemaphore(device, semaphore, nullptr);
+	renderSemaphores.clear();
+
 	vkDestroySwapchainKHR(device, swapchain, nullptr);
 }
 
@@ -578,11 +966,14 @@ void Application::cleanup() {
 
 	vkDestroyCommandPool(device, graphicsPool, nullptr);
 	vkDestroyCommandPool(device, transferPool, nullptr);
+	vkDestroyCommandPool(device, computePool, nullptr);
 
-	cleanupSwapchain();
+	if(!headless()) cleanupSwapchain();
+
+	Buffer::allocator.destroy(device);
 
 	vkDestroyDevice(device, nullptr);
-	vkDestroySurfaceKHR(instance,surface, nullptr);
+	if(surface != VK_NULL_HANDLE) vkDestroySurfaceKHR(instance,surface, nullptr);
 
 	if(enableValidationLayers) {
 		auto func = (PFN_vkDestroyDebugUtilsMessengerEXT) vkGetInstanceProcAddr(instance, "vkDestroyDebugUtilsMessengerEXT");
@@ -593,6 +984,10 @@ void Application::cleanup() {
 
 	vkDestroyInstance(instance, nullptr);
 
+	if(window == nullptr) return;
+
+#ifndef HEADLESS_ONLY
 	glfwDestroyWindow(window);
 	glfwTerminate();
+#endif
 }
\ No newline at end of file
@@ -1,8 +1,8 @@
 #pragma once
 #include "RayTracing/raytracer.h"
+#include "frameWriter.h"
+#include "window.h"
 #include <vulkan/vulkan_core.h>
-#define GLFW_INCLUDE_VULKAN
-#include <GLFW/glfw3.h>
 #include <cstdint>
 #include <iostream>
 #include <stdexcept>
@@ -15,13 +15,14 @@
 #include <algorithm>
 #include <fstream>
 
-//REMEMBER TO HAVE A COMPUTE QUEUE AND OFF LOAD BUILDING ACCELERATION STRUCTURE TO THAT QUEUE
-
 using namespace std;
 
 const uint32_t width = 800;
 const uint32_t height = 600;
 
+//Format of the storage image when there is no swapchain to match, the one raygen.rgen declares it as
+const VkSurfaceFormatKHR headlessFormat = { VK_FORMAT_R16G16B16A16_SFLOAT, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR };
+
 const vector<const char*> validationLayers = { "VK_LAYER_KHRONOS_validation"};
 const vector<const char*> deviceExtensions = { "VK_KHR_swapchain",
     "VK_KHR_acceleration_structure",
@@ -37,7 +38,11 @@ struct QueueFamily {
     optional<uint32_t> graphicsFamily;
     optional<uint32_t> presentationFamily;
     optional<uint32_t> transferFamily;
-    //optional<uint32_t> computeFamily;
+
+    //Acceleration structure builds. A second queue of the graphics family when it has one, so builds overlap with rendering without ownership transfers
+    //between families. Otherwise the graphics queue itself, which still never waits on the cpu
+    optional<uint32_t> computeFamily;
+    uint32_t computeQueueIndex = 0;
 
     bool isComplete() {
         return graphicsFamily.has_value() && presentationFamily.has_value() && transferFamily.has_value();
@@ -50,9 +55,37 @@ struct SwapChainSupportDetails {
     vector<VkPresentModeKHR> presetMode;
 };
 
+//Where the cpu time of the frames went, summed over one report. Time spent waiting on a slot's fence or for a swapchain image is the cpu sitting
+//idle behind the gpu, the rest of a frame it was working while the gpu still had earlier frames to render
+struct FrameStats {
+    uint32_t frames = 0;
+    double frameMs = 0;
+    double worstFrameMs = 0;
+    double fenceWaitMs = 0;
+    double acquireMs = 0;
+    double recordMs = 0;
+    double presentMs = 0; //Submit and present
+
+    double overlap() const { return frameMs > 0 ? 1.0 - (fenceWaitMs + acquireMs) / frameMs : 0.0; }
+};
+
 class Application {
     public:
 
+    //Set from the command line before run, see main.cpp
+    bool hostBlasBuilds = false;
+    bool blasBenchmark = false;
+    uint32_t framesInFlight = 2;
+    bool frameStats = false;
+    string tracePath; //Chrome trace written here at exit, and by F9 which falls back to trace.json
+    bool animate = false; //Moves every chunk instance each frame, so the tlas is refit every frame
+
+    //More than 0 renders that many frames with no window, surface or swapchain and exits. Frames are read back and written to headlessOutput
+    //numbered, or only timed when it is empty
+    uint32_t headlessFrames = 0;
+    string headlessOutput;
+    VkExtent2D headlessExtent = { width, height };
+
     void run();
 
     void mouseInput(double xpos, double ypos) {
@@ -66,7 +99,7 @@ class Application {
 
     private:
 
-    GLFWwindow* window;
+    GLFWwindow* window = nullptr;
     VkInstance instance;
     VkDebugUtilsMessengerEXT debugMessenger;
     VkDevice device;
@@ -74,9 +107,10 @@ class Application {
     VkQueue graphicsQueue;
     VkQueue presentationQueue;
     VkQueue transferQueue;
+    VkQueue computeQueue;
 
     VkPhysicalDevice physicalDevice;
-    VkSurfaceKHR surface;
+    VkSurfaceKHR surface = VK_NULL_HANDLE;
     VkSurfaceFormatKHR swapchainFormat;
     VkPresentModeKHR swapchainPresentMode;
     VkExtent2D swapchainExtent;
@@ -84,14 +118,26 @@ class Application {
 
     VkCommandPool graphicsPool;
     VkCommandPool transferPool;
+    VkCommandPool computePool;
 
     RayTracer raytracer;
     
     vector<VkImage> swapchainImages;
     vector<VkImageView> swapchainImageViews;
 
-    
+    //Everything one frame in flight owns. A slot is only recorded again once its fence says the frame from framesInFlight frames ago is done
+    struct FrameSlot {
+        CommandBuffer commandBuffer;
+        VkFence inFlight;
+        VkSemaphore imageAvailable;
+    };
+    vector<FrameSlot> frameSlots;
+
+    //Signalled by the frame that renders to a swapchain image and waited on by its present. One per image rather than per slot, the present of an
+    //image can still be holding the semaphore after the fence of the slot that rendered it has signalled
+    vector<VkSemaphore> renderSemaphores;
 
+#ifndef HEADLESS_ONLY
     static void frameBufferResizeCallBack(GLFWwindow* window, int width, int height) {
         Application* app = reinterpret_cast<Application*>(glfwGetWindowUserPointer(window));
         app->rayTracerResize();
@@ -101,6 +147,7 @@ class Application {
         Application* app = reinterpret_cast<Application*>(glfwGetWindowUserPointer(window));
         app->mouseInput( xpos, ypos);
     }
+#endif
 
     //Sends the error msg to console
 	static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity, VkDebugUtilsMessageTypeFlagsEXT messageType, const VkDebugUtilsMessengerCallbackDataEXT* pCallbackData, void* pUserData) {
@@ -122,6 +169,7 @@ class Application {
 
     QueueFamily findQueueFamilies(VkPhysicalDevice device);
     SwapChainSupportDetails querySwapChainSupport(VkPhysicalDevice dev);
+    vector<const char*> requiredDeviceExtensions();
     bool checkDeviceExtensionsSupport(VkPhysicalDevice dev);
     int rateSuitability(VkPhysicalDevice dev);
     void pickPhysicalDevices();
@@ -142,12 +190,30 @@ class Application {
 
     void createCommandPools();
 
+    void createFrameSlots();
+    void destroyFrameSlots();
+    void createRenderSemaphores();
+
     //Creating the shaders shit
     VkShaderModule createShaderModule(const string& filePath);
     VkPipelineShaderStageCreateInfo createShaderStageCreateInfo(VkShaderModule shaderModule, VkShaderStageFlagBits flags);
 
+    bool headless() const { return headlessFrames > 0; }
+
     void main_loop();
 
+    //Bobs every instance around where the world upload placed it, time in seconds
+    void animateInstances(float time);
+    void printTlasStats();
+
+    //Draws headlessFrames frames in to readback buffers, the frame in a slot is handed to the frame writer once the slot comes round again
+    void renderHeadless();
+    void printFrameStats(const FrameStats& stats, double seconds);
+
+    //Rolling p50/p95/p99 of the frame time from the profiler, and the whole profile as a Chrome trace plus every zone's percentiles
+    void printProfileSummary();
+    void writeProfile(const string& path);
+
     void cleanupSwapchain();
     void cleanup();
 };
\ No newline at end of file
@@ -0,0 +1,1203 @@
+#include "DataStructures/grid.h"
+#include "DataStructures/svo.h"
+#include "DataStructures/brickmap.h"
+#include "DataStructures/morton.h"
+#include "DataStructures/distanceField.h"
+#include "DataStructures/occupancyPyramid.h"
+#include "DataStructures/chunkManager.h"
+#include "DataStructures/svdag.h"
+#include "DataStructures/voxelBoxes.h"
+#include "DataStructures/bvh.h"
+#include "DataStructures/tlsfAllocator.h"
+#include "DataStructures/profiler.h"
+#include "RayTracing/gridTraversal.h"
+#include "frameWriter.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+//CPU side benchmarks for the voxel data structures. Needs no gpu, run with make benchmark && ./benchmark
+
+using namespace std;
+
+//Rolling hills with a few floating blobs, mostly air like the worlds we actually want to render
+int terrainVoxel(int x, int y, int z, int size) {
+    float fx = (float)x / size;
+    float fz = (float)z / size;
+    float height = size * (0.3f + 0.1f * sinf(fx * 12.0f) * cosf(fz * 9.0f) + 0.05f * sinf((fx + fz) * 31.0f));
+
+    if(y < height) return 1 + (y * 4) / size;
+
+    int cx = x % 32 - 16, cy = y % 48 - 24, cz = z % 32 - 16;
+    if(y > size / 2 && cx * cx + cy * cy + cz * cz < 36) return 7;
+
+    return 0;
+}
+
+vector<int> makeTerrain(int size) {
+    vector<int> dense((size_t)size * size * size);
+    for(int x = 0; x < size; x++) {
+        for(int y = 0; y < size; y++) {
+            for(int z = 0; z < size; z++) dense[((size_t)x * size + y) * size + z] = terrainVoxel(x, y, z, size);
+        }
+    }
+    return dense;
+}
+
+struct RaySet {
+    vector<glm::vec3> origins;
+    vector<glm::vec3> directions;
+};
+
+RaySet makeRays(int count, float size, uint32_t seed) {
+    mt19937 rng(seed);
+    uniform_real_distribution<float> position(-0.25f * size, 1.25f * size);
+    uniform_real_distribution<float> target(0.0f, size);
+
+    RaySet rays;
+    for(int i = 0; i < count; i++) {
+        glm::vec3 origin(position(rng), position(rng), position(rng));
+        glm::vec3 towards(target(rng), target(rng), target(rng));
+        rays.origins.push_back(origin);
+        rays.directions.push_back(glm::normalize(towards - origin));
+    }
+
+    return rays;
+}
+
+template<typename F>
+double timeMilliseconds(F&& f) {
+    auto start = chrono::high_resolution_clock::now();
+    f();
+    auto end = chrono::high_resolution_clock::now();
+    return chrono::duration<double, milli>(end - start).count();
+}
+
+void printSVOStats(const string& name, int size, const SVOStats& stats) {
+    cout << name << " " << size << "^3 : build " << stats.buildMilliseconds << " ms, "
+         << stats.nodeCount << " nodes, " << stats.solidVoxels << " solid voxels, "
+         << stats.bytes << " bytes (" << stats.bytesPerSolidVoxel() << " B/solid voxel) vs dense "
+         << stats.denseBytes << " bytes (" << stats.denseBytesPerSolidVoxel() << " B/solid voxel)" << endl;
+}
+
+void benchmarkSVO() {
+    cout << "== Sparse voxel octree ==" << endl;
+
+    SceneGrid grid;
+    grid.create();
+
+    SparseVoxelOctree gridSvo;
+    gridSvo.build(grid);
+    printSVOStats("grid sphere", SceneGrid::size, gridSvo.stats);
+    grid.releaseVoxels();
+
+    for(int size : {64, 128, 256}) {
+        vector<int> dense = makeTerrain(size);
+
+        SparseVoxelOctree svo;
+        svo.build(size, [&](int x, int y, int z) { return dense[((size_t)x * size + y) * size + z]; });
+        printSVOStats("terrain", size, svo.stats);
+
+        RaySet rays = makeRays(100000, (float)size, 7);
+        AABB denseBox = {glm::vec3(0), glm::vec3((float)size)};
+        AABB svoBox = {glm::vec3(0), glm::vec3((float)svo.getResolution())};
+
+        vector<float> ddaHits(rays.origins.size());
+        vector<float> svoHits(rays.origins.size());
+
+        double ddaMs = timeMilliseconds([&]() {
+            for(size_t i = 0; i < rays.origins.size(); i++) ddaHits[i] = GridTraversal::gridIntersection(dense.data(), denseBox, size, rays.origins[i], rays.directions[i]);
+        });
+
+        double svoMs = timeMilliseconds([&]() {
+            for(size_t i = 0; i < rays.origins.size(); i++) svoHits[i] = svo.traverse(svoBox, rays.origins[i], rays.directions[i]);
+        });
+
+        int mismatches = 0;
+        for(size_t i = 0; i < rays.origins.size(); i++) {
+            if((ddaHits[i] > 0.0f) != (svoHits[i] > 0.0f) || fabsf(ddaHits[i] - svoHits[i]) > 1e-3f * max(1.0f, ddaHits[i])) mismatches++;
+        }
+
+        cout << "    " << rays.origins.size() << " rays : dense dda " << ddaMs << " ms, svo " << svoMs << " ms, " << mismatches << " mismatches" << endl;
+    }
+}
+
+void benchmarkBrickMap() {
+    cout << "== Brick map ==" << endl;
+
+    for(int size : {64, 128, 256}) {
+        vector<int> dense = makeTerrain(size);
+
+        BrickMap brickMap;
+        double buildMs = timeMilliseconds([&]() {
+            brickMap.build(size, [&](int x, int y, int z) { return dense[((size_t)x * size + y) * size + z]; });
+        });
+
+        uint32_t topCount = brickMap.bricksPerAxis * brickMap.bricksPerAxis * brickMap.bricksPerAxis;
+
+        cout << "terrain " << size << "^3 : build " << buildMs << " ms, " << brickMap.brickCount << "/" << topCount << " bricks resident, "
+             << brickMap.bytes() << " bytes vs dense " << dense.size() * sizeof(int) << " bytes" << endl;
+
+        //What the traversal touches vs the old 4 byte Voxel per cell
+        cout << "    occupancy " << brickMap.bytes() << " bytes + colours " << brickMap.colourBytes() << " bytes vs 4 byte voxels "
+             << dense.size() * 4 << " bytes, 1 byte voxels " << dense.size() * sizeof(Voxel) << " bytes" << endl;
+
+        RaySet rays = makeRays(100000, (float)size, 7);
+        AABB denseBox = {glm::vec3(0), glm::vec3((float)size)};
+
+        vector<float> ddaHits(rays.origins.size());
+        vector<float> brickHits(rays.origins.size());
+
+        double ddaMs = timeMilliseconds([&]() {
+            for(size_t i = 0; i < rays.origins.size(); i++) ddaHits[i] = GridTraversal::gridIntersection(dense.data(), denseBox, size, rays.origins[i], rays.directions[i]);
+        });
+
+        double brickMs = timeMilliseconds([&]() {
+            for(size_t i = 0; i < rays.origins.size(); i++) brickHits[i] = GridTraversal::brickMapIntersection(brickMap.data.data(), brickMap.bricksPerAxis, glm::vec3(0), 1.0f, rays.origins[i], rays.directions[i]);
+        });
+
+        int mismatches = 0;
+        for(size_t i = 0; i < rays.origins.size(); i++) {
+            if((ddaHits[i] > 0.0f) != (brickHits[i] > 0.0f) || fabsf(ddaHits[i] - brickHits[i]) > 1e-3f * max(1.0f, ddaHits[i])) mismatches++;
+        }
+
+        cout << "    " << rays.origins.size() << " rays : dense dda " << ddaMs << " ms, brick map " << brickMs << " ms, " << mismatches << " mismatches" << endl;
+    }
+}
+
+//Slow but obviously right, only used to check the separable passes on a small grid
+int bruteForceDistance(const vector<int>& dense, int size, int maxDistance, int x, int y, int z) {
+    int best = maxDistance;
+    for(int dx = -maxDistance + 1; dx < maxDistance; dx++) {
+        for(int dy = -maxDistance + 1; dy < maxDistance; dy++) {
+            for(int dz = -maxDistance + 1; dz < maxDistance; dz++) {
+                int sx = x + dx, sy = y + dy, sz = z + dz;
+                if(sx < 0 || sy < 0 || sz < 0 || sx >= size || sy >= size || sz >= size) continue;
+                if(dense[((size_t)sx * size + sy) * size + sz] != 0) best = min(best, max(abs(dx), max(abs(dy), abs(dz))));
+            }
+        }
+    }
+    return best;
+}
+
+void benchmarkDistanceField() {
+    cout << "== Distance field ==" << endl;
+
+    {
+        const int size = 32, maxDistance = 8;
+        vector<int> dense = makeTerrain(size);
+        DistanceField field;
+        field.build(size, maxDistance, [&](int x, int y, int z) { return dense[((size_t)x * size + y) * size + z] != 0; });
+
+        int failures = 0;
+        for(int x = 0; x < size; x++) {
+            for(int y = 0; y < size; y++) {
+                for(int z = 0; z < size; z++) if(field.get(x, y, z) != bruteForceDistance(dense, size, maxDistance, x, y, z)) failures++;
+            }
+        }
+        cout << "terrain " << size << "^3 against brute force : " << failures << " failures" << endl;
+    }
+
+    const int maxDistance = 16;
+
+    for(int size : {64, 128, 256}) {
+        vector<int> dense = makeTerrain(size);
+        auto solidAt = [&](int x, int y, int z) { return dense[((size_t)x * size + y) * size + z] != 0; };
+
+        DistanceField field;
+        double buildMs = timeMilliseconds([&]() { field.build(size, maxDistance, solidAt); });
+
+        //Carve a 4^3 hole and drop a block somewhere in the air, then check the incremental update against a full rebuild
+        glm::ivec3 lo(size / 3, (int)(size * 0.3f) - 2, size / 3);
+        glm::ivec3 hi = lo + 4;
+        for(int x = lo.x; x < hi.x; x++) for(int y = lo.y; y < hi.y; y++) for(int z = lo.z; z < hi.z; z++) dense[((size_t)x * size + y) * size + z] = 0;
+        glm::ivec3 blockLo(size / 2, size * 3 / 4, size / 2);
+        for(int x = blockLo.x; x < blockLo.x + 2; x++) for(int y = blockLo.y; y < blockLo.y + 2; y++) for(int z = blockLo.z; z < blockLo.z + 2; z++) dense[((size_t)x * size + y) * size + z] = 1;
+
+        double updateMs = timeMilliseconds([&]() {
+            field.update(lo, hi, solidAt);
+            field.update(blockLo, blockLo + 2, solidAt);
+        });
+
+        DistanceField rebuilt;
+        double rebuildMs = timeMilliseconds([&]() { rebuilt.build(size, maxDistance, solidAt); });
+
+        int updateFailures = 0;
+        for(size_t i = 0; i < field.distances.size(); i++) if(field.distances[i] != rebuilt.distances[i]) updateFailures++;
+
+        cout << "terrain " << size << "^3 : build " << buildMs << " ms, " << field.bytes() << " bytes, two small edits " << updateMs << " ms vs rebuild "
+             << rebuildMs << " ms, " << updateFailures << " cells differ" << endl;
+
+        RaySet rays = makeRays(100000, (float)size, 7);
+        AABB denseBox = {glm::vec3(0), glm::vec3((float)size)};
+
+        vector<float> ddaHits(rays.origins.size());
+        vector<float> leapHits(rays.origins.size());
+        vector<float> brickHits(rays.origins.size());
+
+        double ddaMs = timeMilliseconds([&]() {
+            for(size_t i = 0; i < rays.origins.size(); i++) ddaHits[i] = GridTraversal::gridIntersection(dense.data(), denseBox, size, rays.origins[i], rays.directions[i]);
+        });
+
+        double leapMs = timeMilliseconds([&]() {
+            for(size_t i = 0; i < rays.origins.size(); i++) leapHits[i] = GridTraversal::gridIntersection(dense.data(), denseBox, size, rays.origins[i], rays.directions[i], field.data());
+        });
+
+        BrickMap brickMap;
+        brickMap.build(size, [&](int x, int y, int z) { return dense[((size_t)x * size + y) * size + z]; });
+
+        double brickMs = timeMilliseconds([&]() {
+            for(size_t i = 0; i < rays.origins.size(); i++) brickHits[i] = GridTraversal::brickMapIntersection(brickMap.data.data(), brickMap.bricksPerAxis, glm::vec3(0), 1.0f, rays.origins[i], rays.directions[i], nullptr, field.data(), size);
+        });
+
+        int leapMismatches = 0, brickMismatches = 0;
+        for(size_t i = 0; i < rays.origins.size(); i++) {
+            if((ddaHits[i] > 0.0f) != (leapHits[i] > 0.0f) || fabsf(ddaHits[i] - leapHits[i]) > 1e-3f * max(1.0f, ddaHits[i])) leapMismatches++;
+            if((ddaHits[i] > 0.0f) != (brickHits[i] > 0.0f) || fabsf(ddaHits[i] - brickHits[i]) > 1e-3f * max(1.0f, ddaHits[i])) brickMismatches++;
+        }
+
+        cout << "    " << rays.origins.size() << " rays : dense dda " << ddaMs << " ms, with field " << leapMs << " ms (" << leapMismatches << " mismatches), brick map with field "
+             << brickMs << " ms (" << brickMismatches << " mismatches)" << endl;
+    }
+}
+
+void benchmarkPyramid() {
+    cout << "== Occupancy pyramid ==" << endl;
+
+    for(int size : {64, 128, 256}) {
+        vector<int> dense = makeTerrain(size);
+        auto solidAt = [&](int x, int y, int z) { return dense[((size_t)x * size + y) * size + z] != 0; };
+
+        OccupancyPyramid pyramid;
+        double buildMs = timeMilliseconds([&]() { pyramid.build(size, solidAt); });
+
+        BrickMap brickMap;
+        brickMap.build(size, [&](int x, int y, int z) { return dense[((size_t)x * size + y) * size + z]; });
+
+        DistanceField field;
+        field.build(size, 16, solidAt);
+
+        cout << "terrain " << size << "^3 : build " << buildMs << " ms, " << pyramid.levelCount << " levels, " << pyramid.bytes() << " bytes" << endl;
+
+        RaySet rays = makeRays(100000, (float)size, 7);
+        AABB denseBox = {glm::vec3(0), glm::vec3((float)size)};
+
+        vector<float> ddaHits(rays.origins.size());
+        vector<float> pyramidHits(rays.origins.size());
+        vector<float> fieldHits(rays.origins.size());
+
+        double ddaMs = timeMilliseconds([&]() {
+            for(size_t i = 0; i < rays.origins.size(); i++) ddaHits[i] = GridTraversal::gridIntersection(dense.data(), denseBox, size, rays.origins[i], rays.directions[i]);
+        });
+
+        double pyramidMs = timeMilliseconds([&]() {
+            for(size_t i = 0; i < rays.origins.size(); i++) pyramidHits[i] = GridTraversal::pyramidIntersection(pyramid.data.data(), brickMap.data.data(), brickMap.bricksPerAxis, glm::vec3(0), 1.0f, rays.origins[i], rays.directions[i]);
+        });
+
+        double fieldMs = timeMilliseconds([&]() {
+            for(size_t i = 0; i < rays.origins.size(); i++) fieldHits[i] = GridTraversal::pyramidIntersection(pyramid.data.data(), brickMap.data.data(), brickMap.bricksPerAxis, glm::vec3(0), 1.0f, rays.origins[i], rays.directions[i], nullptr, field.data(), size);
+        });
+
+        int pyramidMismatches = 0, fieldMismatches = 0;
+        for(size_t i = 0; i < rays.origins.size(); i++) {
+            if((ddaHits[i] > 0.0f) != (pyramidHits[i] > 0.0f) || fabsf(ddaHits[i] - pyramidHits[i]) > 1e-3f * max(1.0f, ddaHits[i])) pyramidMismatches++;
+            if((ddaHits[i] > 0.0f) != (fieldHits[i] > 0.0f) || fabsf(ddaHits[i] - fieldHits[i]) > 1e-3f * max(1.0f, ddaHits[i])) fieldMismatches++;
+        }
+
+        cout << "    " << rays.origins.size() << " rays : dense dda " << ddaMs << " ms, pyramid " << pyramidMs << " ms (" << pyramidMismatches << " mismatches), pyramid with field "
+             << fieldMs << " ms (" << fieldMismatches << " mismatches)" << endl;
+
+        //A box hit only counts where level 0 of the pyramid has a voxel, then it names that voxel. A box over the whole grid stands in for one that
+        //is out of date with the brick map, so most of its cells are air
+        int boxFailures = 0, boxHits = 0;
+        for(size_t i = 0; i < rays.origins.size(); i++) {
+            glm::ivec3 cell;
+            float t = GridTraversal::solidBoxIntersection(glm::ivec3(0), glm::ivec3(size), rays.origins[i], rays.directions[i], &cell);
+
+            uint32_t hitVoxel = 0xFFFFFFFFu;
+            float hit = GridTraversal::boxHitVoxel(pyramid.data.data(), brickMap.data.data(), brickMap.bricksPerAxis, t, cell, &hitVoxel);
+
+            bool solid = t > 0.0f && GridTraversal::insideCells(cell, size) && solidAt(cell.x, cell.y, cell.z);
+            if((hit > 0.0f) != solid) boxFailures++;
+            if(hit > 0.0f) {
+                boxHits++;
+                glm::ivec3 brick = cell / BRICK_SIZE, local = cell - brick * BRICK_SIZE;
+                uint32_t index = brickMap.data[brickMap.bricksPerAxis * brickMap.bricksPerAxis * brick.x + brickMap.bricksPerAxis * brick.y + brick.z];
+                if(hit != t || hitVoxel != packHitVoxel(index, brickBit(local.x, local.y, local.z))) boxFailures++;
+            }
+            else if(hitVoxel != 0xFFFFFFFFu) boxFailures++;
+        }
+
+        cout << "    box hits through level 0 : " << boxHits << " of " << rays.origins.size() << " rays hit, " << boxFailures << " failures" << endl;
+        if(boxFailures > 0) {
+            cerr << "A box hit was reported where the pyramid has no voxel, or named the wrong voxel" << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+struct IVec3Hash {
+    size_t operator()(glm::ivec3 v) const { return ChunkMap::hash(v); }
+};
+
+void benchmarkChunks() {
+    cout << "== Chunk manager ==" << endl;
+
+    //Random inserts and erases checked against unordered_map, then the same lookups timed on both
+    mt19937 rng(3);
+    uniform_int_distribution<int> coord(-64, 64);
+
+    ChunkMap chunkMap;
+    unordered_map<glm::ivec3, uint32_t, IVec3Hash> reference;
+
+    int failures = 0;
+    for(uint32_t i = 0; i < 200000; i++) {
+        glm::ivec3 key(coord(rng), coord(rng) / 8, coord(rng));
+
+        if(rng() % 3 == 0) {
+            if(chunkMap.erase(key) != (reference.erase(key) == 1)) failures++;
+        }
+        else {
+            chunkMap.insert(key, i);
+            reference[key] = i;
+        }
+    }
+
+    for(const auto& entry : reference) if(chunkMap.find(entry.first) != entry.second) failures++;
+    if(chunkMap.size() != reference.size()) failures++;
+
+    vector<glm::ivec3> queries;
+    for(int i = 0; i < 1000000; i++) queries.push_back(glm::ivec3(coord(rng), coord(rng) / 8, coord(rng)));
+
+    volatile uint32_t sink = 0;
+    double mapMs = timeMilliseconds([&]() { for(glm::ivec3 q : queries) sink = sink + chunkMap.find(q); });
+    double referenceMs = timeMilliseconds([&]() {
+        for(glm::ivec3 q : queries) {
+            auto it = reference.find(q);
+            sink = sink + (it == reference.end() ? ChunkMap::EMPTY : it->second);
+        }
+    });
+
+    cout << reference.size() << " chunks, " << failures << " failures : " << queries.size() << " lookups ChunkMap " << mapMs << " ms, unordered_map " << referenceMs << " ms" << endl;
+
+    //Walk a camera in a straight line over terrain with a budget of roughly two load radii worth of chunks
+    ChunkManager manager;
+    manager.create([](int x, int y, int z) { return terrainVoxel(x & 255, y + 40, z & 255, 256); });
+    manager.loadRadius = 2;
+    manager.verticalRadius = 1;
+    manager.maxLoadsPerUpdate = 1000;
+
+    double updateMs = timeMilliseconds([&]() { manager.update(glm::vec3(0)); });
+    manager.memoryBudget = manager.bytes() * 2;
+
+    double walkMs = 0.0;
+    size_t peakBytes = 0;
+    for(int step = 0; step < 200; step++) {
+        glm::vec3 pos((float)step * 2.0f, 0.0f, (float)step * 0.5f);
+        walkMs += timeMilliseconds([&]() { manager.update(pos); });
+        peakBytes = max(peakBytes, manager.bytes());
+    }
+
+    cout << "first update " << updateMs << " ms, 200 step walk " << walkMs << " ms, " << manager.loadCount << " loads, " << manager.evictCount << " evictions, peak "
+         << peakBytes << " bytes of " << manager.memoryBudget << " budget, " << manager.residentCount() << " resident" << endl;
+}
+
+//Naive bit loop, only here as the reference the fast encoders get checked against
+uint32_t mortonEncodeLoop(uint32_t x, uint32_t y, uint32_t z) {
+    uint32_t code = 0;
+    for(int b = 0; b < 10; b++) code |= (((x >> b) & 1u) << (3 * b + 2)) | (((y >> b) & 1u) << (3 * b + 1)) | (((z >> b) & 1u) << (3 * b));
+    return code;
+}
+
+//step moves an index one voxel along an axis, how a DDA would walk each layout
+struct LinearIndex {
+    int size;
+    uint32_t operator()(int x, int y, int z) const { return ((uint32_t)x * size + y) * size + z; }
+    uint32_t step(uint32_t i, int axis, int dir) const {
+        int stride = axis == 0 ? size * size : (axis == 1 ? size : 1);
+        return i + dir * stride;
+    }
+};
+
+struct MortonIndex {
+    uint32_t operator()(int x, int y, int z) const { return Morton::encode(x, y, z); }
+    uint32_t step(uint32_t i, int axis, int dir) const {
+        uint32_t mask = axis == 0 ? Morton::MASK_X : (axis == 1 ? Morton::MASK_Y : Morton::MASK_Z);
+        return dir > 0 ? Morton::increment(i, mask) : Morton::decrement(i, mask);
+    }
+};
+
+//Walks the whole ray through the grid without stopping, so every layout reads exactly the same voxels. lines collects the 64 byte lines touched
+template<typename Index>
+uint32_t ddaWalk(const uint8_t* voxels, int size, Index index, glm::vec3 origin, glm::vec3 direction, unordered_set<size_t>* lines) {
+    glm::vec3 dir = GridTraversal::safeDirection(direction);
+    glm::vec3 invDir = 1.0f / dir;
+
+    glm::vec3 t0 = -origin * invDir;
+    glm::vec3 t1 = (glm::vec3((float)size) - origin) * invDir;
+    glm::vec3 tmin = glm::min(t0, t1);
+    glm::vec3 tmax = glm::max(t0, t1);
+
+    float tNear = max(max(tmin.x, tmin.y), max(tmin.z, 0.0f));
+    float tFar = min(min(tmax.x, tmax.y), tmax.z);
+    if(tFar < tNear) return 0;
+
+    glm::ivec3 voxel = glm::clamp(glm::ivec3(glm::floor(origin + dir * tNear)), glm::ivec3(0), glm::ivec3(size - 1));
+    glm::ivec3 stepDir(dir.x < 0.0f ? -1 : 1, dir.y < 0.0f ? -1 : 1, dir.z < 0.0f ? -1 : 1);
+    glm::vec3 tDelta = glm::abs(invDir);
+    glm::vec3 tMax = (glm::vec3(voxel) + glm::vec3(glm::greaterThan(stepDir, glm::ivec3(0))) - origin) * invDir;
+
+    uint32_t sum = 0;
+    uint32_t i = index(voxel.x, voxel.y, voxel.z);
+    while(true) {
+        sum += voxels[i];
+        if(lines) lines->insert(i / 64);
+
+        if(tMax.x < tMax.y && tMax.x < tMax.z) {
+            voxel.x += stepDir.x;
+            tMax.x += tDelta.x;
+            if(voxel.x < 0 || voxel.x >= size) break;
+            i = index.step(i, 0, stepDir.x);
+        }
+        else if(tMax.y < tMax.z) {
+            voxel.y += stepDir.y;
+            tMax.y += tDelta.y;
+            if(voxel.y < 0 || voxel.y >= size) break;
+            i = index.step(i, 1, stepDir.y);
+        }
+        else {
+            voxel.z += stepDir.z;
+            tMax.z += tDelta.z;
+            if(voxel.z < 0 || voxel.z >= size) break;
+            i = index.step(i, 2, stepDir.z);
+        }
+    }
+
+    return sum;
+}
+
+//Random walk of single voxel steps along a random axis, the access pattern of flood fills and neighbour queries
+template<typename Index>
+uint32_t randomWalk(const uint8_t* voxels, int size, Index index, const vector<uint8_t>& steps) {
+    int p[3] = {size / 2, size / 2, size / 2};
+    uint32_t sum = 0;
+
+    for(uint8_t step : steps) {
+        int axis = step >> 1;
+        p[axis] = (p[axis] + ((step & 1) ? 1 : size - 1)) % size;
+        sum += voxels[index(p[0], p[1], p[2])];
+    }
+
+    return sum;
+}
+
+template<typename Index>
+vector<uint8_t> layoutVoxels(const vector<int>& dense, int size, Index index, size_t storage) {
+    vector<uint8_t> voxels(storage, 0);
+    for(int x = 0; x < size; x++) {
+        for(int y = 0; y < size; y++) {
+            for(int z = 0; z < size; z++) voxels[index(x, y, z)] = (uint8_t)dense[((size_t)x * size + y) * size + z];
+        }
+    }
+    return voxels;
+}
+
+template<typename Index>
+void benchmarkLayout(const string& name, const vector<uint8_t>& voxels, int size, Index index, const RaySet& rays, const RaySet& xRays, const vector<uint8_t>& steps) {
+    volatile uint32_t sink = 0;
+
+    double randomMs = timeMilliseconds([&]() { sink = sink + randomWalk(voxels.data(), size, index, steps); });
+
+    double ddaMs = timeMilliseconds([&]() {
+        for(size_t i = 0; i < rays.origins.size(); i++) sink = sink + ddaWalk(voxels.data(), size, index, rays.origins[i], rays.directions[i], nullptr);
+    });
+
+    double xMs = timeMilliseconds([&]() {
+        for(size_t i = 0; i < xRays.origins.size(); i++) sink = sink + ddaWalk(voxels.data(), size, index, xRays.origins[i], xRays.directions[i], nullptr);
+    });
+
+    //Distinct cache lines per ray is what decides how much of the walk comes from memory, independent of the machine
+    size_t lineCount = 0, xLineCount = 0;
+    const size_t sampled = 1000;
+    unordered_set<size_t> lines;
+    for(size_t i = 0; i < sampled; i++) {
+        lines.clear();
+        ddaWalk(voxels.data(), size, index, rays.origins[i], rays.directions[i], &lines);
+        lineCount += lines.size();
+        lines.clear();
+        ddaWalk(voxels.data(), size, index, xRays.origins[i], xRays.directions[i], &lines);
+        xLineCount += lines.size();
+    }
+
+    cout << "    " << name << " : random walk " << randomMs << " ms, dda " << ddaMs << " ms (" << (double)lineCount / sampled << " lines/ray), x axis dda "
+         << xMs << " ms (" << (double)xLineCount / sampled << " lines/ray)" << endl;
+}
+
+void benchmarkMorton() {
+    cout << "== Morton layout ==" << endl;
+
+#if defined(__BMI2__)
+    cout << "Morton::encode uses BMI2 pdep/pext" << endl;
+#else
+    cout << "Morton::encode uses lookup tables (build with -mbmi2 for pdep/pext)" << endl;
+#endif
+
+    //Every coordinate of a 1024^3 grid would take too long, 256^3 still covers the table split at bit 8
+    const uint32_t range = 256;
+    int failures = 0;
+    for(uint32_t x = 0; x < range; x += 3) {
+        for(uint32_t y = 0; y < range; y += 5) {
+            for(uint32_t z = 0; z < 1024; z++) {
+                uint32_t code = mortonEncodeLoop(x * 4, y * 4, z);
+                uint32_t dx, dy, dz;
+                Morton::decodeTable(code, dx, dy, dz);
+                if(Morton::encodeTable(x * 4, y * 4, z) != code || Morton::encode(x * 4, y * 4, z) != code || dx != x * 4 || dy != y * 4 || dz != z) failures++;
+                Morton::decode(code, dx, dy, dz);
+                if(dx != x * 4 || dy != y * 4 || dz != z) failures++;
+            }
+        }
+    }
+    for(uint32_t x = 1; x < range - 1; x += 7) {
+        for(uint32_t y = 1; y < range - 1; y += 5) {
+            for(uint32_t z = 1; z < range - 1; z += 3) {
+                uint32_t code = Morton::encode(x, y, z);
+                if(Morton::increment(code, Morton::MASK_X) != Morton::encode(x + 1, y, z) || Morton::decrement(code, Morton::MASK_Y) != Morton::encode(x, y - 1, z) ||
+                   Morton::increment(code, Morton::MASK_Z) != Morton::encode(x, y, z + 1)) failures++;
+            }
+        }
+    }
+    cout << "encode/decode/step round trip : " << failures << " failures" << endl;
+
+    volatile uint32_t sink = 0;
+    const uint64_t encodeCount = (uint64_t)range * range * range;
+
+    double loopMs = timeMilliseconds([&]() {
+        uint32_t acc = 0;
+        for(uint32_t x = 0; x < range; x++) for(uint32_t y = 0; y < range; y++) for(uint32_t z = 0; z < range; z++) acc ^= mortonEncodeLoop(x, y, z);
+        sink = acc;
+    });
+    double tableMs = timeMilliseconds([&]() {
+        uint32_t acc = 0;
+        for(uint32_t x = 0; x < range; x++) for(uint32_t y = 0; y < range; y++) for(uint32_t z = 0; z < range; z++) acc ^= Morton::encodeTable(x, y, z);
+        sink = acc;
+    });
+    double encodeMs = timeMilliseconds([&]() {
+        uint32_t acc = 0;
+        for(uint32_t x = 0; x < range; x++) for(uint32_t y = 0; y < range; y++) for(uint32_t z = 0; z < range; z++) acc ^= Morton::encode(x, y, z);
+        sink = acc;
+    });
+    double decodeMs = timeMilliseconds([&]() {
+        uint32_t acc = 0;
+        for(uint32_t code = 0; code < encodeCount; code++) {
+            uint32_t x, y, z;
+            Morton::decode(code, x, y, z);
+            acc ^= x + y + z;
+        }
+        sink = acc;
+    });
+
+    cout << encodeCount << " encodes : bit loop " << loopMs << " ms, table " << tableMs << " ms, Morton::encode " << encodeMs << " ms, Morton::decode " << decodeMs << " ms" << endl;
+
+    const int size = 256;
+    vector<int> dense = makeTerrain(size);
+
+    LinearIndex linear{size};
+    MortonIndex morton;
+    vector<uint8_t> linearVoxels = layoutVoxels(dense, size, linear, (size_t)size * size * size);
+    vector<uint8_t> mortonVoxels = layoutVoxels(dense, size, morton, (size_t)size * size * size);
+
+    RaySet rays = makeRays(100000, (float)size, 7);
+
+    //Rays along x are the worst case for the linear layout, every step is size * size bytes away
+    RaySet xRays;
+    mt19937 rng(11);
+    uniform_real_distribution<float> position(0.0f, (float)size);
+    for(int i = 0; i < 100000; i++) {
+        xRays.origins.push_back(glm::vec3(-1.0f, position(rng), position(rng)));
+        xRays.directions.push_back(glm::normalize(glm::vec3(1.0f, 0.01f, 0.01f)));
+    }
+
+    vector<uint8_t> steps(1 << 24);
+    for(uint8_t& step : steps) step = (uint8_t)(rng() % 6);
+
+    cout << "terrain " << size << "^3, " << steps.size() << " random steps, " << rays.origins.size() << " rays" << endl;
+    benchmarkLayout("linear", linearVoxels, size, linear, rays, xRays, steps);
+    benchmarkLayout("morton", mortonVoxels, size, morton, rays, xRays, steps);
+}
+
+void benchmarkSVDAG() {
+    cout << "== Sparse voxel DAG ==" << endl;
+
+    for(int size : {64, 128, 256}) {
+        vector<int> dense = makeTerrain(size);
+        auto voxelAt = [&](int x, int y, int z) { return dense[((size_t)x * size + y) * size + z]; };
+
+        SparseVoxelOctree svo;
+        svo.build(size, voxelAt);
+
+        SparseVoxelDAG dag;
+        dag.build(size, voxelAt);
+
+        const SVDAGStats& stats = dag.stats;
+        cout << "terrain " << size << "^3 : build " << stats.buildMilliseconds << " ms (svo " << svo.stats.buildMilliseconds << " ms), "
+             << stats.nodeCount << " nodes for " << stats.treeNodeCount << " tree nodes (" << stats.sharing() << "x sharing), "
+             << stats.bytes << " bytes vs svo " << svo.stats.bytes << " bytes vs dense " << stats.denseBytes << " bytes, "
+             << stats.compressionRatio() << "x over dense, " << (double)svo.stats.bytes / stats.bytes << "x over svo" << endl;
+
+        RaySet rays = makeRays(100000, (float)size, 7);
+        AABB denseBox = {glm::vec3(0), glm::vec3((float)size)};
+        AABB treeBox = {glm::vec3(0), glm::vec3((float)dag.getResolution())};
+
+        vector<float> ddaHits(rays.origins.size());
+        vector<float> svoHits(rays.origins.size());
+        vector<float> dagHits(rays.origins.size());
+        vector<int> svoColours(rays.origins.size(), 0);
+        vector<int> dagColours(rays.origins.size(), 0);
+
+        double ddaMs = timeMilliseconds([&]() {
+            for(size_t i = 0; i < rays.origins.size(); i++) ddaHits[i] = GridTraversal::gridIntersection(dense.data(), denseBox, size, rays.origins[i], rays.directions[i]);
+        });
+
+        double svoMs = timeMilliseconds([&]() {
+            for(size_t i = 0; i < rays.origins.size(); i++) svoHits[i] = svo.traverse(treeBox, rays.origins[i], rays.directions[i], &svoColours[i]);
+        });
+
+        double dagMs = timeMilliseconds([&]() {
+            for(size_t i = 0; i < rays.origins.size(); i++) dagHits[i] = dag.traverse(treeBox, rays.origins[i], rays.directions[i], &dagColours[i]);
+        });
+
+        //Distances are checked against the dense dda, colours against the svo since both report the leaf they stopped at
+        int mismatches = 0, colourMismatches = 0;
+        for(size_t i = 0; i < rays.origins.size(); i++) {
+            if((ddaHits[i] > 0.0f) != (dagHits[i] > 0.0f) || fabsf(ddaHits[i] - dagHits[i]) > 1e-3f * max(1.0f, ddaHits[i])) mismatches++;
+            if(svoHits[i] > 0.0f && dagHits[i] > 0.0f && svoColours[i] != dagColours[i]) colourMismatches++;
+        }
+
+        cout << "    " << rays.origins.size() << " rays : dense dda " << ddaMs << " ms, svo " << svoMs << " ms, dag " << dagMs << " ms, "
+             << mismatches << " mismatches, " << colourMismatches << " colour mismatches" << endl;
+    }
+}
+
+//Surface voxels, solid with at least one air neighbour. Dim is a template argument here so every offset and loop bound is a constant
+template<int Dim>
+uint32_t countSurface(const Voxel* voxels) {
+    uint32_t count = 0;
+    for(int x = 1; x < Dim - 1; x++) {
+        for(int y = 1; y < Dim - 1; y++) {
+            for(int z = 1; z < Dim - 1; z++) {
+                uint32_t i = Grid<Dim>::linearIndex(x, y, z);
+                if(voxels[i].colour == 0) continue;
+
+                if(!voxels[i - 1].colour || !voxels[i + 1].colour || !voxels[i - Dim].colour || !voxels[i + Dim].colour ||
+                   !voxels[i - Dim * Dim].colour || !voxels[i + Dim * Dim].colour) count++;
+            }
+        }
+    }
+    return count;
+}
+
+//Same sweep with the size only known at run time, which is what every lookup paid before Grid took its size as a template argument
+uint32_t countSurface(const Voxel* voxels, int size) {
+    uint32_t count = 0;
+    for(int x = 1; x < size - 1; x++) {
+        for(int y = 1; y < size - 1; y++) {
+            for(int z = 1; z < size - 1; z++) {
+                uint32_t i = ((uint32_t)x * size + y) * size + z;
+                if(voxels[i].colour == 0) continue;
+
+                if(!voxels[i - 1].colour || !voxels[i + 1].colour || !voxels[i - size].colour || !voxels[i + size].colour ||
+                   !voxels[i - size * size].colour || !voxels[i + size * size].colour) count++;
+            }
+        }
+    }
+    return count;
+}
+
+template<int Dim>
+void benchmarkGridSize() {
+    Grid<Dim> grid;
+    grid.create([](int x, int y, int z) { return terrainVoxel(x, y, z, Dim); });
+
+    //volatile so the compiler cannot fold the run time size back in to a constant, or hoist a sweep out of the repeat loop
+    volatile int runtimeSize = Dim;
+    int size = runtimeSize;
+    const Voxel* volatile voxels = grid.data();
+
+    //Every size sweeps the same number of voxels in total
+    int repeats = (int)((64u * 64u * 64u * 16u) / Grid<Dim>::voxelCount);
+    uint32_t constantSurface = 0, runtimeSurface = 0;
+
+    double constantMs = timeMilliseconds([&]() {
+        for(int r = 0; r < repeats; r++) constantSurface += countSurface<Dim>(voxels);
+    });
+
+    double runtimeMs = timeMilliseconds([&]() {
+        for(int r = 0; r < repeats; r++) runtimeSurface += countSurface(voxels, size);
+    });
+
+    BrickMap brickMap;
+    double brickMs = timeMilliseconds([&]() { brickMap.build(grid); });
+
+    cout << "Grid<" << Dim << "> : " << repeats << " surface sweeps, compile time size " << constantMs << " ms, run time size " << runtimeMs << " ms, "
+         << (constantSurface == runtimeSurface ? "same" : "DIFFERENT") << " result, brick map build " << brickMs << " ms" << endl;
+
+    grid.releaseVoxels();
+}
+
+void benchmarkGridSizes() {
+    cout << "== Compile time grid sizes ==" << endl;
+    benchmarkGridSize<16>();
+    benchmarkGridSize<32>();
+    benchmarkGridSize<64>();
+}
+
+void printBVHStats(const BVHStats& stats) {
+    cout << "    bvh : build " << stats.buildMilliseconds << " ms, " << stats.nodeCount << " nodes, " << stats.leafCount << " leaves (" << stats.averageLeafSize() << " boxes/leaf), depth "
+         << stats.maxDepth << ", sah cost " << stats.sahCost << ", " << stats.bytes / 1024.0 << " KB" << endl;
+
+    cout << "    leaves per depth :";
+    for(size_t d = 0; d < stats.depthHistogram.size(); d++) {
+        if(stats.depthHistogram[d]) cout << " " << d << ":" << stats.depthHistogram[d];
+    }
+    cout << endl;
+
+    cout << "    leaves per size :";
+    for(size_t n = 0; n < stats.leafSizeHistogram.size(); n++) {
+        if(stats.leafSizeHistogram[n]) cout << " " << n << ":" << stats.leafSizeHistogram[n];
+    }
+    cout << endl;
+}
+
+void benchmarkBoxes() {
+    cout << "== Merged voxel boxes ==" << endl;
+
+    for(int size : {64, 128}) {
+        vector<int> dense = makeTerrain(size);
+        auto solidAt = [&](int x, int y, int z) { return dense[((size_t)x * size + y) * size + z] != 0; };
+
+        VoxelBoxes boxes;
+        boxes.build(size, solidAt);
+
+        //Every solid voxel in exactly one box and no air in any
+        vector<uint8_t> covered(dense.size(), 0);
+        int coverFailures = 0;
+        for(const VoxelBox& box : boxes.boxes) {
+            for(int x = box.min.x; x < box.max.x; x++) {
+                for(int y = box.min.y; y < box.max.y; y++) {
+                    for(int z = box.min.z; z < box.max.z; z++) {
+                        size_t i = ((size_t)x * size + y) * size + z;
+                        if(covered[i]++ || dense[i] == 0) coverFailures++;
+                    }
+                }
+            }
+        }
+        for(size_t i = 0; i < dense.size(); i++) {
+            if(dense[i] != 0 && !covered[i]) coverFailures++;
+        }
+
+        const VoxelBoxStats& stats = boxes.stats;
+        cout << "terrain " << size << "^3 : build " << stats.buildMilliseconds << " ms, " << stats.boxCount << " boxes for " << stats.solidVoxels << " solid voxels ("
+             << stats.voxelsPerBox() << " voxels/box), " << coverFailures << " cover failures" << endl;
+
+        //Nearest box hit over every box is what the hardware bvh plus the intersection shader work out, it has to agree with the dense dda
+        RaySet rays = makeRays(5000, (float)size, 11);
+        AABB denseBox = {glm::vec3(0), glm::vec3((float)size)};
+
+        int mismatches = 0;
+        double boxMs = 0.0;
+        for(size_t i = 0; i < rays.origins.size(); i++) {
+            float expected = GridTraversal::gridIntersection(dense.data(), denseBox, size, rays.origins[i], rays.directions[i]);
+            float closest = -1.0f;
+
+            boxMs += timeMilliseconds([&]() {
+                for(const VoxelBox& box : boxes.boxes) {
+                    float t = GridTraversal::solidBoxIntersection(box.min, box.max, rays.origins[i], rays.directions[i]);
+                    if(t > 0.0f && (closest < 0.0f || t < closest)) closest = t;
+                }
+            });
+
+            if((expected > 0.0f) != (closest > 0.0f) || fabsf(expected - closest) > 1e-3f * max(1.0f, expected)) mismatches++;
+        }
+
+        cout << "    " << rays.origins.size() << " rays against every box (no bvh) : " << boxMs << " ms, " << mismatches << " mismatches" << endl;
+
+        //Our own bvh over the same boxes has to find the same nearest hit as testing all of them
+        BoxBVH bvh;
+        bvh.build(boxes);
+        printBVHStats(bvh.stats);
+
+        int bvhMismatches = 0;
+        double bvhMs = 0.0;
+        for(size_t i = 0; i < rays.origins.size(); i++) {
+            float closest = -1.0f;
+            for(const VoxelBox& box : boxes.boxes) {
+                float t = GridTraversal::solidBoxIntersection(box.min, box.max, rays.origins[i], rays.directions[i]);
+                if(t > 0.0f && (closest < 0.0f || t < closest)) closest = t;
+            }
+
+            float t = -1.0f;
+            bvhMs += timeMilliseconds([&]() { t = bvh.traverse(rays.origins[i], rays.directions[i]); });
+
+            if(t != closest) bvhMismatches++;
+        }
+
+        cout << "    " << rays.origins.size() << " rays through the bvh : " << bvhMs << " ms, " << bvhMismatches << " mismatches against every box" << endl;
+    }
+
+    //What the chunk manager does: one greedy pass per chunk, chunks on separate threads
+    int size = 256;
+    vector<int> dense = makeTerrain(size);
+    int chunksPerAxis = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    uint32_t chunkCount = (uint32_t)(chunksPerAxis * chunksPerAxis * chunksPerAxis);
+
+    auto buildChunk = [&](uint32_t c, VoxelBoxes& boxes) {
+        glm::ivec3 base = glm::ivec3(c / (chunksPerAxis * chunksPerAxis), (c / chunksPerAxis) % chunksPerAxis, c % chunksPerAxis) * CHUNK_SIZE;
+        boxes.build(CHUNK_SIZE, [&](int x, int y, int z) {
+            glm::ivec3 v = base + glm::ivec3(x, y, z);
+            return GridTraversal::insideCells(v, size) && dense[((size_t)v.x * size + v.y) * size + v.z] != 0;
+        });
+    };
+
+    vector<VoxelBoxes> serial(chunkCount), parallel(chunkCount);
+
+    double serialMs = timeMilliseconds([&]() {
+        for(uint32_t c = 0; c < chunkCount; c++) buildChunk(c, serial[c]);
+    });
+
+    double parallelMs = timeMilliseconds([&]() {
+        parallelFor(chunkCount, [&](uint32_t c) { buildChunk(c, parallel[c]); }, 1);
+    });
+
+    uint64_t boxTotal = 0, voxelTotal = 0;
+    int differ = 0;
+    for(uint32_t c = 0; c < chunkCount; c++) {
+        boxTotal += serial[c].stats.boxCount;
+        voxelTotal += serial[c].stats.solidVoxels;
+        if(serial[c].stats.boxCount != parallel[c].stats.boxCount) differ++;
+    }
+
+    cout << "terrain " << size << "^3 as " << chunkCount << " chunks of " << CHUNK_SIZE << "^3 : " << boxTotal << " boxes for " << voxelTotal << " solid voxels, serial "
+         << serialMs << " ms, parallel " << parallelMs << " ms, " << differ << " chunks differ" << endl;
+
+    //What the blas cache sees: chunks with boxes share one blas, the first of each distinct box set is a miss
+    unordered_map<uint64_t, vector<uint32_t>> byHash;
+    uint32_t instanced = 0, distinct = 0, collisions = 0;
+    for(uint32_t c = 0; c < chunkCount; c++) {
+        const VoxelBoxes& boxes = serial[c];
+        if(boxes.boxes.empty()) continue;
+        instanced++;
+
+        vector<uint32_t>& bucket = byHash[boxes.contentHash];
+        bool shared = false;
+        for(uint32_t other : bucket) {
+            const vector<VoxelBox>& a = serial[other].boxes;
+            bool same = a.size() == boxes.boxes.size();
+            for(size_t i = 0; same && i < a.size(); i++) same = a[i].min == boxes.boxes[i].min && a[i].max == boxes.boxes[i].max;
+            if(same) {
+                shared = true;
+                break;
+            }
+            collisions++;
+        }
+
+        if(!shared) {
+            bucket.push_back(c);
+            distinct++;
+        }
+    }
+
+    cout << "    " << instanced << " non empty chunks over " << distinct << " distinct box sets, blas cache hit rate " << (instanced ? 100.0 * (instanced - distinct) / instanced : 0.0)
+         << "%, " << collisions << " hash collisions" << endl;
+}
+
+//The core of DeviceMemoryAllocator on a made up stream of buffer sizes like the world uploads make, checked against a map of the live ranges
+void benchmarkAllocator() {
+    cout << "== TLSF allocator ==" << endl;
+
+    const uint64_t capacity = 64ull * 1024 * 1024;
+    const uint64_t alignments[] = {16, 64, 256, 4096};
+
+    TlsfAllocator allocator;
+    allocator.create(capacity);
+
+    mt19937 rng(11);
+    uniform_real_distribution<float> logSize(8.0f, 22.0f); //256 bytes to 4 MiB
+    uniform_int_distribution<int> pickAlignment(0, 3);
+
+    struct Live { uint64_t offset; uint64_t size; uint32_t node; };
+    vector<Live> live;
+    map<uint64_t, uint64_t> ranges; //offset -> end of every live allocation
+
+    uint32_t operations = 0, failures = 0, overlaps = 0, misaligned = 0;
+    uint64_t liveBytes = 0;
+    double peakUtilisation = 0.0, fragmentationAtPeak = 0.0;
+
+    auto start = chrono::high_resolution_clock::now();
+
+    for(int i = 0; i < 200000; i++) {
+        operations++;
+
+        //Grows towards full, then churns around it
+        bool allocate = live.empty() || rng() % 100 < 55;
+
+        if(allocate) {
+            uint64_t size = (uint64_t)exp2f(logSize(rng));
+            uint64_t alignment = alignments[pickAlignment(rng)];
+
+            TlsfAllocation a = allocator.allocate(size, alignment);
+            if(a.node == TlsfAllocator::NO_NODE) {
+                failures++;
+                continue;
+            }
+
+            if(a.offset % alignment != 0) misaligned++;
+
+            auto next = ranges.lower_bound(a.offset);
+            if(next != ranges.end() && next->first < a.offset + size) overlaps++;
+            if(next != ranges.begin() && prev(next)->second > a.offset) overlaps++;
+
+            ranges[a.offset] = a.offset + size;
+            live.push_back({a.offset, size, a.node});
+            liveBytes += size;
+        }
+        else {
+            size_t pick = rng() % live.size();
+            allocator.free(live[pick].node);
+            ranges.erase(live[pick].offset);
+            liveBytes -= live[pick].size;
+
+            live[pick] = live.back();
+            live.pop_back();
+        }
+
+        if((i & 1023) == 0) {
+            TlsfStats stats = allocator.stats();
+            if(stats.utilisation() > peakUtilisation) {
+                peakUtilisation = stats.utilisation();
+                fragmentationAtPeak = stats.fragmentation();
+            }
+        }
+    }
+
+    auto end = chrono::high_resolution_clock::now();
+    double ms = chrono::duration<double, milli>(end - start).count();
+
+    TlsfStats stats = allocator.stats();
+    bool countsMatch = stats.usedBytes == liveBytes && stats.allocationCount == live.size();
+
+    cout << "64 MiB block, " << operations << " allocations and frees : " << ms << " ms with the checks, " << failures << " did not fit, " << overlaps << " overlaps, "
+         << misaligned << " misaligned, counts " << (countsMatch ? "match" : "DO NOT MATCH") << endl;
+    cout << "    peak utilisation " << peakUtilisation * 100.0 << "% at " << fragmentationAtPeak * 100.0 << "% fragmentation, end " << stats.utilisation() * 100.0 << "% with "
+         << stats.freeBlockCount << " free blocks, " << stats.fragmentation() * 100.0 << "% fragmentation" << endl;
+
+    for(const Live& l : live) allocator.free(l.node);
+    stats = allocator.stats();
+    cout << "    all freed : " << stats.freeBlockCount << " free block of " << stats.largestFreeBlock << " bytes" << (stats.largestFreeBlock == capacity ? "" : ", NOT MERGED BACK") << endl;
+
+    //Allocator alone, without the map
+    vector<uint32_t> nodes;
+    nodes.reserve(4096);
+    start = chrono::high_resolution_clock::now();
+    for(int round = 0; round < 100; round++) {
+        for(int i = 0; i < 4096; i++) nodes.push_back(allocator.allocate(4096 + (uint64_t)(i % 7) * 1024, 256).node);
+        for(uint32_t node : nodes) allocator.free(node);
+        nodes.clear();
+    }
+    end = chrono::high_resolution_clock::now();
+    cout << "    " << 100 * 4096 << " allocate and free pairs : " << chrono::duration<double, nano>(end - start).count() / (100 * 4096) << " ns per pair" << endl;
+
+    //A dedicated block is sized to its one allocation, so it has to fit exactly, on and off the list boundaries. The rest of a block has to as well
+    //The staging ring, RayTracer::STAGING_RING_SIZE, and a 4K headless readback of rgba16f are both dedicated blocks
+    const uint64_t exactCapacities[] = {32ull * 1024 * 1024 + 4096, 48ull * 1024 * 1024 + 17 * 256, 64ull * 1024 * 1024, 3840ull * 2160 * 8};
+    const uint64_t exactAlignments[] = {1, 16, 256};
+    uint32_t exactFailures = 0;
+
+    for(uint64_t exactCapacity : exactCapacities) {
+        for(uint64_t alignment : exactAlignments) {
+            TlsfAllocator block;
+            block.create(exactCapacity);
+
+            TlsfAllocation whole = block.allocate(exactCapacity, alignment);
+            if(whole.node == TlsfAllocator::NO_NODE || whole.offset != 0 || block.stats().freeBytes != 0) exactFailures++;
+            if(whole.node != TlsfAllocator::NO_NODE) block.free(whole.node);
+
+            TlsfAllocation first = block.allocate(alignment, alignment);
+            TlsfAllocation rest = block.allocate(exactCapacity - alignment, alignment);
+            if(first.node == TlsfAllocator::NO_NODE || rest.node == TlsfAllocator::NO_NODE || block.stats().freeBytes != 0) exactFailures++;
+        }
+    }
+
+    cout << "    exact fits of " << size(exactCapacities) * size(exactAlignments) * 2 << " blocks : " << exactFailures << " failed" << endl;
+    if(exactFailures > 0) {
+        cerr << "TLSF allocator could not fill a block to exact capacity" << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+//The profiler's event ring with every core pushing at once, and a snapshot taken while they do. Every event carries its own checksum, so a torn read shows
+void benchmarkProfiler() {
+    cout << "== Profiler event ring ==" << endl;
+
+    const uint32_t capacityLog2 = 14;
+    const uint32_t perThread = 200000;
+    uint32_t threadCount = max(2u, thread::hardware_concurrency());
+
+    EventRing ring(capacityLog2);
+    atomic<bool> done{false};
+
+    auto check = [](const ProfileEvent& e) { return e.durationNs == e.startNs * 7 + e.thread && e.track == e.thread % 3; };
+
+    //Reads while the writers run, wrapping many times under it
+    uint64_t snapshots = 0, seen = 0, torn = 0;
+    thread reader([&]() {
+        while(!done) {
+            for(const ProfileEvent& e : ring.snapshot()) {
+                seen++;
+                if(!check(e)) torn++;
+            }
+            snapshots++;
+        }
+    });
+
+    auto start = chrono::high_resolution_clock::now();
+
+    vector<thread> writers;
+    for(uint32_t t = 0; t < threadCount; t++) {
+        writers.emplace_back([&, t]() {
+            for(uint32_t i = 0; i < perThread; i++) {
+                uint64_t startNs = (uint64_t)t * perThread + i;
+                ring.push({"event", startNs, startNs * 7 + t, t, t % 3});
+            }
+        });
+    }
+    for(thread& writer : writers) writer.join();
+
+    auto end = chrono::high_resolution_clock::now();
+    done = true;
+    reader.join();
+
+    vector<ProfileEvent> last = ring.snapshot();
+    uint32_t bad = 0;
+    for(const ProfileEvent& e : last) if(!check(e)) bad++;
+
+    uint64_t pushes = (uint64_t)threadCount * perThread;
+    cout << threadCount << " threads, " << pushes << " pushes in to " << ring.capacity() << " slots : " << chrono::duration<double, nano>(end - start).count() / pushes * threadCount
+         << " ns per push per thread, " << snapshots << " snapshots during with " << seen << " events and " << torn << " torn" << endl;
+    cout << "    after : " << last.size() << " events kept of " << ring.pushed() << ", " << ring.dropped() << " dropped on a busy slot, " << bad << " bad" << endl;
+
+    //A torn event is a bug in the ring, not a number to read off
+    if(torn > 0 || bad > 0) {
+        cerr << "Event ring returned " << torn + bad << " torn events" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    //Nearest rank on 1..100 lands on the value itself
+    vector<double> samples;
+    for(int i = 100; i >= 1; i--) samples.push_back(i);
+    Percentiles p = percentiles(samples);
+    cout << "    percentiles of 1..100 : p50 " << p.p50 << ", p95 " << p.p95 << ", p99 " << p.p99 << ((p.p50 == 50 && p.p95 == 95 && p.p99 == 99) ? "" : ", WRONG") << endl;
+
+    //Chrome trace of a few scopes, one object per event plus a name per track
+    for(int i = 0; i < 3; i++) {
+        PROFILE_SCOPE("benchmark \"scope\"");
+    }
+    ostringstream trace;
+    vector<ProfileEvent> scopes = Profiler::events.snapshot();
+    Profiler::writeChromeTrace(trace, scopes);
+    string json = trace.str();
+    size_t objects = 0;
+    for(char c : json) if(c == '}') objects++;
+    cout << "    chrome trace of " << scopes.size() << " scopes : " << json.size() << " bytes, " << objects << " objects" << endl;
+    Profiler::writeSummary(cout, scopes);
+}
+
+void benchmarkFrameWriter() {
+    cout << "== Headless frame writer ==" << endl;
+
+    //1, -2, 65504, the smallest subnormal, infinity and a third
+    const uint16_t halfs[] = {0x3C00, 0xC000, 0x7BFF, 0x0001, 0x7C00, 0x3555};
+    const float expected[] = {1.0f, -2.0f, 65504.0f, ldexp(1.0f, -24), INFINITY, 0.333251953125f};
+    uint32_t wrong = 0;
+    for(int i = 0; i < 6; i++) if(FrameWriter::halfToFloat(halfs[i]) != expected[i]) wrong++;
+    cout << "half to float : " << wrong << " wrong of 6" << endl;
+
+    const uint32_t w = 800, h = 600, frames = 16;
+
+    //A gradient in half floats, red across and green down
+    vector<uint16_t> pixels((size_t)w * h * 4);
+    auto toHalf = [](float value) { return (uint16_t)(value == 0.0f ? 0 : ((int)(log2(value) + 15) << 10) | (uint16_t)((value / exp2(floor(log2(value))) - 1.0f) * 1024.0f)); };
+    for(uint32_t y = 0; y < h; y++) {
+        for(uint32_t x = 0; x < w; x++) {
+            uint16_t* p = &pixels[((size_t)y * w + x) * 4];
+            p[0] = toHalf((float)x / w);
+            p[1] = toHalf((float)y / h);
+            p[2] = 0;
+            p[3] = 0x3C00;
+        }
+    }
+
+    filesystem::path dir = filesystem::temp_directory_path() / "frame_writer_benchmark";
+    filesystem::create_directories(dir);
+
+    FrameWriter writer;
+    writer.start(2);
+
+    auto start = chrono::high_resolution_clock::now();
+    for(uint32_t i = 0; i < frames; i++) writer.write((dir / ("frame_" + to_string(i) + ".ppm")).string(), w, h, pixels.data());
+    auto handedOff = chrono::high_resolution_clock::now();
+    writer.finish();
+    auto end = chrono::high_resolution_clock::now();
+
+    const FrameWriterStats& stats = writer.getStats();
+    cout << frames << " frames of " << w << "x" << h << " : " << chrono::duration<double, milli>(handedOff - start).count() / frames << " ms a frame on the render thread, "
+         << chrono::duration<double, milli>(end - start).count() / frames << " ms a frame to disk, " << stats.frames << " written, " << stats.stalls << " stalls" << endl;
+
+    //The written image against the same conversion done here
+    ifstream file(dir / "frame_0.ppm", ios::binary);
+    string magic;
+    uint32_t fileW = 0, fileH = 0, maxValue = 0;
+    file >> magic >> fileW >> fileH >> maxValue;
+    file.get();
+
+    vector<unsigned char> rgb((size_t)w * h * 3);
+    file.read((char*)rgb.data(), rgb.size());
+
+    uint64_t mismatches = 0;
+    for(size_t i = 0; i < (size_t)w * h; i++) {
+        for(int c = 0; c < 3; c++) {
+            float value = FrameWriter::halfToFloat(pixels[i * 4 + c]);
+            if(rgb[i * 3 + c] != (unsigned char)(clamp(value, 0.0f, 1.0f) * 255.0f + 0.5f)) mismatches++;
+        }
+    }
+    cout << "    " << magic << " " << fileW << "x" << fileH << ", " << mismatches << " mismatched bytes" << (file ? "" : ", SHORT FILE") << endl;
+
+    filesystem::remove_all(dir);
+}
+
+int main() {
+    benchmarkSVO();
+    benchmarkBrickMap();
+    benchmarkMorton();
+    benchmarkDistanceField();
+    benchmarkPyramid();
+    benchmarkChunks();
+    benchmarkSVDAG();
+    benchmarkGridSizes();
+    benchmarkBoxes();
+    benchmarkAllocator();
+    benchmarkProfiler();
+    benchmarkFrameWriter();
+
+    return EXIT_SUCCESS;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "commandBuffer.h"
+#include "memoryAllocator.h"
 #include <cstring>
 #include <cstdint>
 #include <iostream>
@@ -9,29 +10,17 @@
 #include <vulkan/vulkan_core.h>
 
 class Buffer {
-    private:
-
-    uint32_t findMemoryType(VkPhysicalDevice physicalDevice, uint32_t typeFilter, VkMemoryPropertyFlags properties) {
-        VkPhysicalDeviceMemoryProperties memProperties;
-        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
-
-        for(uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
-            if( (typeFilter & (1 << i)) && ( (memProperties.memoryTypes[i].propertyFlags & properties) == properties) ) {
-                return i;
-            }
-        }
-
-        throw std::runtime_error("Failed to find suitable memory type for the buffer");
-    }
-
-
     public:
 
     VkBuffer handle;
-    VkDeviceMemory bufferMemory;
+    DeviceAllocation allocation; //Where in a shared memory block the buffer lives
+
+    //Every buffer takes its memory from here, see DeviceMemoryAllocator
+    static inline DeviceMemoryAllocator allocator;
 
     //ADD SHARING MODES IN FUTURE PLEASE
-    void createBuffer(VkDevice device, VkPhysicalDevice physicalDevice, uint32_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, bool isStaged) {
+    //alignment on top of what the buffer itself needs, for data whose address has to be aligned like a shader binding table
+    void createBuffer(VkDevice device, VkPhysicalDevice physicalDevice, uint32_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, bool isStaged, VkDeviceSize alignment = 1) {
         VkBufferCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
         createInfo.size = (VkDeviceSize)size;
@@ -48,63 +37,24 @@ class Buffer {
         VkMemoryRequirements memoryRequirements;
         vkGetBufferMemoryRequirements(device, handle, &memoryRequirements);
 
+        bool deviceAddress = (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) != 0;
+        allocation = allocator.allocate(device, physicalDevice, memoryRequirements, properties, deviceAddress, alignment);
 
-        VkMemoryAllocateFlagsInfo flagInfo{};
-        flagInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
-        flagInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
-
-        VkMemoryAllocateInfo memoryAllocInfo{};
-        memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        memoryAllocInfo.allocationSize = memoryRequirements.size;
-        memoryAllocInfo.pNext = &flagInfo;
-        memoryAllocInfo.memoryTypeIndex = findMemoryType(physicalDevice, memoryRequirements.memoryTypeBits, properties);
-
-        if(vkAllocateMemory(device, &memoryAllocInfo, nullptr, &bufferMemory) != VK_SUCCESS) {
-            throw std::runtime_error("failed to allocate memory for buffer");
-        }
-
-        if(vkBindBufferMemory(device, handle, bufferMemory, 0) != VK_SUCCESS ) {
+        if(vkBindBufferMemory(device, handle, allocation.memory, allocation.offset) != VK_SUCCESS ) {
             throw std::runtime_error("Failed to bind buffer memory");
         }
     }
 
-    void populateBuffer(VkDevice device, VkPhysicalDevice physicalDevice, const void* data, VkDeviceSize size, VkCommandPool transferPool, VkQueue transferQueue) {
-
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-
-        VkBufferCreateInfo createInfo{};
-        createInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-        createInfo.size = size;
-        createInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-        createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-        if(vkCreateBuffer(device, &createInfo, nullptr, &stagingBuffer) != VK_SUCCESS) {
-            throw std::runtime_error("Faioled to create staging buffer");
-        }
-
-        VkMemoryRequirements memoryRequirements;
-        vkGetBufferMemoryRequirements(device, stagingBuffer, &memoryRequirements);
-
-        VkMemoryAllocateInfo memoryAllocInfo{};
-        memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        memoryAllocInfo.allocationSize = memoryRequirements.size;
-        memoryAllocInfo.memoryTypeIndex = findMemoryType(physicalDevice, memoryRequirements.memoryTypeBits,  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-        if(vkAllocateMemory(device, &memoryAllocInfo, nullptr, &stagingBufferMemory) != VK_SUCCESS) {
-            throw std::runtime_error("failed to allocate memory");
-        }
-
-        if(vkBindBufferMemory(device, stagingBuffer, stagingBufferMemory, 0) != VK_SUCCESS ) {
-            throw std::runtime_error("Failed to bind buffer memory");
-        }
+    //Host visible buffers stay mapped while they live, null for anything else
+    void* mapped() const { return allocation.mapped; }
 
+    //Synchronous upload for one off data at startup. Anything streamed goes through a StagingRing instead
+    void populateBuffer(VkDevice device, VkPhysicalDevice physicalDevice, const void* data, VkDeviceSize size, VkCommandPool transferPool, VkQueue transferQueue) {
 
-        void* dst;
+        Buffer stagingBuffer;
+        stagingBuffer.createBuffer(device, physicalDevice, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false);
 
-        vkMapMemory(device, stagingBufferMemory, 0, size, 0, &dst);
-        memcpy(dst, data, (size_t)size);
-        vkUnmapMemory(device, stagingBufferMemory);
+        memcpy(stagingBuffer.mapped(), data, (size_t)size);
 
         CommandBuffer commandBuffer;
         commandBuffer.createCommandBuffer(device, transferPool);
@@ -115,7 +65,7 @@ class Buffer {
         copyRegion.srcOffset = 0;
         copyRegion.size = size;
 
-        vkCmdCopyBuffer(commandBuffer.handle, stagingBuffer, handle, 1, &copyRegion);
+        vkCmdCopyBuffer(commandBuffer.handle, stagingBuffer.handle, handle, 1, &copyRegion);
 
         commandBuffer.endRecording();
 
@@ -124,13 +74,19 @@ class Buffer {
         submitInfo.commandBufferCount = 1;
         submitInfo.pCommandBuffers = &commandBuffer.handle;
 
-        vkQueueSubmit(transferQueue, 1, &submitInfo, VK_NULL_HANDLE);
-        vkQueueWaitIdle(transferQueue);
+        //Only this copy is waited for, not everything else on the queue
+        VkFenceCreateInfo fenceInfo{};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+        VkFence fence;
+        vkCreateFence(device, &fenceInfo, nullptr, &fence);
+        vkQueueSubmit(transferQueue, 1, &submitInfo, fence);
+        vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+        vkDestroyFence(device, fence, nullptr);
 
         commandBuffer.freeCommandBuffer(device, transferPool);
 
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
+        stagingBuffer.destroy(device);
     }
 
     VkDeviceAddress getBufferAddress(VkDevice device) {
@@ -143,6 +99,7 @@ class Buffer {
 
     void destroy(VkDevice device) {
         vkDestroyBuffer(device, handle, nullptr);
-        vkFreeMemory(device, bufferMemory, nullptr);
+        allocator.free(device, allocation);
+        allocation = DeviceAllocation{};
     }
 };
\ No newline at end of file
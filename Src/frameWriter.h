@@ -0,0 +1,181 @@
+#pragma once
+
+#include "DataStructures/profiler.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct FrameWriterStats {
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    uint64_t stalls = 0; //Times a frame had to wait for the disk because maxQueued frames were still unwritten
+};
+
+//Writes frames read back from the gpu to disk as PPM on a thread of its own, so the render loop only pays for one copy out of the readback buffer.
+//Pixels come in as rgba half floats, the format of the storage image. Pixel buffers are recycled, and at most maxQueued frames wait at once, past
+//that write blocks until the disk catches up rather than growing without bound
+class FrameWriter {
+    public:
+
+    //Only for unwinding past a render that threw, finish is what reports a failed write
+    ~FrameWriter() { stop(); }
+
+    void start(size_t _maxQueued = 4) {
+        maxQueued = std::max<size_t>(_maxQueued, 1);
+        stopping = false;
+        worker = std::thread([this]() { run(); });
+    }
+
+    //Copies width * height rgba half float pixels out of pixels, which is free again once this returns
+    void write(const std::string& path, uint32_t width, uint32_t height, const void* pixels) {
+        size_t halfs = (size_t)width * height * 4;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if(queue.size() >= maxQueued) {
+            stats.stalls++;
+            drained.wait(lock, [this]() { return queue.size() < maxQueued; });
+        }
+
+        std::vector<uint16_t> data;
+        if(!spare.empty()) {
+            data = std::move(spare.back());
+            spare.pop_back();
+        }
+        lock.unlock();
+
+        data.resize(halfs);
+        memcpy(data.data(), pixels, halfs * sizeof(uint16_t));
+
+        lock.lock();
+        queue.push_back({path, width, height, std::move(data)});
+        lock.unlock();
+        queued.notify_one();
+    }
+
+    //Writes out whatever is still queued and stops the thread
+    void finish() {
+        stop();
+
+        spare.clear();
+        if(!error.empty()) throw std::runtime_error(error);
+    }
+
+    //Only read it once finish has returned
+    const FrameWriterStats& getStats() const { return stats; }
+
+    static float halfToFloat(uint16_t half) {
+        uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+        uint32_t exponent = (half >> 10) & 0x1F;
+        uint32_t mantissa = half & 0x3FF;
+
+        uint32_t bits;
+        if(exponent == 0x1F) bits = sign | 0x7F800000 | (mantissa << 13);
+        else if(exponent != 0) bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+        else if(mantissa == 0) bits = sign;
+        else {
+            //Subnormal, shifted up until it has the implicit one of a normal float
+            exponent = 113;
+            while(!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                exponent--;
+            }
+            bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+        }
+
+        float result;
+        memcpy(&result, &bits, sizeof(result));
+        return result;
+    }
+
+    //Same clamp and rounding as CpuRayTracer::writePPM, the alpha is dropped
+    static void writePPM(const std::string& path, uint32_t width, uint32_t height, const uint16_t* pixels) {
+        std::ofstream file(path, std::ios::binary);
+        if(!file.is_open()) throw std::runtime_error("Failed to open image file " + path);
+
+        file << "P6\n" << width << " " << height << "\n255\n";
+
+        std::vector<unsigned char> row(width * 3);
+
+        for(uint32_t y = 0; y < height; y++) {
+            const uint16_t* src = pixels + (size_t)y * width * 4;
+            for(uint32_t x = 0; x < width; x++) {
+                for(int c = 0; c < 3; c++) {
+                    float value = halfToFloat(src[x * 4 + c]);
+                    row[x * 3 + c] = (unsigned char)(std::clamp(value, 0.0f, 1.0f) * 255.0f + 0.5f);
+                }
+            }
+            file.write((const char*)row.data(), row.size());
+        }
+    }
+
+    private:
+
+    struct Frame {
+        std::string path;
+        uint32_t width;
+        uint32_t height;
+        std::vector<uint16_t> pixels;
+    };
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::condition_variable drained;
+
+    std::deque<Frame> queue;
+    std::vector<std::vector<uint16_t>> spare;
+    size_t maxQueued = 4;
+    bool stopping = false;
+
+    FrameWriterStats stats;
+    std::string error; //First failed write, rethrown by finish
+
+    void stop() {
+        if(!worker.joinable()) return;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        queued.notify_one();
+        worker.join();
+    }
+
+    void run() {
+        while(true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            queued.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if(queue.empty()) return;
+
+            Frame frame = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            drained.notify_one();
+
+            bool written = true;
+            try {
+                PROFILE_SCOPE("write frame");
+                writePPM(frame.path, frame.width, frame.height, frame.pixels.data());
+            }
+            catch(const std::exception& e) {
+                written = false;
+                if(error.empty()) error = e.what();
+            }
+
+            lock.lock();
+            if(written) {
+                stats.frames++;
+                stats.bytes += (uint64_t)frame.width * frame.height * 3;
+            }
+            spare.push_back(std::move(frame.pixels));
+        }
+    }
+};
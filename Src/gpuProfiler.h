@@ -0,0 +1,205 @@
+#pragma once
+
+#include "DataStructures/profiler.h"
+#include "commandBuffer.h"
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#include <vulkan/vulkan.h>
+#include <vulkan/vulkan_core.h>
+
+//Times spans of command buffers with a pair of timestamp queries each and hands them to Profiler::events once they have run. Queries are only read
+//back after the timeline value the command buffer signals has been reached, so nothing waits on the gpu and a pair is never read before its reset ran.
+//Gpu timestamps are moved on to the cpu clock with an offset measured once at create, lined up to within one submission's latency
+class GpuProfiler {
+    public:
+
+    static const uint32_t NO_ZONE = 0xFFFFFFFFu;
+
+    uint64_t droppedZones = 0; //Begun while every query pair was still waiting to be read
+
+    //queue and pool are only used for the calibration at create, any queue the zones are recorded for does
+    void create(VkDevice _device, VkPhysicalDevice physicalDevice, VkQueue queue, VkCommandPool pool, uint32_t zoneCapacity = 256) {
+        device = _device;
+
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+        //Without timestamps on every graphics and compute queue the profiler stays off and every call is a no-op
+        enabled = properties.limits.timestampComputeAndGraphics == VK_TRUE;
+        if(!enabled) return;
+
+        timestampPeriod = properties.limits.timestampPeriod;
+
+        VkQueryPoolCreateInfo createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        createInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        createInfo.queryCount = zoneCapacity * 2;
+
+        if(vkCreateQueryPool(device, &createInfo, nullptr, &queryPool) != VK_SUCCESS) throw std::runtime_error("Failed to create timestamp query pool");
+
+        zones.resize(zoneCapacity);
+        for(uint32_t zone = zoneCapacity; zone > 0; zone--) freeZones.push_back(zone - 1);
+
+        calibrate(queue, pool);
+    }
+
+    //Writes the start timestamp once everything recorded before it in commandBuffer has run. Returns what end takes
+    uint32_t begin(VkCommandBuffer commandBuffer, const char* name, uint32_t track) {
+        if(!enabled) return NO_ZONE;
+
+        if(freeZones.empty()) {
+            droppedZones++;
+            return NO_ZONE;
+        }
+
+        uint32_t zone = freeZones.back();
+        freeZones.pop_back();
+
+        zones[zone] = {name, track, commandBuffer, VK_NULL_HANDLE, 0, OPEN};
+
+        vkCmdResetQueryPool(commandBuffer, queryPool, zone * 2, 2);
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, queryPool, zone * 2);
+        return zone;
+    }
+
+    void end(VkCommandBuffer commandBuffer, uint32_t zone) {
+        if(zone == NO_ZONE) return;
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, queryPool, zone * 2 + 1);
+    }
+
+    //The zones recorded in to commandBuffer are done once timeline reaches value
+    void submitted(VkCommandBuffer commandBuffer, VkSemaphore timeline, uint64_t value) {
+        for(Zone& zone : zones) {
+            if(zone.state != OPEN || zone.commandBuffer != commandBuffer) continue;
+
+            zone.timeline = timeline;
+            zone.value = value;
+            zone.state = SUBMITTED;
+        }
+    }
+
+    //Reads back every zone whose submission is done. Cheap, call it once a frame
+    void collect() {
+        if(!enabled) return;
+
+        //Each timeline is asked once, there are only the frame and build ones
+        std::vector<std::pair<VkSemaphore, uint64_t>> reached;
+
+        for(uint32_t i = 0; i < zones.size(); i++) {
+            Zone& zone = zones[i];
+            if(zone.state != SUBMITTED) continue;
+
+            uint64_t completed = 0;
+            bool known = false;
+            for(const std::pair<VkSemaphore, uint64_t>& r : reached) {
+                if(r.first != zone.timeline) continue;
+                completed = r.second;
+                known = true;
+            }
+            if(!known) {
+                vkGetSemaphoreCounterValue(device, zone.timeline, &completed);
+                reached.push_back({zone.timeline, completed});
+            }
+
+            if(completed < zone.value) continue;
+
+            uint64_t timestamps[2];
+            if(vkGetQueryPoolResults(device, queryPool, i * 2, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+                uint64_t start = toCpu(timestamps[0]);
+                uint64_t end = toCpu(timestamps[1]);
+                Profiler::events.push({zone.name, start, end > start ? end - start : 0, 0, zone.track});
+            }
+
+            zone.state = FREE;
+            freeZones.push_back(i);
+        }
+    }
+
+    void destroy() {
+        if(queryPool != VK_NULL_HANDLE) vkDestroyQueryPool(device, queryPool, nullptr);
+        queryPool = VK_NULL_HANDLE;
+        zones.clear();
+        freeZones.clear();
+    }
+
+    private:
+
+    enum ZoneState { FREE, OPEN, SUBMITTED };
+
+    struct Zone {
+        const char* name;
+        uint32_t track;
+        VkCommandBuffer commandBuffer;
+        VkSemaphore timeline;
+        uint64_t value;
+        ZoneState state;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    bool enabled = false;
+
+    VkQueryPool queryPool = VK_NULL_HANDLE;
+    float timestampPeriod = 1.0f; //Nanoseconds per tick
+
+    std::vector<Zone> zones;
+    std::vector<uint32_t> freeZones;
+
+    int64_t gpuToCpu = 0; //Nanoseconds added to a gpu time to get Profiler::now
+
+    uint64_t toCpu(uint64_t ticks) const {
+        int64_t ns = (int64_t)((double)ticks * timestampPeriod) + gpuToCpu;
+        return ns > 0 ? (uint64_t)ns : 0;
+    }
+
+    //One timestamp written on an otherwise idle queue, read against the cpu clock once its fence has signalled
+    void calibrate(VkQueue queue, VkCommandPool pool) {
+        CommandBuffer commandBuffer;
+        commandBuffer.createCommandBuffer(device, pool);
+        commandBuffer.beginRecording(true);
+        vkCmdResetQueryPool(commandBuffer.handle, queryPool, 0, 1);
+        vkCmdWriteTimestamp(commandBuffer.handle, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, 0);
+        commandBuffer.endRecording();
+
+        VkFenceCreateInfo fenceInfo{};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        VkFence fence;
+        if(vkCreateFence(device, &fenceInfo, nullptr, &fence) != VK_SUCCESS) throw std::runtime_error("Failed to create fence");
+
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &commandBuffer.handle;
+
+        if(vkQueueSubmit(queue, 1, &submitInfo, fence) != VK_SUCCESS) throw std::runtime_error("Failed to submit timestamp calibration");
+        vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+        uint64_t cpu = Profiler::now();
+
+        uint64_t ticks = 0;
+        vkGetQueryPoolResults(device, queryPool, 0, 1, sizeof(ticks), &ticks, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+        gpuToCpu = (int64_t)cpu - (int64_t)((double)ticks * timestampPeriod);
+
+        vkDestroyFence(device, fence, nullptr);
+        commandBuffer.freeCommandBuffer(device, pool);
+    }
+};
+
+//Times the commands recorded in to commandBuffer while it is in scope
+class GpuZone {
+    public:
+
+    GpuZone(GpuProfiler& _profiler, VkCommandBuffer _commandBuffer, const char* name, uint32_t track) : profiler(_profiler), commandBuffer(_commandBuffer) {
+        zone = profiler.begin(commandBuffer, name, track);
+    }
+
+    ~GpuZone() { profiler.end(commandBuffer, zone); }
+
+    GpuZone(const GpuZone&) = delete;
+    GpuZone& operator=(const GpuZone&) = delete;
+
+    private:
+
+    GpuProfiler& profiler;
+    VkCommandBuffer commandBuffer;
+    uint32_t zone;
+};
@@ -1,13 +1,131 @@
 #include "application.h"
+#include "RayTracing/cpuRaytracer.h"
 
 #include <cstdlib>
 #include <stdexcept>
 #include <iostream>
+#include <string>
+
+//Renders one frame on the cpu and writes it to disk. Needs no gpu or window
+//usage: application --cpu out.ppm|out.pfm [--size w h] [--pos x y z] [--bvh]
+//Otherwise: application [--host-blas] [--blas-benchmark] [--frames-in-flight n] [--frame-stats], host blas builds for the world, the device against host blas build
+//benchmark instead of the render loop, how many frames the cpu records ahead of the gpu (2 by default) and a report of frame times and cpu/gpu overlap every
+//couple of seconds. --frames-in-flight 1 --frame-stats against the default shows what the overlap buys. --trace out.json writes the profile as a Chrome trace
+//at exit, F9 writes it at any point. --animate bobs every chunk each frame, which refits the tlas every frame, and prints how many refits and builds it took at exit
+//--headless n [--output prefix] [--size w h] renders n frames with no window, surface or swapchain, writes them to prefix_0000.ppm onwards when there is a prefix, and
+//prints the timings. Nothing touches the display server, so it runs on a machine without one, lavapipe included. The headless make target builds it
+//without glfw or X11 linked at all
+int runCpuRenderer(int argc, char** argv) {
+    string outPath = argv[2];
+    uint32_t imgWidth = width;
+    uint32_t imgHeight = height;
+
+    Camera cam;
+    bool useBVH = false;
+
+    for(int i = 3; i < argc; i++) {
+        string arg = argv[i];
+
+        if(arg == "--size" && i + 2 < argc) {
+            imgWidth = (uint32_t)stoul(argv[i + 1]);
+            imgHeight = (uint32_t)stoul(argv[i + 2]);
+            if(imgWidth == 0 || imgHeight == 0) throw runtime_error("The cpu render needs a size of at least 1x1");
+            i += 2;
+        }
+        else if(arg == "--pos" && i + 3 < argc) {
+            cam.setPosition(glm::vec3(stof(argv[i + 1]), stof(argv[i + 2]), stof(argv[i + 3])));
+            i += 3;
+        }
+        else if(arg == "--bvh") {
+            useBVH = true;
+        }
+        else {
+            throw runtime_error("Unknown argument " + arg);
+        }
+    }
+
+    SceneGrid grid;
+    grid.create();
+
+    BrickMap brickMap;
+    brickMap.build(grid);
+
+    DistanceField distanceField;
+    distanceField.build(grid, DISTANCE_FIELD_MAX);
+
+    OccupancyPyramid pyramid;
+    pyramid.build(grid);
+
+    VoxelBoxes boxes;
+    if(useBVH) boxes.build(SCENE_GRID_SIZE, [&grid](int x, int y, int z) { return grid.get(x, y, z).colour != 0; });
+    grid.releaseVoxels();
+
+    CpuRayTracer cpuRaytracer;
+    cpuRaytracer.createRayTracer(brickMap, grid.palette, distanceField, pyramid, glm::vec3(1), 1.0f);
+
+    if(useBVH) {
+        cpuRaytracer.useBoxes(boxes);
+        const BVHStats& bvhStats = cpuRaytracer.getBoxStats();
+        cout << "BVH over " << bvhStats.primitiveCount << " boxes : " << bvhStats.buildMilliseconds << " ms, " << bvhStats.nodeCount << " nodes, depth " << bvhStats.maxDepth << ", sah cost " << bvhStats.sahCost << endl;
+    }
+
+    CameraConstants camCons = CameraConstants::create(cam.viewMatrix(), (float)imgWidth / (float)imgHeight);
+    CpuRenderStats stats = cpuRaytracer.render(camCons, imgWidth, imgHeight);
+
+    if(outPath.size() > 4 && outPath.compare(outPath.size() - 4, 4, ".pfm") == 0) cpuRaytracer.writePFM(outPath);
+    else cpuRaytracer.writePPM(outPath);
+
+    cout << "CPU frame " << imgWidth << "x" << imgHeight << " : " << stats.milliseconds << " ms (" << stats.tileCount << " tiles on " << stats.threadCount << " threads)" << endl;
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char** argv) {
+    try {
+        if(argc >= 3 && string(argv[1]) == "--cpu") return runCpuRenderer(argc, argv);
+    }
+    catch (const std::exception& error) {
+        std::cerr << "Error: " << error.what() << std::endl;
+        return EXIT_FAILURE;
+    }
 
-int main() {
     Application app{};
 
     try {
+        //--output and --size only mean something headless, checked once every argument is in
+        string headlessOnlyArg;
+
+        for(int i = 1; i < argc; i++) {
+            string arg = argv[i];
+
+            if(arg == "--host-blas") app.hostBlasBuilds = true;
+            else if(arg == "--blas-benchmark") app.blasBenchmark = true;
+            else if(arg == "--frame-stats") app.frameStats = true;
+            else if(arg == "--animate") app.animate = true;
+            else if(arg == "--trace" && i + 1 < argc) app.tracePath = argv[++i];
+            else if(arg == "--headless" && i + 1 < argc) {
+                app.headlessFrames = (uint32_t)stoul(argv[++i]);
+                if(app.headlessFrames == 0) throw runtime_error("Need at least one headless frame");
+            }
+            else if(arg == "--output" && i + 1 < argc) {
+                app.headlessOutput = argv[++i];
+                headlessOnlyArg = arg;
+            }
+            else if(arg == "--size" && i + 2 < argc) {
+                app.headlessExtent = { (uint32_t)stoul(argv[i + 1]), (uint32_t)stoul(argv[i + 2]) };
+                if(app.headlessExtent.width == 0 || app.headlessExtent.height == 0) throw runtime_error("Headless frames need a size of at least 1x1");
+                headlessOnlyArg = arg;
+                i += 2;
+            }
+            else if(arg == "--frames-in-flight" && i + 1 < argc) {
+                app.framesInFlight = (uint32_t)stoul(argv[++i]);
+                if(app.framesInFlight == 0) throw runtime_error("Need at least one frame in flight");
+            }
+            else throw runtime_error("Unknown argument " + arg);
+        }
+
+        if(app.headlessFrames == 0 && !headlessOnlyArg.empty()) throw runtime_error("Unknown argument " + headlessOnlyArg + " without --headless");
+
         app.run();
     }
     catch (const std::runtime_error& error) {
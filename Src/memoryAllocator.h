@@ -0,0 +1,227 @@
+#pragma once
+
+#include "DataStructures/tlsfAllocator.h"
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <vulkan/vulkan.h>
+#include <vulkan/vulkan_core.h>
+
+//A range of a shared VkDeviceMemory block
+struct DeviceAllocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    void* mapped = nullptr; //Start of the range when the memory is host visible, blocks stay mapped for as long as they live
+
+    uint32_t pool = 0;
+    uint32_t block = 0;
+    uint32_t node = TlsfAllocator::NO_NODE;
+};
+
+struct DeviceMemoryStats {
+    uint32_t blockCount;
+    uint32_t dedicatedBlockCount;
+    uint32_t allocationCount;
+    uint64_t reservedBytes;
+    uint64_t usedBytes;
+    uint64_t freeBytes;
+    uint64_t largestFreeBytes; //Summed over the blocks, each can only hand out its own largest range
+    uint64_t vkAllocations;    //vkAllocateMemory calls so far
+
+    double utilisation() const { return reservedBytes ? (double)usedBytes / reservedBytes : 0.0; }
+    double fragmentation() const { return freeBytes ? 1.0 - (double)largestFreeBytes / freeBytes : 0.0; }
+};
+
+//Hands out ranges of a few large VkDeviceMemory blocks instead of one allocation per buffer, which is slow and runs in to maxMemoryAllocationCount
+//once every chunk has buffers of its own. There is a pool of blocks per memory type, and per type once more for memory allocated with the device
+//address flag. A TlsfAllocator places the buffers in each block. Requests over half a block get a dedicated block of their own
+class DeviceMemoryAllocator {
+    public:
+
+    VkDeviceSize blockSize = 64ull * 1024 * 1024;
+
+    DeviceAllocation allocate(VkDevice device, VkPhysicalDevice physicalDevice, const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, bool deviceAddress, VkDeviceSize alignment = 1) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if(!haveProperties) {
+            vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+            haveProperties = true;
+        }
+
+        uint32_t memoryType = findMemoryType(requirements.memoryTypeBits, properties);
+        uint32_t poolIndex = memoryType * 2 + (deviceAddress ? 1 : 0);
+        std::vector<Block>& pool = pools[poolIndex];
+
+        alignment = std::max(alignment, requirements.alignment);
+        VkDeviceSize size = requirements.size;
+
+        DeviceAllocation allocation;
+        allocation.pool = poolIndex;
+        allocation.size = size;
+
+        bool dedicated = size > blockSize / 2;
+
+        if(!dedicated) {
+            for(uint32_t b = 0; b < pool.size(); b++) {
+                if(pool[b].memory == VK_NULL_HANDLE || pool[b].dedicated) continue;
+
+                TlsfAllocation range = pool[b].ranges.allocate(size, alignment);
+                if(range.node == TlsfAllocator::NO_NODE) continue;
+
+                place(allocation, pool[b], b, range);
+                return allocation;
+            }
+        }
+
+        uint32_t b = createBlock(device, pool, memoryType, dedicated ? size : blockSize, deviceAddress, dedicated);
+        TlsfAllocation range = pool[b].ranges.allocate(size, alignment);
+        if(range.node == TlsfAllocator::NO_NODE) throw std::runtime_error("Allocation does not fit in a fresh memory block");
+
+        place(allocation, pool[b], b, range);
+        return allocation;
+    }
+
+    //Dedicated blocks go as soon as they are empty, shared ones once another block of the pool is left to take their place
+    void free(VkDevice device, const DeviceAllocation& allocation) {
+        if(allocation.node == TlsfAllocator::NO_NODE) return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        std::vector<Block>& pool = pools[allocation.pool];
+        Block& block = pool[allocation.block];
+        block.ranges.free(allocation.node);
+
+        if(!block.ranges.empty()) return;
+
+        bool otherBlock = false;
+        for(uint32_t b = 0; b < pool.size(); b++) {
+            if(b != allocation.block && pool[b].memory != VK_NULL_HANDLE && !pool[b].dedicated) otherBlock = true;
+        }
+
+        if(block.dedicated || otherBlock) destroyBlock(device, block);
+    }
+
+    DeviceMemoryStats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        DeviceMemoryStats stats{};
+        stats.vkAllocations = vkAllocations;
+
+        for(const std::vector<Block>& pool : pools) {
+            for(const Block& block : pool) {
+                if(block.memory == VK_NULL_HANDLE) continue;
+
+                TlsfStats blockStats = block.ranges.stats();
+                stats.blockCount++;
+                if(block.dedicated) stats.dedicatedBlockCount++;
+                stats.allocationCount += blockStats.allocationCount;
+                stats.reservedBytes += blockStats.capacity;
+                stats.usedBytes += blockStats.usedBytes;
+                stats.freeBytes += blockStats.freeBytes;
+                stats.largestFreeBytes += blockStats.largestFreeBlock;
+            }
+        }
+
+        return stats;
+    }
+
+    void printStats(const char* when) const {
+        DeviceMemoryStats s = stats();
+        std::cout << "Device memory " << when << " : " << s.allocationCount << " buffers in " << s.blockCount << " blocks (" << s.dedicatedBlockCount << " dedicated), "
+                  << s.usedBytes / 1024 << " of " << s.reservedBytes / 1024 << " KiB used, utilisation " << s.utilisation() * 100.0 << "%, fragmentation "
+                  << s.fragmentation() * 100.0 << "%, " << s.vkAllocations << " vkAllocateMemory calls" << std::endl;
+    }
+
+    //Everything has to be freed by now, what is left is reported and freed with its block
+    void destroy(VkDevice device) {
+        DeviceMemoryStats s = stats();
+        if(s.allocationCount > 0) std::cerr << "Device memory : " << s.allocationCount << " buffers still allocated at shutdown" << std::endl;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for(std::vector<Block>& pool : pools) {
+            for(Block& block : pool) {
+                if(block.memory != VK_NULL_HANDLE) destroyBlock(device, block);
+            }
+            pool.clear();
+        }
+    }
+
+    private:
+
+    struct Block {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        void* mapped = nullptr;
+        bool dedicated = false;
+        TlsfAllocator ranges;
+    };
+
+    mutable std::mutex mutex;
+    std::vector<Block> pools[VK_MAX_MEMORY_TYPES * 2];
+
+    VkPhysicalDeviceMemoryProperties memoryProperties{};
+    bool haveProperties = false;
+    uint64_t vkAllocations = 0;
+
+    uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) const {
+        for(uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+            if( (typeFilter & (1 << i)) && ( (memoryProperties.memoryTypes[i].propertyFlags & properties) == properties) ) {
+                return i;
+            }
+        }
+
+        throw std::runtime_error("Failed to find suitable memory type for the buffer");
+    }
+
+    uint32_t createBlock(VkDevice device, std::vector<Block>& pool, uint32_t memoryType, VkDeviceSize size, bool deviceAddress, bool dedicated) {
+        VkMemoryAllocateFlagsInfo flagInfo{};
+        flagInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
+        flagInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+
+        VkMemoryAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = size;
+        allocInfo.pNext = deviceAddress ? &flagInfo : nullptr;
+        allocInfo.memoryTypeIndex = memoryType;
+
+        Block block;
+        if(vkAllocateMemory(device, &allocInfo, nullptr, &block.memory) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate memory block");
+        }
+        vkAllocations++;
+
+        if(memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+            if(vkMapMemory(device, block.memory, 0, VK_WHOLE_SIZE, 0, &block.mapped) != VK_SUCCESS) throw std::runtime_error("Failed to map memory block");
+        }
+
+        block.dedicated = dedicated;
+        block.ranges.create(size);
+
+        //Slots of freed blocks are taken again, so the block index in live allocations stays valid
+        for(uint32_t b = 0; b < pool.size(); b++) {
+            if(pool[b].memory != VK_NULL_HANDLE) continue;
+            pool[b] = block;
+            return b;
+        }
+
+        pool.push_back(block);
+        return (uint32_t)pool.size() - 1;
+    }
+
+    void destroyBlock(VkDevice device, Block& block) {
+        if(block.mapped) vkUnmapMemory(device, block.memory);
+        vkFreeMemory(device, block.memory, nullptr);
+        block = Block{};
+    }
+
+    static void place(DeviceAllocation& allocation, const Block& block, uint32_t b, const TlsfAllocation& range) {
+        allocation.memory = block.memory;
+        allocation.offset = range.offset;
+        allocation.mapped = block.mapped ? (uint8_t*)block.mapped + range.offset : nullptr;
+        allocation.block = b;
+        allocation.node = range.node;
+    }
+};
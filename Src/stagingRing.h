@@ -0,0 +1,185 @@
+#pragma once
+
+#include "buffer.h"
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+#include <vulkan/vulkan.h>
+#include <vulkan/vulkan_core.h>
+
+struct StagingStats {
+    uint64_t bytes = 0;
+    uint64_t copies = 0;
+    uint64_t submissions = 0;
+    uint64_t stalls = 0; //Times an upload had to wait for the gpu to hand ring space back
+};
+
+//One persistently mapped staging buffer used as a ring. Uploads are copied in on the cpu and queued as VkBufferCopy regions, record puts all of them
+//in to one command buffer, a vkCmdCopyBuffer per destination. The submission carrying them signals a value on a timeline semaphore, and their
+//ring space is taken again once the timeline has passed it. Nothing waits on a queue going idle, and the cpu only waits when the ring is full
+class StagingRing {
+    public:
+
+    StagingStats stats;
+
+    //flush is called when the ring is full of uploads that were never recorded. It has to record and submit them, then call submitted
+    void create(VkDevice _device, VkPhysicalDevice physicalDevice, VkDeviceSize _capacity, VkSemaphore _timeline, const std::function<void()>& _flush) {
+        device = _device;
+        capacity = _capacity;
+        timeline = _timeline;
+        flush = _flush;
+
+        ring.createBuffer(device, physicalDevice, capacity, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false);
+        mapped = (uint8_t*)ring.mapped();
+    }
+
+    //Copies data in to the ring and queues the copy to dst. Uploads bigger than half the ring go in pieces
+    void upload(VkBuffer dst, VkDeviceSize dstOffset, const void* data, VkDeviceSize size) {
+        const uint8_t* bytes = (const uint8_t*)data;
+        VkDeviceSize piece = capacity / 2;
+
+        for(VkDeviceSize done = 0; done < size; done += piece) {
+            VkDeviceSize n = std::min(piece, size - done);
+            VkDeviceSize offset = reserve(n);
+            memcpy(mapped + offset, bytes + done, (size_t)n);
+
+            queueCopy(dst, {offset, dstOffset + done, n});
+            stats.bytes += n;
+        }
+    }
+
+    bool empty() const { return pending.empty(); }
+
+    //Every queued copy, then a barrier so whatever comes after in the queue reads the data
+    void record(VkCommandBuffer commandBuffer) {
+        if(pending.empty()) return;
+
+        for(const PendingCopies& copies : pending) {
+            vkCmdCopyBuffer(commandBuffer, ring.handle, copies.dst, (uint32_t)copies.regions.size(), copies.regions.data());
+            stats.copies += copies.regions.size();
+        }
+
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        pending.clear();
+        recorded = true;
+    }
+
+    //The submission with the last recorded copies signals value
+    void submitted(uint64_t value) {
+        if(!recorded) return;
+
+        for(auto it = spans.rbegin(); it != spans.rend() && it->value == 0; ++it) it->value = value;
+        recorded = false;
+        stats.submissions++;
+    }
+
+    //The timeline has to be past everything submitted, the build queue is drained first
+    void destroy() {
+        ring.destroy(device);
+        spans.clear();
+        pending.clear();
+    }
+
+    private:
+
+    //A range of the ring and the timeline value that frees it, 0 until its copies are submitted
+    struct Span {
+        VkDeviceSize begin;
+        VkDeviceSize end;
+        uint64_t value;
+    };
+
+    struct PendingCopies {
+        VkBuffer dst;
+        std::vector<VkBufferCopy> regions;
+    };
+
+    static const VkDeviceSize ALIGNMENT = 16;
+
+    VkDevice device;
+    Buffer ring;
+    uint8_t* mapped = nullptr;
+    VkDeviceSize capacity = 0;
+
+    VkSemaphore timeline = VK_NULL_HANDLE;
+    std::function<void()> flush;
+
+    std::deque<Span> spans; //Oldest first, always one run around the ring
+    std::vector<PendingCopies> pending;
+    bool recorded = false;
+
+    void queueCopy(VkBuffer dst, VkBufferCopy region) {
+        for(PendingCopies& copies : pending) {
+            if(copies.dst != dst) continue;
+            copies.regions.push_back(region);
+            return;
+        }
+
+        pending.push_back({dst, {region}});
+    }
+
+    void reclaim() {
+        if(spans.empty() || spans.front().value == 0) return;
+
+        uint64_t completed = 0;
+        vkGetSemaphoreCounterValue(device, timeline, &completed);
+        while(!spans.empty() && spans.front().value != 0 && spans.front().value <= completed) spans.pop_front();
+    }
+
+    //Waits for the oldest span, submitting it first when it is still only queued
+    void waitOldest() {
+        stats.stalls++;
+        if(spans.front().value == 0) flush();
+
+        uint64_t value = spans.front().value;
+        if(value == 0) throw std::runtime_error("Staging ring flush did not submit its copies");
+
+        VkSemaphoreWaitInfo waitInfo{};
+        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        waitInfo.semaphoreCount = 1;
+        waitInfo.pSemaphores = &timeline;
+        waitInfo.pValues = &value;
+        vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+    }
+
+    VkDeviceSize reserve(VkDeviceSize size) {
+        size = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+        while(true) {
+            reclaim();
+
+            if(spans.empty()) {
+                spans.push_back({0, size, 0});
+                return 0;
+            }
+
+            VkDeviceSize tail = spans.front().begin;
+            VkDeviceSize head = spans.back().end;
+            bool wrapped = spans.back().begin < tail;
+
+            //Not wrapped the free space is behind head and in front of tail, wrapped it is between the two
+            if(!wrapped && capacity - head >= size) {
+                spans.push_back({head, head + size, 0});
+                return head;
+            }
+            if(!wrapped && tail >= size) {
+                spans.push_back({0, size, 0});
+                return 0;
+            }
+            if(wrapped && tail - head >= size) {
+                spans.push_back({head, head + size, 0});
+                return head;
+            }
+
+            waitOldest();
+        }
+    }
+};
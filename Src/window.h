@@ -0,0 +1,9 @@
+#pragma once
+
+//The one place glfw comes in. A HEADLESS_ONLY build has no window at all, it links neither glfw nor any of X11 and only runs --headless
+#ifdef HEADLESS_ONLY
+struct GLFWwindow;
+#else
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+#endif
@@ -1,16 +1,32 @@
-file := Src/main.cpp Src/application.cpp Src/RayTracing/raytracer.cpp 
+file := Src/main.cpp Src/application.cpp Src/RayTracing/raytracer.cpp Src/RayTracing/cpuRaytracer.cpp 
+benchFile := Src/benchmark.cpp
 shaders := Shaders/intersection.rint Shaders/closestHit.rchit Shaders/miss.rmiss Shaders/raygen.rgen
 
 cFlags := -std=c++17 -O2
-ldFlags := -lglfw -lvulkan -ldl -lpthread -lX11 -lXxf86vm -lXrandr -lXi
+#glfw brings in whatever its window system needs itself
+ldFlags := -lglfw -lvulkan -ldl -lpthread
+headlessLdFlags := -lvulkan -ldl -lpthread
 
-application: $(file) $(shaders)
-	rm -f application Shaders/raygen.spv Shaders/closestHit.spv Shaders/miss.spv Shaders/intersection.spv
+application: $(file) spirv
+	rm -f application
+	g++ $(cFlags) -o application $(file) $(ldFlags)
+
+#No window at all, so neither glfw nor X11 has to be on the machine. Only runs --headless, for CI and batch rendering
+headless: $(file) spirv
+	rm -f application
+	g++ $(cFlags) -DHEADLESS_ONLY -o application $(file) $(headlessLdFlags)
+
+spirv: $(shaders)
+	rm -f Shaders/raygen.spv Shaders/closestHit.spv Shaders/miss.spv Shaders/intersection.spv
 	glslc --target-spv=spv1.5 Shaders/raygen.rgen -o Shaders/raygen.spv
 	glslc --target-spv=spv1.5 Shaders/closestHit.rchit -o Shaders/closestHit.spv
 	glslc --target-spv=spv1.5 Shaders/miss.rmiss -o Shaders/miss.spv
 	glslc --target-spv=spv1.5 Shaders/intersection.rint -o Shaders/intersection.spv
-	g++ $(cFlags) -o application $(file) $(ldFlags)
+
+benchmark: $(benchFile)
+	g++ $(cFlags) -o benchmark $(benchFile) -lpthread
 
 clean: 
-	rm -f application Shaders/raygen.spv Shaders/closestHit.spv Shaders/miss.spv Shaders/intersection.spv
\ No newline at end of file
+	rm -f application benchmark Shaders/raygen.spv Shaders/closestHit.spv Shaders/miss.spv Shaders/intersection.spv
+
+.PHONY: headless spirv clean